@@ -7,6 +7,7 @@
 #include <Logs.h>
 #include <State.h>
 #include <Version.h>
+#include <Trace.h>
 
 #include <stddef.h>
 #ifdef QBDI_OS_WIN
@@ -43,20 +44,39 @@ FORCE_EXPORT_C(setFPRState)
 FORCE_EXPORT_C(addMnemonicCB)
 FORCE_EXPORT_C(addMemAccessCB)
 FORCE_EXPORT_C(addMemAddrCB)
+FORCE_EXPORT_C(addMemAccessListCB)
 FORCE_EXPORT_C(addMemRangeCB)
 FORCE_EXPORT_C(addCodeCB)
 FORCE_EXPORT_C(addCodeAddrCB)
 FORCE_EXPORT_C(addCodeRangeCB)
+FORCE_EXPORT_C(addInlineCounter)
+FORCE_EXPORT_C(addInlineAddrCounter)
+FORCE_EXPORT_C(getInlineCounter)
+FORCE_EXPORT_C(getInlineCounters)
+FORCE_EXPORT_C(resetInlineCounters)
+FORCE_EXPORT_C(setInlineBBCounters)
+FORCE_EXPORT_C(getInlineBBCounter)
+FORCE_EXPORT_C(getInlineBBCounters)
+FORCE_EXPORT_C(setCoverageMap)
+FORCE_EXPORT_C(setBlockTrace)
+FORCE_EXPORT_C(flushBlockTrace)
 FORCE_EXPORT_C(addVMEventCB)
 FORCE_EXPORT_C(deleteInstrumentation)
 FORCE_EXPORT_C(deleteAllInstrumentations)
 FORCE_EXPORT_C(getInstAnalysis)
 FORCE_EXPORT_C(recordMemoryAccess)
+FORCE_EXPORT_C(setMemTrace)
+FORCE_EXPORT_C(flushMemTrace)
 FORCE_EXPORT_C(getInstMemoryAccess)
 FORCE_EXPORT_C(getBBMemoryAccess)
+FORCE_EXPORT_C(fillInstMemoryAccess)
+FORCE_EXPORT_C(fillBBMemoryAccess)
 FORCE_EXPORT_C(precacheBasicBlock)
 FORCE_EXPORT_C(clearCache)
 FORCE_EXPORT_C(clearAllCache)
+FORCE_EXPORT_C(setCacheBudget)
+FORCE_EXPORT_C(setCacheStatistics)
+FORCE_EXPORT_C(getCacheStatistics)
 
 // Logs
 FORCE_EXPORT_C(setLogOutput)
@@ -74,6 +94,9 @@ FORCE_EXPORT_C(simulateCallA)
 static const void* dummy__getModuleNames1 _QBDI_FORCE_USE = (const void*) (std::vector<std::string> (*)())&(QBDI::getModuleNames);
 static const void* dummy__getModuleNames2 _QBDI_FORCE_USE = (const void*) (char** (*)(size_t*))&(QBDI::getModuleNames);
 
+// Trace (the writer and the reader share the same object)
+static const void* dummy__TraceWriter _QBDI_FORCE_USE = (const void*) &(QBDI::TraceWriter::blockTraceCallback);
+
 // Helpers
 #ifdef __cplusplus
 namespace QBDI {
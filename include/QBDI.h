@@ -20,6 +20,7 @@
 
 #ifdef __cplusplus
 #include "QBDI/VM.h"
+#include "QBDI/Trace.h"
 #else
 #include "QBDI/VM_C.h"
 #endif
@@ -18,6 +18,8 @@
 #ifndef _CALLBACK_H_
 #define _CALLBACK_H_
 
+#include <stddef.h>
+
 #include "Platform.h"
 #include "State.h"
 #include "Bitmask.h"
@@ -109,6 +111,21 @@ typedef struct {
  */
 typedef VMAction (*VMCallback)(VMInstanceRef vm, const VMState *vmState, GPRState *gprState, FPRState *fprState, void *data);
 
+/*! Execution statistics of the translation cache, counted by the VM once enabled with
+ *  setCacheStatistics.
+ */
+typedef struct {
+    uint64_t dispatches;     /*!< Sequences executed from the VM. The sequences reached through
+                              *   direct chaining, the indirect branch cache, the shadow return
+                              *   stack or inside a trace are not counted.
+                              */
+    uint64_t indirectFills;  /*!< Targets added to the indirect branch caches after a miss.*/
+    uint64_t traces;         /*!< Hot traces formed.*/
+    uint64_t hostCalls;      /*!< Breaks to the host to call an instrumentation callback, including
+                              *   the internal gates of the memory range callbacks.
+                              */
+} CacheStatistics;
+
 static const uint16_t NO_REGISTRATION = 0xFFFF;
 static const uint16_t NOT_FOUND = 0xFFFF;
 static const uint16_t ANY = 0xFFFF;
@@ -133,6 +150,44 @@ typedef struct {
     MemoryAccessType type; /*!< Memory access type (READ / WRITE) */
 } MemoryAccess;
 
+/*! Memory access callback function type.
+ *
+ * @param[in] vm            VM instance of the callback.
+ * @param[in] gprState      A structure containing the state of the General Purpose Registers. Modifying
+ *                          it affects the VM execution accordingly.
+ * @param[in] fprState      A structure containing the state of the Floating Point Registers. Modifying
+ *                          it affects the VM execution accordingly.
+ * @param[in] accesses      The memory accesses of the instruction matching the registered type. The
+ *                          array is only valid until the end of the callback.
+ * @param[in] count         The number of elements of accesses.
+ * @param[in] data          User defined data which can be defined when registering the callback.
+ *
+ * @return                  The callback result used to signal subsequent actions the VM needs to take.
+ */
+typedef VMAction (*MemAccessListCallback)(VMInstanceRef vm, GPRState *gprState, FPRState *fprState,
+                                          const MemoryAccess *accesses, size_t count, void *data);
+
+/*! Memory trace flush callback function type.
+ *
+ * @param[in] vm            VM instance of the callback.
+ * @param[in] accesses      The memory accesses recorded since the previous flush, in execution order.
+ *                          The array is only valid until the end of the callback.
+ * @param[in] count         The number of elements of accesses.
+ * @param[in] data          User defined data which can be defined when enabling the trace.
+ */
+typedef void (*MemTraceCallback)(VMInstanceRef vm, const MemoryAccess *accesses, size_t count, void *data);
+
+/*! Basic block trace flush callback function type.
+ *
+ * @param[in] vm            VM instance of the callback.
+ * @param[in] blocks        The start addresses of the basic blocks executed since the previous
+ *                          flush, in execution order. The array is only valid until the end of the
+ *                          callback.
+ * @param[in] count         The number of elements of blocks.
+ * @param[in] data          User defined data which can be defined when enabling the trace.
+ */
+typedef void (*BlockTraceCallback)(VMInstanceRef vm, const rword *blocks, size_t count, void *data);
+
 #ifdef __cplusplus
 } // QBDI::
 #endif
@@ -0,0 +1,75 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "Platform.h"
+#include "Bitmask.h"
+
+#ifdef __cplusplus
+namespace QBDI {
+#endif
+
+/*! VM execution options (bitfield).
+ */
+typedef enum {
+    _QBDI_EI(NO_OPT)              = 0,    /*!< Default value */
+    _QBDI_EI(OPT_DIRECT_CHAINING) = 1<<0, /*!< Link cached sequences with static successors together
+                                           *   so they can be executed without returning to the VM.
+                                           *   Dynamic exits (indirect jumps, calls and returns) go
+                                           *   through a small indirect branch target cache and
+                                           *   returns are predicted using a shadow return stack.
+                                           *   Chaining is automatically disabled while sequence or
+                                           *   basic block VMEvent callbacks are registered.
+                                           */
+    _QBDI_EI(OPT_HOT_TRACES)      = 1<<1, /*!< Retranslate the most frequent path starting from hot
+                                           *   sequences as a single superblock with side exits.
+                                           *   Disabled under the same conditions as
+                                           *   OPT_DIRECT_CHAINING.
+                                           */
+    _QBDI_EI(OPT_LAZY_FPR)        = 1<<2, /*!< Only switch the FPU and vector registers state between
+                                           *   the host and the guest when entering or leaving an
+                                           *   ExecBlock whose guest code uses it. The FPRState
+                                           *   seen by callbacks and by the VM API stays accurate.
+                                           */
+    _QBDI_EI(OPT_PAGE_WATCH)      = 1<<3, /*!< Implement the memory range callbacks registered
+                                           *   afterwards by protecting the watched pages instead
+                                           *   of instrumenting every memory access (Linux X86_64
+                                           *   only). Read callbacks are called before the access
+                                           *   and write callbacks after it, their VMAction is
+                                           *   ignored. The watched pages should not hold data
+                                           *   used by the VM or by the callbacks. The protections
+                                           *   are process wide: only one thread should run
+                                           *   instrumented code while the option is in use.
+                                           */
+    _QBDI_EI(OPT_HUGE_PAGES)      = 1<<4, /*!< Carve the ExecBlocks out of 2MB code arenas instead
+                                           *   of mapping each of them, reducing the mmap calls
+                                           *   when instrumenting large binaries. On Linux the
+                                           *   arenas are backed by transparent huge pages when the
+                                           *   system grants them, reducing the iTLB misses
+                                           *   (X86_64 only, ignored on iOS).
+                                           */
+} Options;
+
+_QBDI_ENABLE_BITMASK_OPERATORS(Options)
+
+#ifdef __cplusplus
+} // QBDI::
+#endif
+
+#endif // _OPTIONS_H_
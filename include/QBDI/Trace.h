@@ -0,0 +1,292 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "Platform.h"
+#include "State.h"
+#include "Callback.h"
+#include "Range.h"
+#include "Memory.h"
+
+namespace QBDI {
+
+/*! Type of a trace record.
+ */
+typedef enum {
+    _QBDI_EI(TRACE_BASIC_BLOCK) = 1,   /*!< Entry of a basic block */
+    _QBDI_EI(TRACE_MEMORY_ACCESS) = 2, /*!< Memory access */
+    _QBDI_EI(TRACE_REGISTERS) = 3,     /*!< General purpose registers, stored as a delta */
+    _QBDI_EI(TRACE_MODULE) = 4         /*!< Module loaded in the process */
+} TraceRecordType;
+
+/*! A decoded trace record. Only the fields of the record type are meaningful.
+ */
+struct TraceRecord {
+    TraceRecordType type;  /*!< Type of the record. */
+    rword address;         /*!< TRACE_BASIC_BLOCK: start address of the basic block. */
+    MemoryAccess access;   /*!< TRACE_MEMORY_ACCESS: the memory access. */
+    GPRState gprState;     /*!< TRACE_REGISTERS: the registers once the delta is applied. */
+    MemoryMap module;      /*!< TRACE_MODULE: the memory map of the module. */
+};
+
+/*! Writer of the binary trace format.
+ *
+ * The file is a header followed by independent chunks of records. Inside a chunk, the addresses
+ * are delta encoded against the previous record of the same kind, the registers against the
+ * previous register record, and every integer is varint encoded. The delta state is reset at
+ * each chunk start such that a reader can start decoding at any chunk. An index of the chunks
+ * is appended when the writer is closed, a trace without index (for example because the traced
+ * process crashed) can still be read up to its last complete chunk.
+ *
+ * The static callbacks allow to feed the writer directly from the VM, the data parameter being
+ * the TraceWriter. When fed by the trace buffers, the basic blocks and the memory accesses are
+ * each in execution order but are only interleaved at the granularity of the buffer flushes.
+ */
+class QBDI_EXPORT TraceWriter {
+private:
+
+    struct ChunkIndex {
+        uint64_t offset;
+        uint64_t firstRecord;
+    };
+
+    FILE*                   file;
+    size_t                  chunkSize;
+    std::vector<uint8_t>    chunk;
+    uint32_t                chunkRecords;
+    uint64_t                records;
+    uint64_t                offset;
+    std::vector<ChunkIndex> index;
+    rword                   prevBlock;
+    rword                   prevInst;
+    rword                   prevAccess;
+    GPRState                prevGPR;
+
+    void writeVarint(uint64_t value);
+    void writeSigned(rword current, rword previous);
+    void endRecord();
+    bool writeChunk();
+    void resetDelta();
+
+public:
+
+    /*! Construct a new writer.
+     *
+     * @param[in] chunkSize  The payload size after which a chunk is written to the file.
+     */
+    TraceWriter(size_t chunkSize = 1 << 20);
+
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    /*! Create a trace file, closing the previous one.
+     *
+     * @param[in] path  The path of the trace file.
+     *
+     * @return True if the file was created.
+     */
+    bool open(const char* path);
+
+    /*! Write the pending records and the chunk index, then close the file.
+     *
+     * @return True if everything was written.
+     */
+    bool close();
+
+    /*! Write the pending records to the file as a new chunk.
+     *
+     * @return True if the chunk was written.
+     */
+    bool flush();
+
+    /*! Check if a trace file is open.
+     *
+     * @return True if a file is open.
+     */
+    bool isOpen() const { return file != nullptr; }
+
+    /*! Get the number of records written since the file was opened.
+     *
+     * @return The number of records.
+     */
+    uint64_t getRecordCount() const { return records; }
+
+    /*! Append a basic block entry.
+     *
+     * @param[in] address  The start address of the basic block.
+     */
+    void writeBasicBlock(rword address);
+
+    /*! Append basic block entries.
+     *
+     * @param[in] blocks  The start addresses of the basic blocks.
+     * @param[in] count   The number of elements of blocks.
+     */
+    void writeBasicBlocks(const rword* blocks, size_t count);
+
+    /*! Append a memory access.
+     *
+     * @param[in] access  The memory access.
+     */
+    void writeMemoryAccess(const MemoryAccess& access);
+
+    /*! Append memory accesses.
+     *
+     * @param[in] accesses  The memory accesses.
+     * @param[in] count     The number of elements of accesses.
+     */
+    void writeMemoryAccesses(const MemoryAccess* accesses, size_t count);
+
+    /*! Append the general purpose registers. Only the registers which changed since the previous
+     *  register record are stored.
+     *
+     * @param[in] gprState  The general purpose registers.
+     */
+    void writeRegisters(const GPRState* gprState);
+
+    /*! Append a module load event.
+     *
+     * @param[in] module  The memory map of the module.
+     */
+    void writeModule(const MemoryMap& module);
+
+    /*! A BlockTraceCallback appending the basic blocks to the TraceWriter given as data.
+     */
+    static void blockTraceCallback(VMInstanceRef vm, const rword* blocks, size_t count, void* data);
+
+    /*! A MemTraceCallback appending the memory accesses to the TraceWriter given as data.
+     */
+    static void memTraceCallback(VMInstanceRef vm, const MemoryAccess* accesses, size_t count, void* data);
+
+    /*! An InstCallback appending the registers to the TraceWriter given as data.
+     */
+    static VMAction registersCallback(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data);
+
+    /*! A VMCallback appending the basic block entries to the TraceWriter given as data.
+     */
+    static VMAction basicBlockCallback(VMInstanceRef vm, const VMState* vmState, GPRState* gprState,
+                                       FPRState* fprState, void* data);
+};
+
+struct TraceFile;
+
+/*! Reader of the binary trace format. The file is memory mapped and the records are decoded on
+ *  the fly by the iterators.
+ */
+class QBDI_EXPORT TraceReader {
+private:
+
+    TraceFile* traceFile;
+
+public:
+
+    /*! Iterator over the records of a trace. The reference is only valid until the iterator is
+     *  incremented.
+     */
+    class QBDI_EXPORT iterator : public std::iterator<std::input_iterator_tag, TraceRecord> {
+    private:
+
+        const TraceFile* traceFile;
+        size_t           chunk;
+        const uint8_t*   cursor;
+        const uint8_t*   end;
+        uint32_t         remaining;
+        uint64_t         position;
+        TraceRecord      record;
+
+        void loadChunk(size_t chunk);
+        void decode();
+
+    public:
+
+        iterator();
+        iterator(const TraceFile* traceFile, size_t chunk);
+
+        /*! Get the position of the current record in the trace.
+         *
+         * @return The index of the record.
+         */
+        uint64_t getPosition() const { return position; }
+
+        const TraceRecord& operator*() const { return record; }
+        const TraceRecord* operator->() const { return &record; }
+        iterator& operator++();
+        bool operator==(const iterator& other) const { return position == other.position; }
+        bool operator!=(const iterator& other) const { return position != other.position; }
+    };
+
+    TraceReader();
+
+    ~TraceReader();
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    /*! Map a trace file, closing the previous one.
+     *
+     * @param[in] path  The path of the trace file.
+     *
+     * @return True if the file is a valid trace of this architecture.
+     */
+    bool open(const char* path);
+
+    /*! Unmap the trace file.
+     */
+    void close();
+
+    /*! Get the number of complete chunks of the trace.
+     *
+     * @return The number of chunks.
+     */
+    size_t getChunkCount() const;
+
+    /*! Get the number of records of the trace.
+     *
+     * @return The number of records.
+     */
+    uint64_t getRecordCount() const;
+
+    /*! Get an iterator on the first record.
+     */
+    iterator begin() const;
+
+    /*! Get the end iterator.
+     */
+    iterator end() const;
+
+    /*! Get an iterator on a record. Only the chunk of the record is decoded.
+     *
+     * @param[in] position  The index of the record in the trace.
+     *
+     * @return An iterator on the record, or the end iterator if the position is out of the trace.
+     */
+    iterator seek(uint64_t position) const;
+};
+
+}
+
+#endif // _TRACE_H_
@@ -18,6 +18,7 @@
 #ifndef _VM_H_
 #define _VM_H_
 
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,6 +29,7 @@
 #include "Errors.h"
 #include "State.h"
 #include "InstAnalysis.h"
+#include "Options.h"
 
 namespace QBDI {
 
@@ -37,6 +39,18 @@ class Engine;
 class InstrRule;
 // Forward declaration of private memCBInfo
 struct MemCBInfo;
+// Forward declaration of private MemAccessListCBInfo
+struct MemAccessListCBInfo;
+// Forward declaration of private RangeIndex
+template<typename T> class RangeIndex;
+// Forward declaration of private MemRangeFilter
+struct MemRangeFilter;
+// Forward declaration of private PageWatch
+class PageWatch;
+// Forward declaration of private MemTraceInfo
+struct MemTraceInfo;
+// Forward declaration of private BlockTraceInfo
+struct BlockTraceInfo;
 
 class QBDI_EXPORT VM {
     private:
@@ -44,17 +58,33 @@ class QBDI_EXPORT VM {
     Engine*     engine;
     uint8_t  memoryLoggingLevel;
     std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos;
+    RangeIndex<MemCBInfo>* memCBIndex;
+    MemRangeFilter* memReadFilter;
+    MemRangeFilter* memWriteFilter;
+    MemRangeFilter* memReadWriteFilter;
+    PageWatch* pageWatch;
+    std::map<uint32_t, uint64_t*>* inlineCounters;
+    std::map<rword, uint64_t>* blockCounters;
+    std::vector<std::pair<uint32_t, uint64_t*>>* releasedCounters;
+    std::vector<std::pair<uint32_t, MemAccessListCBInfo*>>* memAccessListCBInfos;
+    std::vector<std::pair<uint32_t, MemAccessListCBInfo*>>* releasedCBInfos;
+    MemTraceInfo* memTrace;
+    BlockTraceInfo* blockTrace;
     uint32_t memCBID;
     uint32_t memReadGateCBID;
     uint32_t memWriteGateCBID;
 
+    void updateMemRangeCBs();
+    void releaseFlushed();
+
     public:
     /*! Construct a new VM for a given CPU with specific attributes
      *
-     * @param[in] cpu    The name of the CPU
-     * @param[in] mattrs A list of additional attributes
+     * @param[in] cpu     The name of the CPU
+     * @param[in] mattrs  A list of additional attributes
+     * @param[in] options The execution options of the VM
      */
-    VM(const std::string& cpu = "", const std::vector<std::string>& mattrs = {});
+    VM(const std::string& cpu = "", const std::vector<std::string>& mattrs = {}, Options options = NO_OPT);
 
     ~VM();
 
@@ -82,6 +112,49 @@ class QBDI_EXPORT VM {
      */
     void        setFPRState(FPRState* fprState);
 
+    /*! Get the current Options of the VM
+     *
+     * @return The current options.
+     */
+    Options     getOptions() const;
+
+    /*! Set the Options of the VM. Changing the options clears the translation cache.
+     *
+     * @param[in] options The new options of the VM.
+     */
+    void        setOptions(Options options);
+
+    /*! Enable the edge coverage instrumentation. The entry of every basic block increments the
+     *  byte of the bitmap indexed by a hash of the edge from the previous basic block, in the
+     *  fashion of AFL, without any callback. The previous basic block is forgotten at the start
+     *  of every run. Changing the bitmap clears the translation cache.
+     *
+     * @param[in] map   The bitmap, for example a shared memory of a fuzzer, or nullptr to disable
+     *                  the coverage instrumentation.
+     * @param[in] size  The size of the bitmap in bytes, a power of two.
+     *
+     * @return True if the coverage instrumentation is supported and the size is valid.
+     */
+    bool        setCoverageMap(uint8_t* map, size_t size);
+
+    /*! Trace the executed basic blocks in a buffer written by the instrumentation itself. The
+     *  entry of every basic block appends its start address to the buffer, and the execution only
+     *  breaks to the host when the buffer is full, to hand the whole batch of addresses to the
+     *  flush callback. The addresses left in the buffer are flushed at the end of every run.
+     *  Changing the trace clears the translation cache.
+     *
+     * @param[in] cbk       The flush callback, or nullptr to disable the trace.
+     * @param[in] data      User defined data passed to the callback.
+     * @param[in] capacity  The number of addresses of the buffer.
+     *
+     * @return True if the basic block trace is supported, False if not or in case of error.
+     */
+    bool        setBlockTrace(BlockTraceCallback cbk, void* data, size_t capacity = 4096);
+
+    /*! Call the flush callback of the basic block trace with the addresses currently in the buffer.
+     */
+    void        flushBlockTrace();
+
     /*! Add an address range to the set of instrumented address ranges.
      *
      * @param[in] start  Start address of the range (included).
@@ -249,6 +322,78 @@ class QBDI_EXPORT VM {
      */
     uint32_t    addCodeRangeCB(rword start, rword end, InstPosition pos, InstCallback cbk, void *data);
 
+    /*! Add a counter of the instructions executed in an address range. The counter is incremented
+     *  by the instrumented code itself without breaking to the host (X86_64 only).
+     *
+     * @param[in] start    Start of the address range.
+     * @param[in] end      End of the address range.
+     *
+     * @return The id of the registered instrumentation, which is also the id of the counter
+     * (or VMError::INVALID_EVENTID in case of failure).
+     */
+    uint32_t    addInlineCounter(rword start, rword end);
+
+    /*! Add a counter of the executions of the instruction at a specific address, for example the
+     *  first instruction of a basic block. The counter is incremented by the instrumented code
+     *  itself without breaking to the host (X86_64 only).
+     *
+     * @param[in] address  Address of the instruction.
+     *
+     * @return The id of the registered instrumentation, which is also the id of the counter
+     * (or VMError::INVALID_EVENTID in case of failure).
+     */
+    uint32_t    addInlineAddrCounter(rword address);
+
+    /*! Obtain the value of an inline counter. Deleting the instrumentation of a counter releases
+     *  it, its value must be read before.
+     *
+     * @param[in] id       The id of the counter.
+     *
+     * @return The number of counted executions, 0 if the id is not a counter.
+     */
+    uint64_t    getInlineCounter(uint32_t id) const;
+
+    /*! Copy the value of several inline counters, for example once the execution ended.
+     *
+     * @param[in]  ids     The ids of the counters.
+     * @param[out] values  Array receiving the values of the counters, in the order of ids.
+     * @param[in]  count   Number of elements of ids and values.
+     */
+    void        getInlineCounters(const uint32_t* ids, uint64_t* values, size_t count) const;
+
+    /*! Reset all the inline counters, including the basic block counters, to 0.
+     */
+    void        resetInlineCounters();
+
+    /*! Enable or disable a counter of the executions of every basic block. The counter of a basic
+     *  block is created when it is first translated and incremented by the instrumented code itself
+     *  without breaking to the host (X86_64 only). Changing the state clears the translation cache,
+     *  the counted values are kept.
+     *
+     * @param[in] enable   True to count the basic block executions.
+     *
+     * @return True if the basic block counters are supported.
+     */
+    bool        setInlineBBCounters(bool enable);
+
+    /*! Obtain the number of executions of a basic block.
+     *
+     * @param[in] address  Start address of the basic block.
+     *
+     * @return The number of counted executions, 0 if the basic block was not counted.
+     */
+    uint64_t    getInlineBBCounter(rword address) const;
+
+    /*! Copy the basic block counters, sorted by basic block address.
+     *
+     * @param[out] addresses  Array receiving the start addresses of the basic blocks.
+     * @param[out] values     Array receiving the values of the counters, in the order of addresses.
+     * @param[in]  count      Number of elements of addresses and values.
+     *
+     * @return The number of counted basic blocks, only the first count ones are copied.
+     */
+    size_t      getInlineBBCounters(rword* addresses, uint64_t* values, size_t count) const;
+
     /*! Register a callback event for every memory access matching the type bitfield made by the instructions.
      *
      * @param[in] type       A mode bitfield: either QBDI::MEMORY_READ, QBDI::MEMORY_WRITE or both
@@ -276,9 +421,25 @@ class QBDI_EXPORT VM {
      */
     uint32_t    addMemAddrCB(rword address, MemoryAccessType type, InstCallback cbk, void *data);
 
+    /*! Register a callback event for every memory access matching the type bitfield made by the
+     *  instructions. The memory accesses are passed to the callback such that it needs neither
+     *  to query them nor to allocate memory.
+     *
+     * @param[in] type     A mode bitfield: either QBDI::MEMORY_READ, QBDI::MEMORY_WRITE or both
+     *                     (QBDI::MEMORY_READ_WRITE).
+     * @param[in] cbk      A function pointer to the callback.
+     * @param[in] data     User defined data passed to the callback.
+     *
+     * @return The id of the registered instrumentation (or VMError::INVALID_EVENTID
+     * in case of failure).
+     */
+    uint32_t    addMemAccessListCB(MemoryAccessType type, MemAccessListCallback cbk, void *data);
+
     /*! Add a virtual callback which is triggered for any memory access in a specific address range 
      *  matching the access type. Virtual callbacks are called via callback forwarding by a 
      *  gate callback triggered on every memory access. This incurs a high performance cost.
+     *  With the OPT_PAGE_WATCH option the watched pages are protected instead and the callback
+     *  is triggered by the access faults.
      *
      * @param[in] start    Start of the address range which will trigger the callback.
      * @param[in] end      End of the address range which will trigger the callback.
@@ -339,18 +500,56 @@ class QBDI_EXPORT VM {
      */
     bool recordMemoryAccess(MemoryAccessType type);
 
+    /*! Trace the memory accesses in a buffer written by the instrumentation itself. The
+     *  instrumented code appends a MemoryAccess record per access and only breaks to the host
+     *  when the buffer is full, to hand the whole batch of records to the flush callback. The
+     *  records left in the buffer are flushed at the end of every run. Enabling the trace again
+     *  replaces the previous one.
+     *
+     * @param[in] type      Memory mode bitfield of the traced accesses: either QBDI::MEMORY_READ,
+     *                      QBDI::MEMORY_WRITE or both (QBDI::MEMORY_READ_WRITE).
+     * @param[in] cbk       The flush callback, or nullptr to disable the trace.
+     * @param[in] data      User defined data passed to the callback.
+     * @param[in] capacity  The number of records of the buffer.
+     *
+     * @return True if the memory trace is supported, False if not or in case of error.
+     */
+    bool setMemTrace(MemoryAccessType type, MemTraceCallback cbk, void* data, size_t capacity = 4096);
+
+    /*! Call the flush callback of the memory trace with the records currently in the buffer.
+     */
+    void flushMemTrace();
+
     /*! Obtain the memory accesses made by the last executed instruction.
      *
      * @return List of memory access made by the instruction.
      */
     std::vector<MemoryAccess> getInstMemoryAccess() const;
 
+    /*! Obtain the memory accesses made by the last executed instruction without allocating.
+     *
+     * @param[out] buffer  Array receiving the first size memory accesses.
+     * @param[in]  size    Number of elements of buffer.
+     *
+     * @return The number of memory accesses made by the instruction, which can exceed size.
+     */
+    size_t getInstMemoryAccess(MemoryAccess* buffer, size_t size) const;
+
     /*! Obtain the memory accesses made by the last executed basic block.
      *
      * @return List of memory access made by the instruction.
      */
     std::vector<MemoryAccess> getBBMemoryAccess() const;
 
+    /*! Obtain the memory accesses made by the last executed basic block without allocating.
+     *
+     * @param[out] buffer  Array receiving the first size memory accesses.
+     * @param[in]  size    Number of elements of buffer.
+     *
+     * @return The number of memory accesses made by the basic block, which can exceed size.
+     */
+    size_t getBBMemoryAccess(MemoryAccess* buffer, size_t size) const;
+
     /*! Pre-cache a known basic block
      *
      * @param[in] pc   Start address of a basic block
@@ -359,7 +558,8 @@ class QBDI_EXPORT VM {
      */
     bool precacheBasicBlock(rword pc);
 
-    /*! Clear a specific address range from the translation cache.
+    /*! Clear a specific address range from the translation cache. Only the translated sequences
+     *  overlapping the range are translated again, the rest of the cache is kept.
      *
      * @param[in] start Start of the address range to clear from the cache.
      * @param[in] end   End of the address range to clear from the cache.
@@ -371,6 +571,28 @@ class QBDI_EXPORT VM {
     */
     void clearAllCache();
 
+    /*! Bound the memory used by the translation cache. Once the code and data blocks of the cache
+     *  exceed the budget, the least recently executed regions of the cache are evicted, at the
+     *  next safe point of the execution. A few evicted blocks are kept for reuse and are not
+     *  accounted.
+     *
+     * @param[in] budget The budget in bytes, 0 for an unbounded cache (the default).
+     */
+    void setCacheBudget(size_t budget);
+
+    /*! Enable or disable the counting of the translation cache statistics. The statistics are
+     *  not counted by default, enabling them resets the counters.
+     *
+     * @param[in] enable True to count the statistics.
+     */
+    void setCacheStatistics(bool enable);
+
+    /*! Get the execution statistics of the translation cache.
+     *
+     * @return The statistics counted since they were enabled.
+     */
+    CacheStatistics getCacheStatistics() const;
+
 };
 
 } // QBDI::
@@ -26,6 +26,7 @@
 #include "Errors.h"
 #include "State.h"
 #include "InstAnalysis.h"
+#include "Options.h"
 
 #ifdef __cplusplus
 namespace QBDI {
@@ -206,6 +207,56 @@ QBDI_EXPORT void qbdi_setGPRState(VMInstanceRef instance, GPRState* gprState);
  */
 QBDI_EXPORT void qbdi_setFPRState(VMInstanceRef instance, FPRState* fprState);
 
+/*! Get the current Options of the VM
+ *
+ * @param[in] instance  VM instance.
+ *
+ * @return  The current options.
+ */
+QBDI_EXPORT Options qbdi_getOptions(VMInstanceRef instance);
+
+/*! Set the Options of the VM. Changing the options clears the translation cache.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] options   The new options of the VM.
+ */
+QBDI_EXPORT void qbdi_setOptions(VMInstanceRef instance, Options options);
+
+/*! Enable the edge coverage instrumentation. The entry of every basic block increments the
+ *  byte of the bitmap indexed by a hash of the edge from the previous basic block, in the
+ *  fashion of AFL, without any callback. The previous basic block is forgotten at the start
+ *  of every run. Changing the bitmap clears the translation cache.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] map       The bitmap, for example a shared memory of a fuzzer, or NULL to disable
+ *                      the coverage instrumentation.
+ * @param[in] size      The size of the bitmap in bytes, a power of two.
+ *
+ * @return True if the coverage instrumentation is supported and the size is valid.
+ */
+QBDI_EXPORT bool qbdi_setCoverageMap(VMInstanceRef instance, uint8_t* map, size_t size);
+
+/*! Trace the executed basic blocks in a buffer written by the instrumentation itself. The
+ *  entry of every basic block appends its start address to the buffer, and the execution only
+ *  breaks to the host when the buffer is full, to hand the whole batch of addresses to the
+ *  flush callback. The addresses left in the buffer are flushed at the end of every run.
+ *  Changing the trace clears the translation cache.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] cbk       The flush callback, or NULL to disable the trace.
+ * @param[in] data      User defined data passed to the callback.
+ * @param[in] capacity  The number of addresses of the buffer.
+ *
+ * @return True if the basic block trace is supported, False if not or in case of error.
+ */
+QBDI_EXPORT bool qbdi_setBlockTrace(VMInstanceRef instance, BlockTraceCallback cbk, void* data, size_t capacity);
+
+/*! Call the flush callback of the basic block trace with the addresses currently in the buffer.
+ *
+ * @param[in] instance  VM instance.
+ */
+QBDI_EXPORT void qbdi_flushBlockTrace(VMInstanceRef instance);
+
 /*! Register a callback event for every memory access matching the type bitfield made by the instructions.
  *
  * @param[in] instance  VM instance.
@@ -233,6 +284,20 @@ QBDI_EXPORT uint32_t qbdi_addMemAccessCB(VMInstanceRef instance, MemoryAccessTyp
  */
 QBDI_EXPORT uint32_t qbdi_addMemAddrCB(VMInstanceRef instance, rword address, MemoryAccessType type, InstCallback cbk, void *data);
 
+/*! Register a callback event for every memory access matching the type bitfield made by the
+ *  instructions. The memory accesses are passed to the callback such that it needs neither to
+ *  query them nor to free memory.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] type      A mode bitfield: either QBDI_MEMORY_READ, QBDI_MEMORY_WRITE or both (QBDI_MEMORY_READ_WRITE).
+ * @param[in] cbk       A function pointer to the callback.
+ * @param[in] data      User defined data passed to the callback.
+ *
+ * @return The id of the registered instrumentation (or QBDI_INVALID_EVENTID
+ * in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addMemAccessListCB(VMInstanceRef instance, MemoryAccessType type, MemAccessListCallback cbk, void *data);
+
 /*! Add a virtual callback which is triggered for any memory access in a specific address range 
  *  matching the access type. Virtual callbacks are called via callback forwarding by a 
  *  gate callback triggered on every memory access. This incurs a high performance cost.
@@ -301,6 +366,87 @@ QBDI_EXPORT uint32_t qbdi_addCodeAddrCB(VMInstanceRef instance, rword address, I
  */
 QBDI_EXPORT uint32_t qbdi_addCodeRangeCB(VMInstanceRef instance, rword start, rword end, InstPosition pos, InstCallback cbk, void *data);
 
+/*! Add a counter of the instructions executed in an address range. The counter is incremented
+ *  by the instrumented code itself without breaking to the host (X86_64 only).
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] start     Start of the address range.
+ * @param[in] end       End of the address range.
+ *
+ * @return The id of the registered instrumentation, which is also the id of the counter
+ * (or QBDI_INVALID_EVENTID in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addInlineCounter(VMInstanceRef instance, rword start, rword end);
+
+/*! Add a counter of the executions of the instruction at a specific address, for example the
+ *  first instruction of a basic block. The counter is incremented by the instrumented code
+ *  itself without breaking to the host (X86_64 only).
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] address   Address of the instruction.
+ *
+ * @return The id of the registered instrumentation, which is also the id of the counter
+ * (or QBDI_INVALID_EVENTID in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addInlineAddrCounter(VMInstanceRef instance, rword address);
+
+/*! Obtain the value of an inline counter. Deleting the instrumentation of a counter releases
+ *  it, its value must be read before.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] id        The id of the counter.
+ *
+ * @return The number of counted executions, 0 if the id is not a counter.
+ */
+QBDI_EXPORT uint64_t qbdi_getInlineCounter(VMInstanceRef instance, uint32_t id);
+
+/*! Copy the value of several inline counters, for example once the execution ended.
+ *
+ * @param[in]  instance  VM instance.
+ * @param[in]  ids       The ids of the counters.
+ * @param[out] values    Array receiving the values of the counters, in the order of ids.
+ * @param[in]  count     Number of elements of ids and values.
+ */
+QBDI_EXPORT void qbdi_getInlineCounters(VMInstanceRef instance, const uint32_t* ids, uint64_t* values, size_t count);
+
+/*! Reset all the inline counters, including the basic block counters, to 0.
+ *
+ * @param[in] instance  VM instance.
+ */
+QBDI_EXPORT void qbdi_resetInlineCounters(VMInstanceRef instance);
+
+/*! Enable or disable a counter of the executions of every basic block. The counter of a basic
+ *  block is created when it is first translated and incremented by the instrumented code itself
+ *  without breaking to the host (X86_64 only). Changing the state clears the translation cache,
+ *  the counted values are kept.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] enable    True to count the basic block executions.
+ *
+ * @return True if the basic block counters are supported.
+ */
+QBDI_EXPORT bool qbdi_setInlineBBCounters(VMInstanceRef instance, bool enable);
+
+/*! Obtain the number of executions of a basic block.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] address   Start address of the basic block.
+ *
+ * @return The number of counted executions, 0 if the basic block was not counted.
+ */
+QBDI_EXPORT uint64_t qbdi_getInlineBBCounter(VMInstanceRef instance, rword address);
+
+/*! Copy the basic block counters, sorted by basic block address.
+ *
+ * @param[in]  instance   VM instance.
+ * @param[out] addresses  Array receiving the start addresses of the basic blocks.
+ * @param[out] values     Array receiving the values of the counters, in the order of addresses.
+ * @param[in]  count      Number of elements of addresses and values.
+ *
+ * @return The number of counted basic blocks, only the first count ones are copied.
+ */
+QBDI_EXPORT size_t qbdi_getInlineBBCounters(VMInstanceRef instance, rword* addresses, uint64_t* values, size_t count);
+
 /*! Register a callback event for a specific VM event.
  *
  * @param[in] instance  VM instance.
@@ -350,6 +496,30 @@ QBDI_EXPORT const InstAnalysis* qbdi_getInstAnalysis(VMInstanceRef instance, Ana
  */
 QBDI_EXPORT bool qbdi_recordMemoryAccess(VMInstanceRef instance, MemoryAccessType type);
 
+/*! Trace the memory accesses in a buffer written by the instrumentation itself. The
+ *  instrumented code appends a MemoryAccess record per access and only breaks to the host
+ *  when the buffer is full, to hand the whole batch of records to the flush callback. The
+ *  records left in the buffer are flushed at the end of every run. Enabling the trace again
+ *  replaces the previous one.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] type      Memory mode bitfield of the traced accesses: either QBDI_MEMORY_READ,
+ *                      QBDI_MEMORY_WRITE or both (QBDI_MEMORY_READ_WRITE).
+ * @param[in] cbk       The flush callback, or NULL to disable the trace.
+ * @param[in] data      User defined data passed to the callback.
+ * @param[in] capacity  The number of records of the buffer.
+ *
+ * @return True if the memory trace is supported, False if not or in case of error.
+ */
+QBDI_EXPORT bool qbdi_setMemTrace(VMInstanceRef instance, MemoryAccessType type, MemTraceCallback cbk, void* data,
+                                  size_t capacity);
+
+/*! Call the flush callback of the memory trace with the records currently in the buffer.
+ *
+ * @param[in] instance  VM instance.
+ */
+QBDI_EXPORT void qbdi_flushMemTrace(VMInstanceRef instance);
+
 /*! Obtain the memory accesses made by the last executed instruction.
  *  Return NULL and a size of 0 if the instruction made no memory access.
  *
@@ -360,6 +530,16 @@ QBDI_EXPORT bool qbdi_recordMemoryAccess(VMInstanceRef instance, MemoryAccessTyp
  */
 QBDI_EXPORT MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_t* size);
 
+/*! Copy the memory accesses made by the last executed instruction to a caller provided buffer.
+ *
+ *  @param[in]  instance     VM instance.
+ *  @param[out] buffer       Array receiving the first size memory accesses.
+ *  @param[in]  size         Number of elements of buffer.
+ *
+ * @return The number of memory accesses made by the instruction, which can exceed size.
+ */
+QBDI_EXPORT size_t qbdi_fillInstMemoryAccess(VMInstanceRef instance, MemoryAccess* buffer, size_t size);
+
 /*! Obtain the memory accesses made by the last executed basic block.
  *  Return NULL and a size of 0 if the basic block made no memory access.
  *
@@ -370,6 +550,16 @@ QBDI_EXPORT MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_
  */
 QBDI_EXPORT MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t* size);
 
+/*! Copy the memory accesses made by the last executed basic block to a caller provided buffer.
+ *
+ *  @param[in]  instance     VM instance.
+ *  @param[out] buffer       Array receiving the first size memory accesses.
+ *  @param[in]  size         Number of elements of buffer.
+ *
+ * @return The number of memory accesses made by the basic block, which can exceed size.
+ */
+QBDI_EXPORT size_t qbdi_fillBBMemoryAccess(VMInstanceRef instance, MemoryAccess* buffer, size_t size);
+
 /*! Pre-cache a known basic block
  *
  *  @param[in]  instance     VM instance.
@@ -379,7 +569,8 @@ QBDI_EXPORT MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t*
  */
 QBDI_EXPORT bool qbdi_precacheBasicBlock(VMInstanceRef instance, rword pc);
 
-/*! Clear a specific address range from the translation cache.
+/*! Clear a specific address range from the translation cache. Only the translated sequences
+ *  overlapping the range are translated again, the rest of the cache is kept.
  *
  * @param[in] instance     VM instance.
  * @param[in] start        Start of the address range to clear from the cache.
@@ -394,6 +585,31 @@ QBDI_EXPORT void qbdi_clearCache(VMInstanceRef instance, rword start, rword end)
  */
 QBDI_EXPORT void qbdi_clearAllCache(VMInstanceRef instance);
 
+/*! Bound the memory used by the translation cache. Once the code and data blocks of the cache
+ *  exceed the budget, the least recently executed regions of the cache are evicted, at the
+ *  next safe point of the execution. A few evicted blocks are kept for reuse and are not
+ *  accounted.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] budget       The budget in bytes, 0 for an unbounded cache (the default).
+ */
+QBDI_EXPORT void qbdi_setCacheBudget(VMInstanceRef instance, size_t budget);
+
+/*! Enable or disable the counting of the translation cache statistics. The statistics are not
+ *  counted by default, enabling them resets the counters.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] enable       True to count the statistics.
+ */
+QBDI_EXPORT void qbdi_setCacheStatistics(VMInstanceRef instance, bool enable);
+
+/*! Get the execution statistics of the translation cache.
+ *
+ * @param[in]  instance    VM instance.
+ * @param[out] statistics  The statistics counted since they were enabled.
+ */
+QBDI_EXPORT void qbdi_getCacheStatistics(VMInstanceRef instance, CacheStatistics* statistics);
+
 #ifdef __cplusplus
 } // "C"
 } // QBDI::
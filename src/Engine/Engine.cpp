@@ -50,8 +50,10 @@
 
 namespace QBDI {
 
-Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs, VMInstanceRef vminstance)
-    : cpu(_cpu), mattrs(_mattrs), vminstance(vminstance), instrRulesCounter(0), vmCallbacksCounter(0) {
+Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs, VMInstanceRef vminstance, Options options)
+    : cpu(_cpu), mattrs(_mattrs), vminstance(vminstance), instrRulesCounter(0), vmCallbacksCounter(0), eventMask((VMEvent) 0),
+      vmState(VMState {(VMEvent) 0, 0, 0, 0, 0, 0}), lastUpdatePC(0), options(options),
+      statistics(CacheStatistics {0, 0, 0, 0}), countStatistics(false), flushCount(0) {
 
     std::string          error;
     std::string          featuresStr;
@@ -113,7 +115,7 @@ Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs,
     );
     // Allocate QBDI classes
     assembly = new Assembly(*MCTX, *MAB, *MCII, *processTarget, *MSTI);
-    blockManager = new ExecBlockManager(*MCII, *MRI, *assembly, vminstance);
+    blockManager = new ExecBlockManager(*MCII, *MRI, *assembly, vminstance, options);
     execBroker = new ExecBroker(*assembly, vminstance);
 
     // Get default Patch rules for this architecture
@@ -128,6 +130,8 @@ Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs,
     initFPRState();
 
     curExecBlock = nullptr;
+
+    updateChaining();
 }
 
 Engine::~Engine() {
@@ -170,6 +174,46 @@ void Engine::setFPRState(FPRState* fprState) {
     *(this->curFPRState) = *fprState;
 }
 
+void Engine::setOptions(Options options) {
+    if(options == this->options) {
+        return;
+    }
+    LogDebug("Engine::setOptions", "Options changed from 0x%x to 0x%x, flushing the cache", this->options, options);
+    // The cached code depends on the options, everything needs to be translated again
+    blockManager->clearCache(Range<rword>(0, (rword) -1));
+    blockManager->setOptions(options);
+    this->options = options;
+    updateChaining();
+}
+
+bool Engine::setCoverageMap(uint8_t* map, size_t size) {
+    return blockManager->setCoverageMap(map, size);
+}
+
+void Engine::setBlockTrace(const BlockTrace* trace) {
+    blockManager->setBlockTrace(trace);
+}
+
+void Engine::setBlockCounters(std::map<rword, uint64_t>* counters) {
+    blockManager->setBlockCounters(counters);
+}
+
+void Engine::updateEventMask() {
+    eventMask = (VMEvent) 0;
+    for(const auto& item : vmCallbacks) {
+        eventMask |= item.second.mask;
+    }
+    updateChaining();
+}
+
+void Engine::updateChaining() {
+    // Chained sequences and traces don't return to the engine between basic blocks and would skip
+    // those events
+    bool enable = (eventMask & (SEQUENCE_ENTRY | SEQUENCE_EXIT | BASIC_BLOCK_ENTRY | BASIC_BLOCK_EXIT)) == 0;
+    blockManager->setChaining(enable && (options & OPT_DIRECT_CHAINING));
+    blockManager->setTracing(enable && (options & OPT_HOT_TRACES));
+}
+
 bool Engine::isPreInst() const {
     if(curExecBlock == nullptr) {
         return false;
@@ -195,20 +239,36 @@ bool Engine::instrumentAllExecutableMaps() {
     return execBroker->instrumentAllExecutableMaps();
 }
 
+// Chained sequences and traces are executed without checking if their target is still instrumented,
+// the cache is flushed such that removed ranges get back through the ExecBroker.
 void Engine::removeInstrumentedRange(rword start, rword end) {
     execBroker->removeInstrumentedRange(Range<rword>(start, end));
+    if(blockManager->isChaining() || blockManager->isTracing()) {
+        blockManager->clearCache(Range<rword>(start, end));
+    }
 }
 
 bool Engine::removeInstrumentedModule(const std::string& name) {
-    return execBroker->removeInstrumentedModule(name);
+    bool removed = execBroker->removeInstrumentedModule(name);
+    if(removed && (blockManager->isChaining() || blockManager->isTracing())) {
+        blockManager->clearCache(Range<rword>(0, (rword) -1));
+    }
+    return removed;
 }
 
 bool Engine::removeInstrumentedModuleFromAddr(rword addr) {
-    return execBroker->removeInstrumentedModuleFromAddr(addr);
+    bool removed = execBroker->removeInstrumentedModuleFromAddr(addr);
+    if(removed && (blockManager->isChaining() || blockManager->isTracing())) {
+        blockManager->clearCache(Range<rword>(0, (rword) -1));
+    }
+    return removed;
 }
 
 void Engine::removeAllInstrumentedRanges() {
     execBroker->removeAllInstrumentedRanges();
+    if(blockManager->isChaining() || blockManager->isTracing()) {
+        blockManager->clearCache(Range<rword>(0, (rword) -1));
+    }
 }
 
 std::vector<Patch> Engine::patch(rword start) {
@@ -300,6 +360,38 @@ void Engine::handleNewBasicBlock(rword pc) {
     blockManager->writeBasicBlock(basicBlock);
 }
 
+bool Engine::handleHotTrace(rword pc) {
+    std::vector<Patch::Vec> basicBlocks;
+    rword address = pc;
+    // Follow the most frequent successors from the hot sequence
+    while(basicBlocks.size() < MAX_TRACE_BLOCKS) {
+        Patch::Vec basicBlock = patch(address);
+        instrument(basicBlock);
+        basicBlocks.push_back(basicBlock);
+        address = blockManager->getHotSuccessor(basicBlock);
+        if(address == 0 || execBroker->isInstrumented(address) == false) {
+            break;
+        }
+        // The stop address of the run is never part of a trace
+        if(address == blockManager->getChainingStop()) {
+            break;
+        }
+        // Stop on loops, the exit of the trace is chained back to it
+        bool visited = false;
+        for(const Patch::Vec& previous : basicBlocks) {
+            if(previous.front().metadata.address == address) {
+                visited = true;
+                break;
+            }
+        }
+        if(visited) {
+            break;
+        }
+    }
+    LogDebug("Engine::handleHotTrace", "Writing trace of %zu basic blocks at 0x%" PRIRWORD, basicBlocks.size(), pc);
+    return blockManager->writeTrace(basicBlocks);
+}
+
 
 bool Engine::precacheBasicBlock(rword pc) {
     if (blockManager->getProgrammedExecBlock(pc) != nullptr) {
@@ -314,8 +406,16 @@ bool Engine::precacheBasicBlock(rword pc) {
 bool Engine::run(rword start, rword stop) {
     rword         currentPC = start;
     bool          hasRan = false;
+    ExecBlock*    prevExecBlock = nullptr;
+    rword         prevPC = 0;
     curGPRState = gprState.get();
     curFPRState = fprState.get();
+    lastUpdatePC = 0;
+    blockManager->setChainingStop(stop);
+    // Each run starts a new path, as the executions of a fuzzer
+    if(blockManager->isCoverageEnabled()) {
+        blockManager->resetCoverageLocation();
+    }
 
     // Start address is out of range
     if (!execBroker->isInstrumented(start)) {
@@ -328,11 +428,17 @@ bool Engine::run(rword start, rword stop) {
         if(execBroker->isInstrumented(currentPC) == false &&
            execBroker->canTransferExecution(curGPRState)) {
             curExecBlock = nullptr;
+            prevExecBlock = nullptr;
+            prevPC = 0;
             LogDebug("Engine::run", "Executing 0x%" PRIRWORD " through execBroker", currentPC);
             // transfer execution
-            signalEvent(EXEC_TRANSFER_CALL, currentPC, curGPRState, curFPRState);
+            if(eventMask & EXEC_TRANSFER_CALL) {
+                signalEvent(EXEC_TRANSFER_CALL, currentPC, curGPRState, curFPRState);
+            }
             execBroker->transferExecution(currentPC, curGPRState, curFPRState);
-            signalEvent(EXEC_TRANSFER_RETURN, currentPC, curGPRState, curFPRState);
+            if(eventMask & EXEC_TRANSFER_RETURN) {
+                signalEvent(EXEC_TRANSFER_RETURN, currentPC, curGPRState, curFPRState);
+            }
         }
         // Else execute through DBI
         else {
@@ -348,6 +454,8 @@ bool Engine::run(rword start, rword stop) {
                 curFPRState = fprState.get();
                 // Commit the flush
                 blockManager->flushCommit();
+                flushCount++;
+                prevExecBlock = nullptr;
             }
 
             // Test if we have it in cache
@@ -360,24 +468,62 @@ bool Engine::run(rword start, rword stop) {
                 // Set new basic block as current
                 curExecBlock = blockManager->getProgrammedExecBlock(currentPC);
             }
+            // The last dynamic exit missed the indirect branch cache of this block, fill it
+            else if(curExecBlock == prevExecBlock && blockManager->isChaining() &&
+                    currentPC != stop && curExecBlock->getIndirectMiss() == currentPC) {
+                curExecBlock->cacheIndirectTarget(currentPC, curExecBlock->getCurrentSeqID());
+                if(countStatistics) {
+                    statistics.indirectFills++;
+                }
+            }
+
+            // Profile the dispatches and retranslate hot paths as traces
+            if(blockManager->isTracing()) {
+                if(prevPC != 0) {
+                    blockManager->profileEdge(prevPC, currentPC);
+                }
+                if(blockManager->profileSequence(currentPC)) {
+                    LogDebug("Engine::run", "Sequence 0x%" PRIRWORD " is hot, forming a trace", currentPC);
+                    if(handleHotTrace(currentPC) && countStatistics) {
+                        statistics.traces++;
+                    }
+                    curExecBlock = blockManager->getProgrammedExecBlock(currentPC);
+                    prevExecBlock = nullptr;
+                }
+            }
 
             // Set context if necessary
-            if(&(curExecBlock->getContext()->gprState) != curGPRState || &(curExecBlock->getContext()->fprState) != curFPRState) {
-                curExecBlock->getContext()->gprState = *curGPRState;
-                curExecBlock->getContext()->fprState = *curFPRState;
+            // Every mapping of the shared context is accessed through the same view
+            Context* context = curExecBlock->getContext();
+            if(curExecBlock->isContextShared()) {
+                context = blockManager->getSharedContext();
             }
-            curGPRState = &(curExecBlock->getContext()->gprState);
-            curFPRState = &(curExecBlock->getContext()->fprState);
+            if(&(context->gprState) != curGPRState || &(context->fprState) != curFPRState) {
+                context->gprState = *curGPRState;
+                context->fprState = *curFPRState;
+            }
+            curGPRState = &(context->gprState);
+            curFPRState = &(context->fprState);
 
             // Signal events
-            if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Entry) > 0) {
-                event |= BASIC_BLOCK_ENTRY;
+            if(eventMask & (SEQUENCE_ENTRY | BASIC_BLOCK_ENTRY | BASIC_BLOCK_NEW)) {
+                if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Entry) > 0) {
+                    event |= BASIC_BLOCK_ENTRY;
+                }
+                signalEvent(event, currentPC, curGPRState, curFPRState);
             }
-            signalEvent(event, currentPC, curGPRState, curFPRState);
 
             // Execute
             hasRan = true;
-            switch(curExecBlock->execute()) {
+            prevExecBlock = curExecBlock;
+            prevPC = currentPC;
+            uint64_t hostCalls = curExecBlock->getHostCalls();
+            VMAction action = curExecBlock->execute();
+            if(countStatistics) {
+                statistics.dispatches++;
+                statistics.hostCalls += curExecBlock->getHostCalls() - hostCalls;
+            }
+            switch(action) {
                 case CONTINUE:
                 case BREAK_TO_VM:
                     break;
@@ -390,11 +536,13 @@ bool Engine::run(rword start, rword stop) {
             }
 
             // Signal events
-            event = SEQUENCE_EXIT;
-            if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Exit) > 0) {
-                event |= BASIC_BLOCK_EXIT;
+            if(eventMask & (SEQUENCE_EXIT | BASIC_BLOCK_EXIT)) {
+                event = SEQUENCE_EXIT;
+                if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Exit) > 0) {
+                    event |= BASIC_BLOCK_EXIT;
+                }
+                signalEvent(event, currentPC, curGPRState, curFPRState);
             }
-            signalEvent(event, currentPC, curGPRState, curFPRState);
         }
         // Get next block PC
         currentPC = QBDI_GPR_GET(curGPRState, REG_PC);
@@ -429,13 +577,11 @@ uint32_t Engine::addVMEventCB(VMEvent mask, VMCallback cbk, void *data) {
     uint32_t id = vmCallbacksCounter++;
     RequireAction("Engine::addVMEventCB", id < EVENTID_VM_MASK, return VMError::INVALID_EVENTID);
     vmCallbacks.push_back(std::make_pair(id, CallbackRegistration {mask, cbk, data}));
+    updateEventMask();
     return id | EVENTID_VM_MASK;
 }
 
 void Engine::signalEvent(VMEvent event, rword currentPC, GPRState *gprState, FPRState *fprState) {
-    static VMState vmState;
-    static rword lastUpdatePC = 0;
-
     for(const auto& item : vmCallbacks) {
         const QBDI::CallbackRegistration& r = item.second;
         if(event & r.mask) {
@@ -464,6 +610,7 @@ bool Engine::deleteInstrumentation(uint32_t id) {
         for(size_t i = 0; i < vmCallbacks.size(); i++) {
             if(vmCallbacks[i].first == id) {
                 vmCallbacks.erase(vmCallbacks.begin() + i);
+                updateEventMask();
                 return true;
             }
         }
@@ -481,8 +628,12 @@ bool Engine::deleteInstrumentation(uint32_t id) {
 }
 
 void Engine::deleteAllInstrumentations() {
+    for(const std::pair<uint32_t, std::shared_ptr<InstrRule>>& rule : instrRules) {
+        blockManager->clearCache(rule.second->affectedRange());
+    }
     instrRules.clear();
     vmCallbacks.clear();
+    updateEventMask();
 }
 
 const InstAnalysis* Engine::analyzeInstMetadata(const InstMetadata* instMetadata, AnalysisType type) {
@@ -497,4 +648,15 @@ void Engine::clearCache(rword start, rword end) {
     blockManager->clearCache(Range<rword>(start, end));
 }
 
+void Engine::setCacheBudget(size_t budget) {
+    blockManager->setCacheBudget(budget);
+}
+
+void Engine::setStatistics(bool enable) {
+    countStatistics = enable;
+    if(enable) {
+        statistics = CacheStatistics {0, 0, 0, 0};
+    }
+}
+
 } // QBDI::
@@ -39,6 +39,7 @@
 
 #include "Callback.h"
 #include "InstAnalysis.h"
+#include "Options.h"
 #include "State.h"
 #include "Patch/Types.h"
 
@@ -86,11 +87,18 @@ private:
     uint32_t                                                        instrRulesCounter;
     std::vector<std::pair<uint32_t, CallbackRegistration>>          vmCallbacks;
     uint32_t                                                        vmCallbacksCounter;
+    VMEvent                                                         eventMask;
+    VMState                                                         vmState;
+    rword                                                           lastUpdatePC;
     std::unique_ptr<GPRState>                                       gprState;
     std::unique_ptr<FPRState>                                       fprState;
     GPRState*                                                       curGPRState;
     FPRState*                                                       curFPRState;
     ExecBlock*                                                      curExecBlock;
+    Options                                                         options;
+    CacheStatistics                                                 statistics;
+    bool                                                            countStatistics;
+    uint32_t                                                        flushCount;
 
     std::vector<Patch> patch(rword start);
 
@@ -99,9 +107,13 @@ private:
 
     void instrument(std::vector<Patch> &basicBlock);
     void handleNewBasicBlock(rword pc);
+    bool handleHotTrace(rword pc);
 
     void signalEvent(VMEvent kind, rword currentBasicBlock, GPRState *gprState, FPRState *fprState);
 
+    void updateEventMask();
+    void updateChaining();
+
 public:
 
     /*! Construct a new Engine for a given CPU with specific attributes
@@ -109,8 +121,10 @@ public:
      * @param[in] cpu        The name of the CPU
      * @param[in] mattrs     A list of additional attributes
      * @param[in] vminstance Pointer to public engine interface
+     * @param[in] options    The execution options of the engine
      */
-    Engine(const std::string& cpu = "", const std::vector<std::string>& mattrs = {}, VMInstanceRef vminstance = nullptr);
+    Engine(const std::string& cpu = "", const std::vector<std::string>& mattrs = {}, VMInstanceRef vminstance = nullptr,
+           Options options = NO_OPT);
 
     ~Engine();
     
@@ -138,6 +152,43 @@ public:
      */
     void        setFPRState(FPRState* fprState);
 
+    /*! Get the current Options
+     *
+     * @return The current options.
+     */
+    Options     getOptions() const { return options; }
+
+    /*! Set the Options. Changing the options clears the translation cache.
+     *
+     * @param[in] options The new options.
+     */
+    void        setOptions(Options options);
+
+    /*! Set the bitmap updated by the edge coverage instrumentation. Changing the bitmap clears the
+     *  translation cache.
+     *
+     * @param[in] map   The bitmap, or nullptr to disable the coverage instrumentation.
+     * @param[in] size  The size of the bitmap in bytes, a power of two.
+     *
+     * @return True if the coverage instrumentation is supported and the size is valid.
+     */
+    bool        setCoverageMap(uint8_t* map, size_t size);
+
+    /*! Set the buffer appended by the basic block trace instrumentation. Changing the buffer clears
+     *  the translation cache.
+     *
+     * @param[in] trace  The trace buffer, or nullptr to disable the trace instrumentation.
+     */
+    void        setBlockTrace(const BlockTrace* trace);
+
+    /*! Set the counters incremented by the basic block counter instrumentation. Changing the
+     *  counters clears the translation cache.
+     *
+     * @param[in] counters  The counters indexed by basic block address, or nullptr to disable the
+     *                      counter instrumentation.
+     */
+    void        setBlockCounters(std::map<rword, uint64_t>* counters);
+
     /*! Add an address range to the set of instrumented address ranges.
      *
      * @param[in] start  Start address of the range (included).
@@ -248,6 +299,8 @@ public:
      */
     const ExecBlock* getCurExecBlock() const { return curExecBlock; }
 
+    ExecBlock* getCurExecBlock() { return curExecBlock; }
+
     /*! Check if current ExecBlock is PREINST in current state
      *
      * @return true if engine state is Pre-inst
@@ -273,6 +326,33 @@ public:
     /*! Clear the entire translation cache.
     */
     void clearAllCache();
+
+    /*! Set the memory budget of the translation cache. The least recently used regions are
+     *  evicted once the budget is exceeded.
+     *
+     * @param[in] budget The budget in bytes, 0 for an unbounded cache.
+     */
+    void setCacheBudget(size_t budget);
+
+    /*! Enable or disable the counting of the translation cache statistics. Enabling them resets
+     *  the counters.
+     *
+     * @param[in] enable True to count the statistics.
+     */
+    void setStatistics(bool enable);
+
+    /*! Get the execution statistics of the translation cache.
+     *
+     * @return The statistics counted since they were enabled.
+     */
+    CacheStatistics getStatistics() const { return statistics; }
+
+    /*! Get the number of cache flushes committed. The code of a deleted instrumentation is not
+     *  executed anymore once the count increased past its deletion.
+     *
+     * @return The number of cache flushes committed since the creation of the engine.
+     */
+    uint32_t getFlushCount() const { return flushCount; }
 };
 
 } // QBDI::
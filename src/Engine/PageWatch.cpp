@@ -0,0 +1,451 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Platform.h"
+
+#if defined(QBDI_OS_LINUX) && defined(QBDI_ARCH_X86_64)
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "Memory.h"
+#include "Engine/Engine.h"
+#include "Engine/PageWatch.h"
+#include "ExecBlock/ExecBlock.h"
+#include "Patch/InstInfo.h"
+#include "Patch/PatchRule.h"
+#include "Utility/LogSys.h"
+
+namespace QBDI {
+
+#if defined(QBDI_OS_LINUX) && defined(QBDI_ARCH_X86_64)
+
+static const size_t PAGE_WATCH_MAX_STEP = 16;
+static const greg_t TRAP_FLAG = 0x100;
+// Page fault error code bit set by write accesses
+static const greg_t FAULT_WRITE_FLAG = 0x2;
+static const size_t ALT_STACK_SIZE = 256 * 1024;
+static const size_t FXSAVE_SIZE = 512;
+// Linux extends the FXSAVE area of the signal frame with the other XSAVE state components, in the
+// standard format. The software reserved bytes of the FXSAVE area then describe them.
+static const size_t FX_SW_BYTES_OFFSET = 464;
+static const uint32_t FP_XSTATE_MAGIC1 = 0x46505853;
+static const uint64_t XSTATE_LEGACY = 0x3;
+static const uint64_t XSTATE_YMM = 0x4;
+
+struct FxSwBytes {
+    uint32_t magic1;
+    uint32_t extendedSize;
+    uint64_t xfeatures;
+    uint32_t xstateSize;
+};
+
+// Location of the GPRState registers, up to REG_SP, in the signal context
+static const int UC_GPR_ID[] = {
+    REG_RAX, REG_RBX, REG_RCX, REG_RDX,
+    REG_RSI, REG_RDI, REG_R8,  REG_R9,
+    REG_R10, REG_R11, REG_R12, REG_R13,
+    REG_R14, REG_R15, REG_RBP, REG_RSP
+};
+
+// Faulting access being single stepped by a thread. Faults happening while it is pending (in the
+// callbacks or on a second page of the same access) only unprotect their page.
+struct PendingStep {
+    PageWatch* watch;
+    rword      pc;
+    bool       pushFlags;
+    size_t     pageCount;
+    PageWatch* owners[PAGE_WATCH_MAX_STEP];
+    rword      pages[PAGE_WATCH_MAX_STEP];
+    unsigned   writeSize;
+    size_t     writeCount;
+    rword      writes[PAGE_WATCH_MAX_STEP];
+};
+
+// Last reported fault, the instrumentation of an instruction may access the same address before
+// the instruction itself.
+struct LastFault {
+    const ExecBlock* block;
+    uint16_t         instID;
+    rword            pc;
+};
+
+static thread_local PendingStep pendingStep;
+static thread_local LastFault lastFault;
+static thread_local bool threadReady = false;
+
+// Size of the FPRState synchronized with a signal frame: the FXSAVE area, followed by the XSAVE
+// header and the upper halves of the YMM registers if both the frame and the FPRState hold them.
+// The AVX-512 components are not synchronized.
+static size_t getFrameFPRSize(const void* fpregs) {
+    const FxSwBytes* swBytes = (const FxSwBytes*) ((const uint8_t*) fpregs + FX_SW_BYTES_OFFSET);
+    if(swBytes->magic1 == FP_XSTATE_MAGIC1 && (swBytes->xfeatures & XSTATE_YMM) != 0 &&
+       (getXSaveMask() & XSTATE_YMM) != 0 && swBytes->xstateSize >= offsetof(FPRState, rsrv5)) {
+        return offsetof(FPRState, rsrv5);
+    }
+    return FXSAVE_SIZE;
+}
+
+// Process wide state, only changed by setWatches. It is not synchronized with the signal handler,
+// see the PageWatch class documentation.
+static std::vector<PageWatch*> watchRegistry;
+static struct sigaction previousSegv;
+static struct sigaction previousTrap;
+static bool handlerInstalled = false;
+
+static void chainSignal(int sig, siginfo_t* info, void* uc, const struct sigaction& previous) {
+    if(previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(sig, info, uc);
+    }
+    else if(previous.sa_handler == SIG_DFL) {
+        // The faulting instruction is executed again and triggers the default action
+        signal(sig, SIG_DFL);
+    }
+    else if(previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(sig);
+    }
+}
+
+static void pageWatchHandler(int sig, siginfo_t* info, void* uc) {
+    if(sig == SIGSEGV) {
+        bool nested = pendingStep.watch != nullptr;
+        for(PageWatch* watch : watchRegistry) {
+            if(watch->handleFault((rword) info->si_addr, uc, nested)) {
+                return;
+            }
+        }
+        chainSignal(sig, info, uc, previousSegv);
+    }
+    else {
+        if(pendingStep.watch != nullptr && info->si_code == TRAP_TRACE) {
+            pendingStep.watch->handleStep(uc);
+            return;
+        }
+        chainSignal(sig, info, uc, previousTrap);
+    }
+}
+
+// The handler runs on an alternate stack such that watched pages can share the guest stack, and
+// the thread local state is touched outside of the handler.
+static void prepareThread() {
+    if(threadReady) {
+        return;
+    }
+    stack_t current;
+    if(sigaltstack(nullptr, &current) == 0 && (current.ss_flags & SS_DISABLE)) {
+        stack_t altStack;
+        altStack.ss_sp = mmap(nullptr, ALT_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        altStack.ss_size = ALT_STACK_SIZE;
+        altStack.ss_flags = 0;
+        if(altStack.ss_sp == MAP_FAILED || sigaltstack(&altStack, nullptr) != 0) {
+            LogWarning("PageWatch::prepareThread", "Could not set an alternate signal stack");
+        }
+    }
+    memset(&pendingStep, 0, sizeof(PendingStep));
+    memset(&lastFault, 0, sizeof(LastFault));
+    threadReady = true;
+}
+
+static void installHandler() {
+    if(handlerInstalled) {
+        return;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = pageWatchHandler;
+    sigemptyset(&action.sa_mask);
+    // Callbacks may fault on other watched pages while a fault is handled
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigaction(SIGSEGV, &action, &previousSegv);
+    sigaction(SIGTRAP, &action, &previousTrap);
+    handlerInstalled = true;
+}
+
+static int toProt(Permission permission) {
+    return ((permission & PF_READ) ? PROT_READ : 0) |
+           ((permission & PF_WRITE) ? PROT_WRITE : 0) |
+           ((permission & PF_EXEC) ? PROT_EXEC : 0);
+}
+
+PageWatch::PageWatch(VMInstanceRef vminstance, Engine* engine) : vminstance(vminstance), engine(engine),
+    pageSize((rword) sysconf(_SC_PAGESIZE)), running(false) {}
+
+PageWatch::~PageWatch() {
+    setWatches({});
+}
+
+bool PageWatch::isSupported() {
+    return true;
+}
+
+bool PageWatch::setWatches(const std::vector<Entry>& entries) {
+    bool ok = true;
+    prepareThread();
+    watchIndex.build(entries);
+
+    // A page with a read watch can not be accessed at all, else only writes are forbidden
+    std::map<rword, bool> watchedPages;
+    for(const Entry& entry : entries) {
+        if(entry.first.size() == 0) {
+            continue;
+        }
+        for(rword page = entry.first.start & ~(pageSize - 1); page < entry.first.end && page != 0 - pageSize; page += pageSize) {
+            watchedPages[page] |= (entry.second.type & MEMORY_READ) != 0;
+        }
+    }
+
+    // Restore the pages which are not watched anymore
+    for(std::map<rword, PageInfo>::iterator it = pages.begin(); it != pages.end();) {
+        if(watchedPages.count(it->first) == 0) {
+            mprotect((void*) it->first, pageSize, it->second.originalProt);
+            it = pages.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+
+    std::vector<MemoryMap> maps;
+    for(const std::pair<rword, bool>& watchedPage : watchedPages) {
+        std::map<rword, PageInfo>::iterator it = pages.find(watchedPage.first);
+        if(it == pages.end()) {
+            // Lookup the original protection of the page once
+            if(maps.empty()) {
+                maps = getCurrentProcessMaps();
+            }
+            std::vector<MemoryMap>::const_iterator map = std::find_if(maps.begin(), maps.end(),
+                [&](const MemoryMap& m) { return m.range.contains(watchedPage.first); });
+            if(map == maps.end()) {
+                LogError("PageWatch::setWatches", "Page 0x%" PRIRWORD " is not mapped", watchedPage.first);
+                ok = false;
+                continue;
+            }
+            it = pages.insert(std::make_pair(watchedPage.first, PageInfo {toProt(map->permission), 0})).first;
+        }
+        it->second.watchProt = watchedPage.second ? PROT_NONE : (it->second.originalProt & ~PROT_WRITE);
+        if(mprotect((void*) it->first, pageSize, it->second.watchProt) != 0) {
+            LogError("PageWatch::setWatches", "Could not protect page 0x%" PRIRWORD, it->first);
+            pages.erase(it);
+            ok = false;
+        }
+    }
+
+    std::vector<PageWatch*>::iterator registered = std::find(watchRegistry.begin(), watchRegistry.end(), this);
+    if(pages.empty() && registered != watchRegistry.end()) {
+        watchRegistry.erase(registered);
+    }
+    else if(!pages.empty() && registered == watchRegistry.end()) {
+        installHandler();
+        watchRegistry.push_back(this);
+    }
+    return ok;
+}
+
+void PageWatch::setRunning(bool running) {
+    prepareThread();
+    lastFault.block = nullptr;
+    this->running = running;
+}
+
+void PageWatch::reprotect(rword page) {
+    std::map<rword, PageInfo>::const_iterator it = pages.find(page);
+    if(it != pages.end()) {
+        mprotect((void*) page, pageSize, it->second.watchProt);
+    }
+}
+
+void PageWatch::dispatch(rword address, rword size, MemoryAccessType type, bool postInst, void* uc) {
+    mcontext_t* mcontext = &((ucontext_t*) uc)->uc_mcontext;
+    ExecBlock* block = engine->getCurExecBlock();
+    const InstMetadata* metadata = block->getInstMetadata(lastFault.instID);
+    GPRState* gprState = engine->getGPRState();
+    FPRState* fprState = engine->getFPRState();
+
+    // The guest registers are live except the temporaries of the patch which were saved in the
+    // context
+    for(unsigned i = 0; i <= REG_SP; i++) {
+        if((metadata->tempRegs & (1u << i)) == 0) {
+            QBDI_GPR_SET(gprState, i, (rword) mcontext->gregs[UC_GPR_ID[i]]);
+        }
+    }
+    QBDI_GPR_SET(gprState, REG_PC, postInst ? metadata->endAddress() : metadata->address);
+    gprState->eflags = (rword) (mcontext->gregs[REG_EFL] & ~TRAP_FLAG);
+    // The guest FPR are only in the registers if the block switched them (see OPT_LAZY_FPR), the
+    // callbacks otherwise get the state stored in the context
+    size_t fprSize = 0;
+    if(block->getContext()->hostState.fprSwitch != 0 && mcontext->fpregs != nullptr) {
+        fprSize = getFrameFPRSize(mcontext->fpregs);
+        memcpy(fprState, mcontext->fpregs, fprSize);
+        if(fprSize > FXSAVE_SIZE) {
+            // XSAVE does not write the components in their initial configuration
+            completeFPRState(fprState);
+        }
+    }
+    block->setCurrentInstID(lastFault.instID);
+
+    uint64_t generation = watchIndex.getGeneration();
+    watchIndex.forEachOverlap(Range<rword>(address, address + size), [&](const Watch& watch) -> bool {
+        if(watch.type & type) {
+            // The execution can not be stopped in the middle of the instruction
+            watch.cbk(vminstance, gprState, fprState, watch.data);
+        }
+        // A callback changed the watches
+        return watchIndex.getGeneration() == generation;
+    });
+
+    // Apply the changes made by the callbacks
+    for(unsigned i = 0; i <= REG_SP; i++) {
+        if((metadata->tempRegs & (1u << i)) == 0) {
+            mcontext->gregs[UC_GPR_ID[i]] = (greg_t) QBDI_GPR_GET(gprState, i);
+        }
+    }
+    mcontext->gregs[REG_EFL] = (greg_t) gprState->eflags | (mcontext->gregs[REG_EFL] & TRAP_FLAG);
+    if(fprSize > 0) {
+        memcpy(mcontext->fpregs, fprState, fprSize);
+        if(fprSize > FXSAVE_SIZE) {
+            // The synchronized components are restored from the frame even if they were in their
+            // initial configuration
+            uint64_t* xstatebv = (uint64_t*) ((uint8_t*) mcontext->fpregs + offsetof(FPRState, xstatebv));
+            *xstatebv |= XSTATE_LEGACY | XSTATE_YMM;
+        }
+    }
+}
+
+bool PageWatch::handleFault(rword address, void* uc, bool nested) {
+    rword page = address & ~(pageSize - 1);
+    std::map<rword, PageInfo>::const_iterator it = pages.find(page);
+    if(it == pages.end()) {
+        return false;
+    }
+    mcontext_t* mcontext = &((ucontext_t*) uc)->uc_mcontext;
+    rword pc = (rword) mcontext->gregs[REG_RIP];
+
+    // Let the access through, the page is protected again after the single step. If too many
+    // pages are unprotected by a single step the extra ones are lost.
+    mprotect((void*) page, pageSize, it->second.originalProt);
+    if(pendingStep.pageCount < PAGE_WATCH_MAX_STEP) {
+        pendingStep.owners[pendingStep.pageCount] = this;
+        pendingStep.pages[pendingStep.pageCount] = page;
+        pendingStep.pageCount++;
+    }
+    if(nested) {
+        // Faults of the callbacks are not reported, only the ones of the stepped access
+        if(pc != pendingStep.pc || pendingStep.watch != this) {
+            return true;
+        }
+    }
+    else {
+        pendingStep.watch = this;
+        pendingStep.pc = pc;
+        pendingStep.pushFlags = false;
+        pendingStep.writeSize = 0;
+        pendingStep.writeCount = 0;
+        mcontext->gregs[REG_EFL] |= TRAP_FLAG;
+    }
+
+    // Map the faulting code back to the guest instruction, accesses outside of the JIT code are
+    // not reported
+    if(running == false || engine->getCurExecBlock() == nullptr) {
+        return true;
+    }
+    const ExecBlock* block = engine->getCurExecBlock();
+    uint16_t instID = block->getInstIDByCodeAddress(pc);
+    if(instID == NOT_FOUND) {
+        return true;
+    }
+    const llvm::MCInst* inst = block->getOriginalMCInst(instID);
+    if(!nested) {
+        pendingStep.pushFlags = inst->getOpcode() == llvm::X86::PUSHF64 || inst->getOpcode() == llvm::X86::PUSHF16;
+    }
+    unsigned readSize = getReadSize(inst);
+    unsigned writeSize = getWriteSize(inst);
+    // The write callbacks follow the step of the instruction itself, not the one of an earlier read
+    // of the same address by its instrumentation. A read-modify-write access to an unreadable page
+    // faults as a read.
+    bool writeFault = (mcontext->gregs[REG_ERR] & FAULT_WRITE_FLAG) != 0;
+    if(writeSize > 0 && pendingStep.writeCount < PAGE_WATCH_MAX_STEP && (writeFault || block->isMemoryWriteAt(pc))) {
+        pendingStep.writeSize = writeSize;
+        pendingStep.writes[pendingStep.writeCount++] = address;
+    }
+    if(!nested && block == lastFault.block && instID == lastFault.instID && pc > lastFault.pc) {
+        return true;
+    }
+    lastFault.block = block;
+    lastFault.instID = instID;
+    lastFault.pc = pc;
+
+    if(readSize > 0) {
+        dispatch(address, readSize, MEMORY_READ, false, uc);
+    }
+    return true;
+}
+
+void PageWatch::handleStep(void* uc) {
+    mcontext_t* mcontext = &((ucontext_t*) uc)->uc_mcontext;
+    mcontext->gregs[REG_EFL] &= ~TRAP_FLAG;
+    // A stepped PUSHF stored the trap flag of the step, which a later POPF would restore
+    if(pendingStep.pushFlags) {
+        *((uint16_t*) mcontext->gregs[REG_RSP]) &= (uint16_t) ~TRAP_FLAG;
+    }
+
+    for(size_t i = 0; i < pendingStep.writeCount; i++) {
+        dispatch(pendingStep.writes[i], pendingStep.writeSize, MEMORY_WRITE, true, uc);
+    }
+    for(size_t i = 0; i < pendingStep.pageCount; i++) {
+        pendingStep.owners[i]->reprotect(pendingStep.pages[i]);
+    }
+    memset(&pendingStep, 0, sizeof(PendingStep));
+}
+
+#else
+
+PageWatch::PageWatch(VMInstanceRef vminstance, Engine* engine) : vminstance(vminstance), engine(engine),
+    pageSize(0), running(false) {}
+
+PageWatch::~PageWatch() {}
+
+bool PageWatch::isSupported() {
+    return false;
+}
+
+bool PageWatch::setWatches(const std::vector<Entry>& entries) {
+    return entries.empty();
+}
+
+void PageWatch::setRunning(bool running) {
+    this->running = running;
+}
+
+void PageWatch::reprotect(rword page) {}
+
+void PageWatch::dispatch(rword address, rword size, MemoryAccessType type, bool postInst, void* uc) {}
+
+bool PageWatch::handleFault(rword address, void* uc, bool nested) {
+    return false;
+}
+
+void PageWatch::handleStep(void* uc) {}
+
+#endif
+
+}
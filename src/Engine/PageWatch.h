@@ -0,0 +1,126 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PAGEWATCH_H
+#define PAGEWATCH_H
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "Callback.h"
+#include "Range.h"
+#include "State.h"
+#include "Utility/RangeIndex.h"
+
+namespace QBDI {
+
+class Engine;
+
+/*! Memory range callbacks implemented with page protections. The pages of the watched ranges
+ *  are protected such that the guest code runs without memory access instrumentation. The fault
+ *  of an access is mapped back to the guest instruction through the ExecBlock metadata, the
+ *  callbacks are called, then the access is single stepped before protecting the page again.
+ *
+ *  Read callbacks are called before the access and write callbacks after it. The VMAction
+ *  returned by the callbacks is ignored since the execution can not be interrupted in the
+ *  middle of an instruction.
+ *
+ *  The page protections and the signal handler are process wide: the watches must be changed
+ *  while no other thread runs a VM or accesses the watched pages, the registry of the instances
+ *  read by the signal handler is not synchronized.
+ */
+class PageWatch {
+public:
+
+    struct Watch {
+        MemoryAccessType type;
+        InstCallback     cbk;
+        void*            data;
+    };
+
+    using Entry = std::pair<Range<rword>, Watch>;
+
+private:
+
+    struct PageInfo {
+        int originalProt;
+        int watchProt;
+    };
+
+    VMInstanceRef              vminstance;
+    Engine*                    engine;
+    RangeIndex<Watch>          watchIndex;
+    std::map<rword, PageInfo>  pages;
+    rword                      pageSize;
+    bool                       running;
+
+    void dispatch(rword address, rword size, MemoryAccessType type, bool postInst, void* uc);
+
+public:
+
+    PageWatch(VMInstanceRef vminstance, Engine* engine);
+
+    ~PageWatch();
+
+    /*! Check if page protection watching is implemented on this platform.
+     *
+     * @return True if it is implemented.
+     */
+    static bool isSupported();
+
+    /*! Replace the watched ranges and update the page protections.
+     *
+     * @param[in] entries  The watched ranges and their callbacks.
+     *
+     * @return False if the protection of a page could not be changed.
+     */
+    bool setWatches(const std::vector<Entry>& entries);
+
+    /*! Mark the guest as running, faults raised by the JIT code are only mapped back to the
+     *  guest instructions while the guest is running.
+     *
+     * @param[in] running  True when the execution of the VM starts, false when it ends.
+     */
+    void setRunning(bool running);
+
+    /*! Handle a fault on a watched page. Called by the signal handler.
+     *
+     * @param[in] address  The faulting address.
+     * @param[in] uc       The signal context of the fault.
+     * @param[in] nested   True if the fault happened while handling a previous fault.
+     *
+     * @return False if the page is not watched by this instance.
+     */
+    bool handleFault(rword address, void* uc, bool nested);
+
+    /*! Complete the single step of a faulting access. Called by the signal handler.
+     *
+     * @param[in] uc  The signal context after the access.
+     */
+    void handleStep(void* uc);
+
+    /*! Protect again a page once a faulting access has been single stepped.
+     *
+     * @param[in] page  The page address.
+     */
+    void reprotect(rword page);
+};
+
+}
+
+#endif // PAGEWATCH_H
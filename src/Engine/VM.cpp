@@ -21,8 +21,12 @@
 #include "Memory.h"
 
 #include "Engine/Engine.h"
+#include "Engine/PageWatch.h"
 #include "Patch/InstrRules.h"
 #include "Utility/LogSys.h"
+#include "Utility/RangeIndex.h"
+
+#include <algorithm>
 
 // Mask to identify Virtual Callback events
 #define EVENTID_VIRTCB_MASK  (1UL << 31)
@@ -34,71 +38,243 @@ struct MemCBInfo {
     Range<rword> range;
     InstCallback cbk;
     void* data;
+    bool pageWatch;
 };
 
-VMAction memReadGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
-    std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos = (std::vector<std::pair<uint32_t, MemCBInfo>>*) data;
-    std::vector<MemoryAccess> memAccesses = vm->getInstMemoryAccess();
+struct MemAccessListCBInfo {
+    MemoryAccessType type;
+    MemAccessListCallback cbk;
+    void* data;
+};
+
+struct MemTraceInfo {
+    MemoryAccessType type;
+    MemTraceCallback cbk;
+    void* data;
+    std::vector<MemoryAccess> records;
+    // Address of the next record, advanced by the instrumentation
+    rword cursor;
+    // Hits when the cursor reaches the end of the records
+    MemRangeFilter full;
+    uint32_t readID;
+    uint32_t writeID;
+};
+
+struct BlockTraceInfo {
+    BlockTraceCallback cbk;
+    void* data;
+    std::vector<rword> blocks;
+    // Cursor and bounds read by the instrumentation
+    BlockTrace trace;
+};
+
+// An instruction makes at most one read and one write access
+static const size_t MEM_ACCESS_BUFFER_SIZE = 4;
+
+static void buildMemCBIndex(RangeIndex<MemCBInfo>* memCBIndex, const std::vector<std::pair<uint32_t, MemCBInfo>>& memCBInfos) {
+    std::vector<RangeIndex<MemCBInfo>::Entry> entries;
+    entries.reserve(memCBInfos.size());
+    for(const std::pair<uint32_t, MemCBInfo>& memCBInfo : memCBInfos) {
+        if(memCBInfo.second.pageWatch == false) {
+            entries.push_back(std::make_pair(memCBInfo.second.range, memCBInfo.second));
+        }
+    }
+    memCBIndex->build(entries);
+}
+
+// Maximum size of a memory access, the filters are widened by this size such that an access
+// starting before a range but overlapping it is caught.
+static const rword MEM_ACCESS_MAX_SIZE = 64;
+// Upper bound of the filter boxes, see MemRangeFilter
+static const rword MEM_FILTER_LIMIT = ((rword) 1) << 56;
+
+// The box of the ranges reached by one type of access through a gate. Read accesses are also
+// forwarded by the write gate to the MEMORY_READ_WRITE ranges.
+static void buildMemRangeFilter(MemRangeFilter* filter, const std::vector<std::pair<uint32_t, MemCBInfo>>& memCBInfos,
+                                bool writeGate, MemoryAccessType access) {
+    rword start = MEM_FILTER_LIMIT;
+    rword end = 0;
+    for(const std::pair<uint32_t, MemCBInfo>& memCBInfo : memCBInfos) {
+        const MemCBInfo& info = memCBInfo.second;
+        if(info.pageWatch || (info.type & access) == 0) {
+            continue;
+        }
+        if(writeGate ? (info.type & MEMORY_WRITE) != 0 : info.type == MEMORY_READ) {
+            start = std::min(start, info.range.start);
+            end = std::max(end, info.range.end);
+        }
+    }
+    start = start > MEM_ACCESS_MAX_SIZE ? start - MEM_ACCESS_MAX_SIZE : 0;
+    end = std::min(end, MEM_FILTER_LIMIT - 1);
+    // An empty box never hits
+    rword size = end > start ? end - start : 0;
+    start = std::min(start, MEM_FILTER_LIMIT - 1);
+    filter->negStart = (rword) 0 - start;
+    filter->negSize = (rword) 0 - size;
+    // A write whose address is unknown may hit any range of the box
+    filter->writeFallback = start;
+}
+
+static void buildPageWatch(PageWatch* pageWatch, const std::vector<std::pair<uint32_t, MemCBInfo>>& memCBInfos) {
+    std::vector<PageWatch::Entry> entries;
+    for(const std::pair<uint32_t, MemCBInfo>& memCBInfo : memCBInfos) {
+        const MemCBInfo& info = memCBInfo.second;
+        if(info.pageWatch) {
+            entries.push_back(std::make_pair(info.range, PageWatch::Watch {info.type, info.cbk, info.data}));
+        }
+    }
+    pageWatch->setWatches(entries);
+}
+
+static VMAction memRangeGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, const RangeIndex<MemCBInfo>* memCBIndex,
+                             bool writeGate) {
+    MemoryAccess memAccesses[MEM_ACCESS_BUFFER_SIZE];
+    size_t count = std::min(vm->getInstMemoryAccess(memAccesses, MEM_ACCESS_BUFFER_SIZE), MEM_ACCESS_BUFFER_SIZE);
     VMAction action = VMAction::CONTINUE;
-    for(const MemoryAccess& memAccess : memAccesses) {
+    uint64_t generation = memCBIndex->getGeneration();
+    for(const MemoryAccess& memAccess : llvm::makeArrayRef(memAccesses, count)) {
         Range<rword> accessRange(memAccess.accessAddress, memAccess.accessAddress + memAccess.size);
-        for(size_t i = 0; i < memCBInfos->size(); i++) {
+        // Only the callbacks whose range overlaps the access are visited
+        memCBIndex->forEachOverlap(accessRange, [&](const MemCBInfo& memCBInfo) -> bool {
             // Check access type
-            if((*memCBInfos)[i].second.type == MEMORY_READ && (memAccess.type & (*memCBInfos)[i].second.type)) {
-                // Check access range
-                if((*memCBInfos)[i].second.range.overlaps(accessRange)) {
-                    // Forward to virtual callback
-                    VMAction ret = (*memCBInfos)[i].second.cbk(vm, gprState, fprState, (*memCBInfos)[i].second.data);
-                    // Always keep the most extreme action as the return
-                    if(ret > action) {
-                        action = ret;
-                    }
+            bool gateType = writeGate ? (memCBInfo.type & MEMORY_WRITE) != 0 : memCBInfo.type == MEMORY_READ;
+            if(gateType && (memAccess.type & memCBInfo.type)) {
+                // Forward to virtual callback
+                VMAction ret = memCBInfo.cbk(vm, gprState, fprState, memCBInfo.data);
+                // Always keep the most extreme action as the return
+                if(ret > action) {
+                    action = ret;
                 }
             }
+            // The callback invalidated the index by adding or deleting a virtual callback
+            return memCBIndex->getGeneration() == generation;
+        });
+        if(memCBIndex->getGeneration() != generation) {
+            break;
         }
     }
     return action;
 }
 
+VMAction memReadGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    return memRangeGate(vm, gprState, fprState, (const RangeIndex<MemCBInfo>*) data, false);
+}
+
 VMAction memWriteGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
-    std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos = (std::vector<std::pair<uint32_t, MemCBInfo>>*) data;
-    std::vector<MemoryAccess> memAccesses = vm->getInstMemoryAccess();
-    VMAction action = VMAction::CONTINUE;
-    for(const MemoryAccess& memAccess : memAccesses) {
-        Range<rword> accessRange(memAccess.accessAddress, memAccess.accessAddress + memAccess.size);
-        for(size_t i = 0; i < memCBInfos->size(); i++) {
-            // Check access type
-            if(((*memCBInfos)[i].second.type & MEMORY_WRITE) && (memAccess.type & (*memCBInfos)[i].second.type)) {
-                // Check access range
-                if((*memCBInfos)[i].second.range.overlaps(accessRange)) {
-                    // Forward to virtual callback
-                    VMAction ret = (*memCBInfos)[i].second.cbk(vm, gprState, fprState, (*memCBInfos)[i].second.data);
-                    // Always keep the most extreme action as the return
-                    if(ret > action) {
-                        action = ret;
-                    }
-                }
-            }
+    return memRangeGate(vm, gprState, fprState, (const RangeIndex<MemCBInfo>*) data, true);
+}
+
+VMAction memAccessListGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    const MemAccessListCBInfo* info = (const MemAccessListCBInfo*) data;
+    MemoryAccess memAccesses[MEM_ACCESS_BUFFER_SIZE];
+    size_t count = std::min(vm->getInstMemoryAccess(memAccesses, MEM_ACCESS_BUFFER_SIZE), MEM_ACCESS_BUFFER_SIZE);
+    // Only forward the accesses of the registered type
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(memAccesses[i].type & info->type) {
+            memAccesses[kept++] = memAccesses[i];
         }
     }
-    return action;
+    return info->cbk(vm, gprState, fprState, memAccesses, kept, info->data);
+}
+
+VMAction memTraceGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    vm->flushMemTrace();
+    return VMAction::CONTINUE;
+}
+
+VMAction blockTraceGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    vm->flushBlockTrace();
+    return VMAction::CONTINUE;
 }
 
 VMAction stopCallback(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
     return VMAction::STOP;
 }
 
-VM::VM(const std::string& cpu, const std::vector<std::string>& mattrs) :
+VM::VM(const std::string& cpu, const std::vector<std::string>& mattrs, Options options) :
     memoryLoggingLevel(0), memCBID(0), memReadGateCBID(VMError::INVALID_EVENTID), memWriteGateCBID(VMError::INVALID_EVENTID) {
-    engine = new Engine(cpu, mattrs, this);
+    engine = new Engine(cpu, mattrs, this, options);
     memCBInfos = new std::vector<std::pair<uint32_t, MemCBInfo>>;
+    memCBIndex = new RangeIndex<MemCBInfo>;
+    memReadFilter = new MemRangeFilter;
+    memWriteFilter = new MemRangeFilter;
+    memReadWriteFilter = new MemRangeFilter;
+    pageWatch = new PageWatch(this, engine);
+    updateMemRangeCBs();
+    inlineCounters = new std::map<uint32_t, uint64_t*>;
+    blockCounters = new std::map<rword, uint64_t>;
+    releasedCounters = new std::vector<std::pair<uint32_t, uint64_t*>>;
+    memAccessListCBInfos = new std::vector<std::pair<uint32_t, MemAccessListCBInfo*>>;
+    releasedCBInfos = new std::vector<std::pair<uint32_t, MemAccessListCBInfo*>>;
+    memTrace = new MemTraceInfo {(MemoryAccessType) 0, nullptr, nullptr, {}, 0, {0, 0, 0}, VMError::INVALID_EVENTID,
+                                 VMError::INVALID_EVENTID};
+    blockTrace = new BlockTraceInfo {nullptr, nullptr, {}, {0, 0, blockTraceGate, nullptr}};
 }
 
 VM::~VM() {
+    for(const std::pair<uint32_t, MemAccessListCBInfo*>& info : *memAccessListCBInfos) {
+        delete info.second;
+    }
+    delete memAccessListCBInfos;
+    for(const std::pair<uint32_t, MemAccessListCBInfo*>& info : *releasedCBInfos) {
+        delete info.second;
+    }
+    delete releasedCBInfos;
+    delete blockTrace;
+    delete memTrace;
+    for(const std::pair<const uint32_t, uint64_t*>& counter : *inlineCounters) {
+        delete counter.second;
+    }
+    delete inlineCounters;
+    for(const std::pair<uint32_t, uint64_t*>& counter : *releasedCounters) {
+        delete counter.second;
+    }
+    delete releasedCounters;
+    delete pageWatch;
+    delete blockCounters;
+    delete memReadWriteFilter;
+    delete memWriteFilter;
+    delete memReadFilter;
+    delete memCBIndex;
     delete memCBInfos;
     delete engine;
 }
 
+void VM::releaseFlushed() {
+    // The infos and counters of deleted instrumentations are released once a cache flush was
+    // committed after their deletion, the code using them can't be executed anymore
+    uint32_t flushCount = engine->getFlushCount();
+    size_t i = 0;
+    while(i < releasedCBInfos->size()) {
+        if((*releasedCBInfos)[i].first != flushCount) {
+            delete (*releasedCBInfos)[i].second;
+            releasedCBInfos->erase(releasedCBInfos->begin() + i);
+        }
+        else {
+            i++;
+        }
+    }
+    i = 0;
+    while(i < releasedCounters->size()) {
+        if((*releasedCounters)[i].first != flushCount) {
+            delete (*releasedCounters)[i].second;
+            releasedCounters->erase(releasedCounters->begin() + i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+void VM::updateMemRangeCBs() {
+    buildMemCBIndex(memCBIndex, *memCBInfos);
+    buildMemRangeFilter(memReadFilter, *memCBInfos, false, MEMORY_READ);
+    buildMemRangeFilter(memWriteFilter, *memCBInfos, true, MEMORY_WRITE);
+    buildMemRangeFilter(memReadWriteFilter, *memCBInfos, true, MEMORY_READ);
+    buildPageWatch(pageWatch, *memCBInfos);
+}
+
 GPRState* VM::getGPRState() const {
     return engine->getGPRState();
 }
@@ -118,6 +294,54 @@ void VM::setFPRState(FPRState* fprState) {
     engine->setFPRState(fprState);
 }
 
+Options VM::getOptions() const {
+    return engine->getOptions();
+}
+
+void VM::setOptions(Options options) {
+    engine->setOptions(options);
+}
+
+bool VM::setCoverageMap(uint8_t* map, size_t size) {
+    return engine->setCoverageMap(map, size);
+}
+
+bool VM::setBlockTrace(BlockTraceCallback cbk, void* data, size_t capacity) {
+    RequireAction("VM::setBlockTrace", cbk == nullptr || capacity > 0, return false);
+#ifdef QBDI_ARCH_X86_64
+    // The addresses of the previous trace are handed to its own callback
+    flushBlockTrace();
+    blockTrace->cbk = cbk;
+    blockTrace->data = data;
+    if(cbk == nullptr) {
+        // The buffer is kept, the translated code may run until the cache flush is committed
+        engine->setBlockTrace(nullptr);
+        return true;
+    }
+    // The instrumentation only addresses the trace structure, the buffer can be reallocated
+    blockTrace->blocks.assign(capacity, 0);
+    blockTrace->trace.cursor = (rword) blockTrace->blocks.data();
+    blockTrace->trace.negEnd = (rword) 0 - (blockTrace->trace.cursor + capacity * sizeof(rword));
+    engine->setBlockTrace(&blockTrace->trace);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void VM::flushBlockTrace() {
+    rword begin = (rword) blockTrace->blocks.data();
+    if(blockTrace->trace.cursor == begin) {
+        return;
+    }
+    // A disabled trace may still be appended until the cache flush is committed
+    if(blockTrace->cbk != nullptr) {
+        size_t count = (blockTrace->trace.cursor - begin) / sizeof(rword);
+        blockTrace->cbk(this, blockTrace->blocks.data(), count, blockTrace->data);
+    }
+    blockTrace->trace.cursor = begin;
+}
+
 void VM::addInstrumentedRange(rword start, rword end) {
     RequireAction("VM::addInstrumentedRange", start < end, return);
     engine->addInstrumentedRange(start, end);
@@ -154,8 +378,13 @@ bool VM::removeInstrumentedModuleFromAddr(rword addr) {
 
 bool VM::run(rword start, rword stop) {
     uint32_t stopCB = addCodeAddrCB(stop, InstPosition::PREINST, stopCallback, nullptr);
+    pageWatch->setRunning(true);
     bool ret = engine->run(start, stop);
+    pageWatch->setRunning(false);
     deleteInstrumentation(stopCB);
+    releaseFlushed();
+    flushMemTrace();
+    flushBlockTrace();
     return ret;
 }
 
@@ -244,6 +473,89 @@ uint32_t VM::addCodeRangeCB(rword start, rword end, InstPosition pos, InstCallba
     ));
 }
 
+uint32_t VM::addInlineCounter(rword start, rword end) {
+    RequireAction("VM::addInlineCounter", start < end, return VMError::INVALID_EVENTID);
+#if defined(QBDI_ARCH_X86_64)
+    uint64_t* counter = new uint64_t(0);
+    uint32_t id = addInstrRule(InstrRule(
+        InstructionInRange(start, end),
+        {
+            IncrementCounter(Temp(0), Temp(1), Constant((rword) counter)),
+        },
+        InstPosition::PREINST,
+        false
+    ));
+    if(id == VMError::INVALID_EVENTID) {
+        delete counter;
+        return id;
+    }
+    (*inlineCounters)[id] = counter;
+    return id;
+#else
+    return VMError::INVALID_EVENTID;
+#endif
+}
+
+uint32_t VM::addInlineAddrCounter(rword address) {
+    return addInlineCounter(address, address + 1);
+}
+
+uint64_t VM::getInlineCounter(uint32_t id) const {
+    std::map<uint32_t, uint64_t*>::const_iterator counter = inlineCounters->find(id);
+    if(counter == inlineCounters->end()) {
+        return 0;
+    }
+    return *counter->second;
+}
+
+void VM::getInlineCounters(const uint32_t* ids, uint64_t* values, size_t count) const {
+    RequireAction("VM::getInlineCounters", count == 0 || (ids != nullptr && values != nullptr), return);
+    for(size_t i = 0; i < count; i++) {
+        values[i] = getInlineCounter(ids[i]);
+    }
+}
+
+void VM::resetInlineCounters() {
+    for(const std::pair<const uint32_t, uint64_t*>& counter : *inlineCounters) {
+        *counter.second = 0;
+    }
+    // The counters are referenced by the translated code, they are reset but never erased
+    for(std::pair<const rword, uint64_t>& counter : *blockCounters) {
+        counter.second = 0;
+    }
+}
+
+bool VM::setInlineBBCounters(bool enable) {
+#ifdef QBDI_ARCH_X86_64
+    engine->setBlockCounters(enable ? blockCounters : nullptr);
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t VM::getInlineBBCounter(rword address) const {
+    std::map<rword, uint64_t>::const_iterator counter = blockCounters->find(address);
+    if(counter == blockCounters->end()) {
+        return 0;
+    }
+    return counter->second;
+}
+
+size_t VM::getInlineBBCounters(rword* addresses, uint64_t* values, size_t count) const {
+    RequireAction("VM::getInlineBBCounters", count == 0 || (addresses != nullptr && values != nullptr), return 0);
+    size_t i = 0;
+    for(const std::pair<const rword, uint64_t>& counter : *blockCounters) {
+        if(i >= count) {
+            break;
+        }
+        addresses[i] = counter.first;
+        values[i] = counter.second;
+        i++;
+    }
+    return blockCounters->size();
+}
+
 uint32_t VM::addMemAccessCB(MemoryAccessType type, InstCallback cbk, void *data) {
     RequireAction("VM::addMemAccessCB", cbk != nullptr, return VMError::INVALID_EVENTID);
     recordMemoryAccess(type);
@@ -278,6 +590,19 @@ uint32_t VM::addMemAccessCB(MemoryAccessType type, InstCallback cbk, void *data)
 }
 
 
+uint32_t VM::addMemAccessListCB(MemoryAccessType type, MemAccessListCallback cbk, void *data) {
+    RequireAction("VM::addMemAccessListCB", type & MEMORY_READ_WRITE, return VMError::INVALID_EVENTID);
+    RequireAction("VM::addMemAccessListCB", cbk != nullptr, return VMError::INVALID_EVENTID);
+    MemAccessListCBInfo* info = new MemAccessListCBInfo {type, cbk, data};
+    uint32_t id = addMemAccessCB(type, memAccessListGate, info);
+    if(id == VMError::INVALID_EVENTID) {
+        delete info;
+        return id;
+    }
+    memAccessListCBInfos->push_back(std::make_pair(id, info));
+    return id;
+}
+
 uint32_t VM::addMemAddrCB(rword address, MemoryAccessType type, InstCallback cbk, void *data) {
     RequireAction("VM::addMemAddrCB", cbk != nullptr, return VMError::INVALID_EVENTID);
     return addMemRangeCB(address, address + 1, type, cbk, data);
@@ -287,15 +612,57 @@ uint32_t VM::addMemRangeCB(rword start, rword end, MemoryAccessType type, InstCa
     RequireAction("VM::addMemRangeCB", start < end, return VMError::INVALID_EVENTID);
     RequireAction("VM::addMemRangeCB", type & MEMORY_READ_WRITE, return VMError::INVALID_EVENTID);
     RequireAction("VM::addMemRangeCB", cbk != nullptr, return VMError::INVALID_EVENTID);
-    if((type == MEMORY_READ) && memReadGateCBID == VMError::INVALID_EVENTID) {
-        memReadGateCBID = addMemAccessCB(MEMORY_READ, memReadGate, memCBInfos);
+    // Page protections replace the instrumentation of every memory access
+    bool usePageWatch = (engine->getOptions() & OPT_PAGE_WATCH) && PageWatch::isSupported();
+    if(!usePageWatch && (type == MEMORY_READ) && memReadGateCBID == VMError::INVALID_EVENTID) {
+#if defined(QBDI_ARCH_X86_64)
+        // The gate is only called when the read address hits the filter of the read ranges
+        recordMemoryAccess(MEMORY_READ);
+        PatchGenerator::SharedPtrVec gate = {
+            GetMemFilterAddress(Temp(0), false, memReadFilter),
+            WriteTemp(Temp(0), Offset(offsetof(Context, hostState.scratch))),
+        };
+        append(gate, getCallbackGenerator(memReadGate, memCBIndex));
+        memReadGateCBID = addInstrRule(InstrRule(DoesReadAccess(), gate, InstPosition::PREINST, true, memReadFilter));
+#else
+        memReadGateCBID = addMemAccessCB(MEMORY_READ, memReadGate, memCBIndex);
+#endif
     }
-    if((type & MEMORY_WRITE) && memWriteGateCBID == VMError::INVALID_EVENTID) {
-        memWriteGateCBID = addMemAccessCB(MEMORY_READ_WRITE, memWriteGate, memCBInfos);
+    if(!usePageWatch && (type & MEMORY_WRITE) && memWriteGateCBID == VMError::INVALID_EVENTID) {
+#if defined(QBDI_ARCH_X86_64)
+        // The gate is only called when the write address hits the filter of the write ranges
+        recordMemoryAccess(MEMORY_READ_WRITE);
+        PatchGenerator::SharedPtrVec gate = {
+            GetMemFilterAddress(Temp(0), true, memWriteFilter),
+            WriteTemp(Temp(0), Offset(offsetof(Context, hostState.scratch))),
+        };
+        append(gate, getCallbackGenerator(memWriteGate, memCBIndex));
+        memWriteGateCBID = addInstrRule(InstrRule(DoesWriteAccess(), gate, InstPosition::POSTINST, true, memWriteFilter));
+        // Or, for the read only instructions, when the recorded read address hits the filter of
+        // the MEMORY_READ_WRITE ranges
+        PatchGenerator::SharedPtrVec readGate = {
+            ReadShadow(Temp(0), Shadow(MEM_READ_ADDRESS_TAG)),
+            WriteTemp(Temp(0), Offset(offsetof(Context, hostState.scratch))),
+        };
+        append(readGate, getCallbackGenerator(memWriteGate, memCBIndex));
+        addInstrRule(InstrRule(
+            And({
+                DoesReadAccess(),
+                Not(DoesWriteAccess()),
+            }),
+            readGate,
+            InstPosition::POSTINST,
+            true,
+            memReadWriteFilter
+        ));
+#else
+        memWriteGateCBID = addMemAccessCB(MEMORY_READ_WRITE, memWriteGate, memCBIndex);
+#endif
     }
     uint32_t id = memCBID++;
     RequireAction("VM::addMemRangeCB", id < EVENTID_VIRTCB_MASK, return VMError::INVALID_EVENTID);
-    memCBInfos->push_back(std::make_pair(id, MemCBInfo {type, Range<rword>(start, end), cbk, data}));
+    memCBInfos->push_back(std::make_pair(id, MemCBInfo {type, Range<rword>(start, end), cbk, data, usePageWatch}));
+    updateMemRangeCBs();
     return id | EVENTID_VIRTCB_MASK;
 }
 
@@ -311,22 +678,50 @@ bool VM::deleteInstrumentation(uint32_t id) {
         for(size_t i = 0; i < memCBInfos->size(); i++) {
             if((*memCBInfos)[i].first == id) {
                 memCBInfos->erase(memCBInfos->begin() + i);
+                updateMemRangeCBs();
                 return true;
             }
         }
         return false;
     }
     else {
+        // The info of a memory access list callback and the inline counters are kept until the
+        // next cache flush is committed, as the deleted instrumentation may still be running
+        for(size_t i = 0; i < memAccessListCBInfos->size(); i++) {
+            if((*memAccessListCBInfos)[i].first == id) {
+                releasedCBInfos->push_back(std::make_pair(engine->getFlushCount(), (*memAccessListCBInfos)[i].second));
+                memAccessListCBInfos->erase(memAccessListCBInfos->begin() + i);
+                break;
+            }
+        }
+        std::map<uint32_t, uint64_t*>::iterator counter = inlineCounters->find(id);
+        if(counter != inlineCounters->end()) {
+            releasedCounters->push_back(std::make_pair(engine->getFlushCount(), counter->second));
+            inlineCounters->erase(counter);
+        }
         return engine->deleteInstrumentation(id);
     }
 }
 
 void VM::deleteAllInstrumentations() {
     engine->deleteAllInstrumentations();
+    for(const std::pair<uint32_t, MemAccessListCBInfo*>& info : *memAccessListCBInfos) {
+        releasedCBInfos->push_back(std::make_pair(engine->getFlushCount(), info.second));
+    }
+    memAccessListCBInfos->clear();
+    for(const std::pair<const uint32_t, uint64_t*>& counter : *inlineCounters) {
+        releasedCounters->push_back(std::make_pair(engine->getFlushCount(), counter.second));
+    }
+    inlineCounters->clear();
     memReadGateCBID = VMError::INVALID_EVENTID;
     memWriteGateCBID = VMError::INVALID_EVENTID;
     memCBInfos->clear();
+    updateMemRangeCBs();
     memoryLoggingLevel = 0;
+    flushMemTrace();
+    memTrace->readID = VMError::INVALID_EVENTID;
+    memTrace->writeID = VMError::INVALID_EVENTID;
+    memTrace->cbk = nullptr;
 }
 
 const InstAnalysis* VM::getInstAnalysis(AnalysisType type) {
@@ -373,39 +768,100 @@ bool VM::recordMemoryAccess(MemoryAccessType type) {
 #endif
 }
 
-std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
-    const ExecBlock* curExecBlock = engine->getCurExecBlock();
-    if(curExecBlock == nullptr) {
-        return {};
+bool VM::setMemTrace(MemoryAccessType type, MemTraceCallback cbk, void* data, size_t capacity) {
+    RequireAction("VM::setMemTrace", cbk == nullptr || (type & MEMORY_READ_WRITE), return false);
+    RequireAction("VM::setMemTrace", cbk == nullptr || capacity > 0, return false);
+#ifdef QBDI_ARCH_X86_64
+    // The records of the previous trace are handed to its own callback
+    flushMemTrace();
+    for(uint32_t* id : {&memTrace->readID, &memTrace->writeID}) {
+        if(*id != VMError::INVALID_EVENTID) {
+            engine->deleteInstrumentation(*id);
+            *id = VMError::INVALID_EVENTID;
+        }
     }
-    uint16_t instID = curExecBlock->getCurrentInstID();
-    std::vector<MemoryAccess> memAccess;
-    std::vector<ShadowInfo> shadows = curExecBlock->queryShadowByInst(instID, ANY);
-    LogDebug("VM::getInstMemoryAccess", "Got %zu shadows for Instruction %" PRIu16, shadows.size(), instID);
+    memTrace->type = type;
+    memTrace->cbk = cbk;
+    memTrace->data = data;
+    if(cbk == nullptr) {
+        // The buffer is kept, deleted instrumentation may run until the cache flush is committed
+        return true;
+    }
+    // The instrumentation only addresses the cursor and the filter, the records can be reallocated
+    memTrace->records.assign(capacity, MemoryAccess());
+    memTrace->cursor = (rword) memTrace->records.data();
+    memTrace->full.negStart = (rword) 0 - (memTrace->cursor + capacity * sizeof(MemoryAccess));
+    memTrace->full.negSize = (rword) 0 - 1;
+    memTrace->full.writeFallback = 0;
+
+    // The cursor following the record is copied in the scratch tested by the filter
+    if(type & MEMORY_READ) {
+        PatchGenerator::SharedPtrVec record = {
+            GetReadAddress(Temp(0)),
+            GetReadValue(Temp(1)),
+            WriteMemTraceRecord(Temp(0), Temp(1), Temp(2), MEMORY_READ, Constant((rword) &memTrace->cursor)),
+            WriteTemp(Temp(2), Offset(offsetof(Context, hostState.scratch))),
+        };
+        append(record, getCallbackGenerator(memTraceGate, nullptr));
+        memTrace->readID = addInstrRule(InstrRule(DoesReadAccess(), record, PREINST, true, &memTrace->full));
+    }
+    if(type & MEMORY_WRITE) {
+        PatchGenerator::SharedPtrVec record = {
+            GetWriteAddress(Temp(0)),
+            GetWriteValue(Temp(1)),
+            WriteMemTraceRecord(Temp(0), Temp(1), Temp(2), MEMORY_WRITE, Constant((rword) &memTrace->cursor)),
+            WriteTemp(Temp(2), Offset(offsetof(Context, hostState.scratch))),
+        };
+        append(record, getCallbackGenerator(memTraceGate, nullptr));
+        memTrace->writeID = addInstrRule(InstrRule(DoesWriteAccess(), record, POSTINST, true, &memTrace->full));
+    }
+    return true;
+#else
+    return false;
+#endif
+}
 
+void VM::flushMemTrace() {
+    rword begin = (rword) memTrace->records.data();
+    if(memTrace->cursor == begin) {
+        return;
+    }
+    // A disabled trace may still be appended until the cache flush is committed
+    if(memTrace->cbk != nullptr) {
+        size_t count = (memTrace->cursor - begin) / sizeof(MemoryAccess);
+        memTrace->cbk(this, memTrace->records.data(), count, memTrace->data);
+    }
+    memTrace->cursor = begin;
+}
+
+// Decode the memory accesses recorded in the shadows of the instructions up to lastInstID. Only
+// the first size accesses are written to buffer, the total number of accesses is returned.
+static size_t decodeMemoryAccess(const ExecBlock* curExecBlock, llvm::ArrayRef<ShadowInfo> shadows, uint16_t lastInstID,
+                                 bool preInst, MemoryAccess* buffer, size_t size) {
+    size_t count = 0;
     size_t i = 0;
-    while(i < shadows.size()) {
-        auto access = MemoryAccess();
+    while(i < shadows.size() && shadows[i].instID <= lastInstID) {
+        MemoryAccess access = MemoryAccess();
 
         if(shadows[i].tag == MEM_READ_ADDRESS_TAG) {
             access.type = MEMORY_READ;
-            access.size = getReadSize(curExecBlock->getOriginalMCInst(instID));
+            access.size = getReadSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
         }
-        else if(engine->isPreInst() == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
+        else if(preInst == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
             access.type = MEMORY_WRITE;
-            access.size = getWriteSize(curExecBlock->getOriginalMCInst(instID));
+            access.size = getWriteSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
         }
         else {
             i += 1;
             continue;
         }
-        access.accessAddress = curExecBlock->getShadow(shadows[i].shadowID);
         access.instAddress = curExecBlock->getInstAddress(shadows[i].instID);
+        access.accessAddress = curExecBlock->getShadow(shadows[i].shadowID);
         i += 1;
 
-        if(i >= shadows.size()) {
+        if(i >= shadows.size() || shadows[i-1].instID != shadows[i].instID) {
             LogError(
-                "Engine::getInstMemoryAccess",
+                "VM::getMemoryAccess",
                 "An address shadow is not followed by a shadow for instruction at address %" PRIx64,
                 access.instAddress
             );
@@ -417,7 +873,7 @@ std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
         }
         else {
             LogError(
-                "Engine::getInstMemoryAccess",
+                "VM::getMemoryAccess",
                 "An address shadow is not followed by a value shadow for instruction at address %" PRIx64,
                 access.instAddress
             );
@@ -425,72 +881,46 @@ std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
         }
 
         // we found our access and its value, record access
-        memAccess.push_back(access);
+        if(count < size) {
+            buffer[count] = access;
+        }
+        count += 1;
         i += 1;
     }
-    return memAccess;
+    return count;
 }
 
-std::vector<MemoryAccess> VM::getBBMemoryAccess() const {
+size_t VM::getInstMemoryAccess(MemoryAccess* buffer, size_t size) const {
     const ExecBlock* curExecBlock = engine->getCurExecBlock();
     if(curExecBlock == nullptr) {
-        return {};
+        return 0;
     }
-    uint16_t bbID = curExecBlock->getCurrentSeqID();
     uint16_t instID = curExecBlock->getCurrentInstID();
-    std::vector<MemoryAccess> memAccess;
-    std::vector<ShadowInfo> shadows = curExecBlock->queryShadowBySeq(bbID, ANY);
-    LogDebug("VM::getBBMemoryAccess", "Got %zu shadows for Basic Block %" PRIu16 " stopping at Instruction %" PRIu16,
-             shadows.size(), bbID, instID);
-
-    size_t i = 0;
-    while(i < shadows.size() && shadows[i].instID <= instID) {
-        auto access = MemoryAccess();
-
-        if(shadows[i].tag == MEM_READ_ADDRESS_TAG) {
-            access.type = MEMORY_READ;
-            access.size = getReadSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
-        }
-        else if(engine->isPreInst() == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
-            access.type = MEMORY_WRITE;
-            access.size = getWriteSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
-        }
-        else {
-            i += 1;
-            continue;
-        }
-        access.instAddress = curExecBlock->getInstAddress(shadows[i].instID);
-        access.accessAddress = curExecBlock->getShadow(shadows[i].shadowID);
-        i += 1;
-
-        if(i >= shadows.size() || curExecBlock->getInstAddress(shadows[i-1].instID) != curExecBlock->getInstAddress(shadows[i].instID)) {
-            LogError(
-                "VM::getBBMemoryAccess",
-                "An address shadow is not followed by a shadow for instruction at address %" PRIx64,
-                access.instAddress
-            );
-            continue;
-        }
+    return decodeMemoryAccess(curExecBlock, curExecBlock->queryShadowByInst(instID), instID, engine->isPreInst(),
+                              buffer, size);
+}
 
-        if(shadows[i].tag == MEM_VALUE_TAG) {
-            access.value = curExecBlock->getShadow(shadows[i].shadowID);
-        }
-        else {
-            LogError(
-                "Engine::getBBMemoryAccess",
-                "An address shadow is not followed by a value shadow for instruction at address %" PRIx64,
-                access.instAddress
-            );
-            continue;
-        }
+std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
+    std::vector<MemoryAccess> memAccess(getInstMemoryAccess(nullptr, 0));
+    getInstMemoryAccess(memAccess.data(), memAccess.size());
+    return memAccess;
+}
 
-        // we found our access and its value, record access
-        memAccess.push_back(access);
-        i += 1;
+size_t VM::getBBMemoryAccess(MemoryAccess* buffer, size_t size) const {
+    const ExecBlock* curExecBlock = engine->getCurExecBlock();
+    if(curExecBlock == nullptr) {
+        return 0;
     }
-    return memAccess;
+    uint16_t instID = curExecBlock->getCurrentInstID();
+    return decodeMemoryAccess(curExecBlock, curExecBlock->queryShadowBySeq(curExecBlock->getCurrentSeqID()), instID,
+                              engine->isPreInst(), buffer, size);
 }
 
+std::vector<MemoryAccess> VM::getBBMemoryAccess() const {
+    std::vector<MemoryAccess> memAccess(getBBMemoryAccess(nullptr, 0));
+    getBBMemoryAccess(memAccess.data(), memAccess.size());
+    return memAccess;
+}
 
 bool VM::precacheBasicBlock(rword pc) {
     return engine->precacheBasicBlock(pc);
@@ -504,4 +934,16 @@ void VM::clearCache(rword start, rword end) {
     engine->clearCache(start, end);
 }
 
+void VM::setCacheBudget(size_t budget) {
+    engine->setCacheBudget(budget);
+}
+
+void VM::setCacheStatistics(bool enable) {
+    engine->setStatistics(enable);
+}
+
+CacheStatistics VM::getCacheStatistics() const {
+    return engine->getStatistics();
+}
+
 } // QBDI::
@@ -133,6 +133,31 @@ void qbdi_setFPRState(VMInstanceRef instance, FPRState* gprState) {
     ((VM*) instance)->setFPRState(gprState);
 }
 
+Options qbdi_getOptions(VMInstanceRef instance) {
+    RequireAction("VM_C::getOptions", instance, return Options::NO_OPT);
+    return ((VM*) instance)->getOptions();
+}
+
+void qbdi_setOptions(VMInstanceRef instance, Options options) {
+    RequireAction("VM_C::setOptions", instance, return);
+    ((VM*) instance)->setOptions(options);
+}
+
+bool qbdi_setCoverageMap(VMInstanceRef instance, uint8_t* map, size_t size) {
+    RequireAction("VM_C::setCoverageMap", instance, return false);
+    return ((VM*) instance)->setCoverageMap(map, size);
+}
+
+bool qbdi_setBlockTrace(VMInstanceRef instance, BlockTraceCallback cbk, void* data, size_t capacity) {
+    RequireAction("VM_C::setBlockTrace", instance, return false);
+    return ((VM*) instance)->setBlockTrace(cbk, data, capacity);
+}
+
+void qbdi_flushBlockTrace(VMInstanceRef instance) {
+    RequireAction("VM_C::flushBlockTrace", instance, return);
+    ((VM*) instance)->flushBlockTrace();
+}
+
 uint32_t qbdi_addMnemonicCB(VMInstanceRef instance, const char* mnemonic, InstPosition pos, InstCallback cbk, void *data) {
     RequireAction("VM_C::addMnemonicCB", instance, return VMError::INVALID_EVENTID);
     return ((VM*) instance)->addMnemonicCB(mnemonic, pos, cbk, data);
@@ -153,6 +178,46 @@ uint32_t qbdi_addCodeRangeCB(VMInstanceRef instance, rword start, rword end, Ins
     return ((VM*) instance)->addCodeRangeCB(start, end, pos, cbk, data);
 }
 
+uint32_t qbdi_addInlineCounter(VMInstanceRef instance, rword start, rword end) {
+    RequireAction("VM_C::addInlineCounter", instance, return VMError::INVALID_EVENTID);
+    return ((VM*) instance)->addInlineCounter(start, end);
+}
+
+uint32_t qbdi_addInlineAddrCounter(VMInstanceRef instance, rword address) {
+    RequireAction("VM_C::addInlineAddrCounter", instance, return VMError::INVALID_EVENTID);
+    return ((VM*) instance)->addInlineAddrCounter(address);
+}
+
+uint64_t qbdi_getInlineCounter(VMInstanceRef instance, uint32_t id) {
+    RequireAction("VM_C::getInlineCounter", instance, return 0);
+    return ((VM*) instance)->getInlineCounter(id);
+}
+
+void qbdi_getInlineCounters(VMInstanceRef instance, const uint32_t* ids, uint64_t* values, size_t count) {
+    RequireAction("VM_C::getInlineCounters", instance, return);
+    ((VM*) instance)->getInlineCounters(ids, values, count);
+}
+
+void qbdi_resetInlineCounters(VMInstanceRef instance) {
+    RequireAction("VM_C::resetInlineCounters", instance, return);
+    ((VM*) instance)->resetInlineCounters();
+}
+
+bool qbdi_setInlineBBCounters(VMInstanceRef instance, bool enable) {
+    RequireAction("VM_C::setInlineBBCounters", instance, return false);
+    return ((VM*) instance)->setInlineBBCounters(enable);
+}
+
+uint64_t qbdi_getInlineBBCounter(VMInstanceRef instance, rword address) {
+    RequireAction("VM_C::getInlineBBCounter", instance, return 0);
+    return ((VM*) instance)->getInlineBBCounter(address);
+}
+
+size_t qbdi_getInlineBBCounters(VMInstanceRef instance, rword* addresses, uint64_t* values, size_t count) {
+    RequireAction("VM_C::getInlineBBCounters", instance, return 0);
+    return ((VM*) instance)->getInlineBBCounters(addresses, values, count);
+}
+
 uint32_t qbdi_addMemAccessCB(VMInstanceRef instance, MemoryAccessType type, InstCallback cbk, void *data) {
     RequireAction("VM_C::addMemAccessCB", instance, return VMError::INVALID_EVENTID);
     return ((VM*) instance)->addMemAccessCB(type, cbk, data);
@@ -163,6 +228,11 @@ uint32_t qbdi_addMemAddrCB(VMInstanceRef instance, rword address, MemoryAccessTy
     return ((VM*) instance)->addMemAddrCB(address, type, cbk, data);
 }
 
+uint32_t qbdi_addMemAccessListCB(VMInstanceRef instance, MemoryAccessType type, MemAccessListCallback cbk, void *data) {
+    RequireAction("VM_C::addMemAccessListCB", instance, return VMError::INVALID_EVENTID);
+    return ((VM*) instance)->addMemAccessListCB(type, cbk, data);
+}
+
 uint32_t qbdi_addMemRangeCB(VMInstanceRef instance, rword start, rword end, MemoryAccessType type, InstCallback cbk, void *data) {
     RequireAction("VM_C::addMemRangeCB", instance, return VMError::INVALID_EVENTID);
     return ((VM*) instance)->addMemRangeCB(start, end, type, cbk, data);
@@ -193,6 +263,16 @@ bool qbdi_recordMemoryAccess(VMInstanceRef instance, MemoryAccessType type) {
     return ((VM*) instance)->recordMemoryAccess(type);
 }
 
+bool qbdi_setMemTrace(VMInstanceRef instance, MemoryAccessType type, MemTraceCallback cbk, void* data, size_t capacity) {
+    RequireAction("VM_C::setMemTrace", instance, return false);
+    return ((VM*) instance)->setMemTrace(type, cbk, data, capacity);
+}
+
+void qbdi_flushMemTrace(VMInstanceRef instance) {
+    RequireAction("VM_C::flushMemTrace", instance, return);
+    ((VM*) instance)->flushMemTrace();
+}
+
 MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_t* size) {
     RequireAction("VM_C::getInstMemoryAccess", instance, return nullptr);
     RequireAction("VM_C::getInstMemoryAccess", size, return nullptr);
@@ -211,6 +291,12 @@ MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_t* size) {
     return ma_arr;
 }
 
+size_t qbdi_fillInstMemoryAccess(VMInstanceRef instance, MemoryAccess* buffer, size_t size) {
+    RequireAction("VM_C::fillInstMemoryAccess", instance, return 0);
+    RequireAction("VM_C::fillInstMemoryAccess", buffer || size == 0, return 0);
+    return ((VM*) instance)->getInstMemoryAccess(buffer, size);
+}
+
 MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t* size) {
     RequireAction("VM_C::getBBMemoryAccess", instance, return nullptr);
     RequireAction("VM_C::getBBMemoryAccess", size, return nullptr);
@@ -229,6 +315,12 @@ MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t* size) {
     return ma_arr;
 }
 
+size_t qbdi_fillBBMemoryAccess(VMInstanceRef instance, MemoryAccess* buffer, size_t size) {
+    RequireAction("VM_C::fillBBMemoryAccess", instance, return 0);
+    RequireAction("VM_C::fillBBMemoryAccess", buffer || size == 0, return 0);
+    return ((VM*) instance)->getBBMemoryAccess(buffer, size);
+}
+
 bool qbdi_precacheBasicBlock(VMInstanceRef instance, rword pc) {
     RequireAction("VM_C::precacheBasicBlock", instance, return false);
     return ((VM*) instance)->precacheBasicBlock(pc);
@@ -242,4 +334,20 @@ void qbdi_clearCache(VMInstanceRef instance, rword start, rword end) {
     ((VM*) instance)->clearCache(start, end);
 }
 
+void qbdi_setCacheBudget(VMInstanceRef instance, size_t budget) {
+    RequireAction("VM_C::setCacheBudget", instance, return);
+    ((VM*) instance)->setCacheBudget(budget);
+}
+
+void qbdi_setCacheStatistics(VMInstanceRef instance, bool enable) {
+    RequireAction("VM_C::setCacheStatistics", instance, return);
+    ((VM*) instance)->setCacheStatistics(enable);
+}
+
+void qbdi_getCacheStatistics(VMInstanceRef instance, CacheStatistics* statistics) {
+    RequireAction("VM_C::getCacheStatistics", instance, return);
+    RequireAction("VM_C::getCacheStatistics", statistics, return);
+    *statistics = ((VM*) instance)->getCacheStatistics();
+}
+
 }
@@ -60,6 +60,9 @@ struct HostState {
     rword callback;
     rword data;
     rword origin;
+    rword fprSwitch;
+    rword scratch;
+    rword coveragePrev;
 };
 
 /*! X86_64 Execution context.
@@ -106,6 +109,9 @@ struct HostState {
     rword callback;
     rword data;
     rword origin;
+    rword fprSwitch;
+    rword scratch;
+    rword coveragePrev;
 };
 
 /*! ARM Execution context.
@@ -0,0 +1,121 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include <algorithm>
+
+#include "ExecBlock/ExecArena.h"
+#include "Utility/LogSys.h"
+#include "Utility/System.h"
+
+namespace QBDI {
+
+// Every ExecBlock has at most one more data page than code pages
+static const size_t ARENA_DATA_SIZE = 2 * ARENA_CODE_SIZE;
+
+ExecArena::ExecArena(size_t pageSize) : pageSize(pageSize), blockCount(0), executable(false), hugePages(false) {
+    std::error_code ec;
+
+    // Over allocate to align the code area on a huge page
+    mapping = QBDI::allocateMappedMemory(ARENA_CODE_SIZE + ARENA_CODE_SIZE + ARENA_DATA_SIZE, nullptr,
+                                         PF::MF_READ | PF::MF_WRITE, ec);
+    if(mapping.base() == nullptr) {
+        LogDebug("ExecArena::ExecArena", "Failed to map an arena: %s", ec.message().c_str());
+        return;
+    }
+    rword codeBase = ((rword) mapping.base() + ARENA_CODE_SIZE - 1) & ~((rword) ARENA_CODE_SIZE - 1);
+    codeArea = llvm::sys::MemoryBlock((void*) codeBase, ARENA_CODE_SIZE);
+    dataArea = llvm::sys::MemoryBlock((void*) (codeBase + ARENA_CODE_SIZE), ARENA_DATA_SIZE);
+    codePages.assign(ARENA_CODE_SIZE / pageSize, false);
+    dataPages.assign(ARENA_DATA_SIZE / pageSize, false);
+    hugePages = adviseHugePages(codeArea.base(), codeArea.size());
+    LogDebug("ExecArena::ExecArena", "Arena code @ 0x%" PRIRWORD " | data @ 0x%" PRIRWORD " | huge pages %d",
+             (rword) codeArea.base(), (rword) dataArea.base(), hugePages);
+}
+
+ExecArena::~ExecArena() {
+    Require("ExecArena::~ExecArena", blockCount == 0);
+    if(mapping.base() != nullptr) {
+        QBDI::releaseMappedMemory(mapping);
+    }
+}
+
+size_t ExecArena::findPages(const std::vector<bool>& pages, size_t count) {
+    // First fit
+    size_t run = 0;
+    for(size_t i = 0; i < pages.size(); i++) {
+        run = pages[i] ? 0 : run + 1;
+        if(run == count) {
+            return i + 1 - count;
+        }
+    }
+    return pages.size();
+}
+
+bool ExecArena::allocate(size_t codeSize, size_t dataSize, llvm::sys::MemoryBlock& code, llvm::sys::MemoryBlock& data) {
+    size_t codeCount = codeSize / pageSize;
+    size_t dataCount = dataSize / pageSize;
+    size_t codeIdx = findPages(codePages, codeCount);
+    size_t dataIdx = findPages(dataPages, dataCount);
+    if(codeIdx == codePages.size() || dataIdx == dataPages.size()) {
+        return false;
+    }
+    std::fill(codePages.begin() + codeIdx, codePages.begin() + codeIdx + codeCount, true);
+    std::fill(dataPages.begin() + dataIdx, dataPages.begin() + dataIdx + dataCount, true);
+    code = llvm::sys::MemoryBlock((void*) ((rword) codeArea.base() + codeIdx * pageSize), codeSize);
+    data = llvm::sys::MemoryBlock((void*) ((rword) dataArea.base() + dataIdx * pageSize), dataSize);
+    // Reused data pages must look like freshly mapped ones
+    memset(data.base(), 0, dataSize);
+    blockCount++;
+    // The code block is written right after its allocation
+    makeRW();
+    return true;
+}
+
+void ExecArena::release(const llvm::sys::MemoryBlock& code, const llvm::sys::MemoryBlock& data) {
+    size_t codeIdx = ((rword) code.base() - (rword) codeArea.base()) / pageSize;
+    size_t dataIdx = ((rword) data.base() - (rword) dataArea.base()) / pageSize;
+    std::fill(codePages.begin() + codeIdx, codePages.begin() + codeIdx + code.size() / pageSize, false);
+    std::fill(dataPages.begin() + dataIdx, dataPages.begin() + dataIdx + data.size() / pageSize, false);
+    blockCount--;
+}
+
+void ExecArena::makeRX() {
+    if(executable == false) {
+        LogDebug("ExecArena::makeRX", "Making ExecArena %p RX", this);
+        RequireAction(
+            "ExecArena::makeRX",
+            !llvm::sys::Memory::protectMappedMemory(codeArea, PF::MF_READ | PF::MF_EXEC),
+            abort()
+        );
+        executable = true;
+    }
+}
+
+void ExecArena::makeRW() {
+    if(executable) {
+        LogDebug("ExecArena::makeRW", "Making ExecArena %p RW", this);
+        RequireAction(
+            "ExecArena::makeRW",
+            !llvm::sys::Memory::protectMappedMemory(codeArea, PF::MF_READ | PF::MF_WRITE),
+            abort()
+        );
+        executable = false;
+    }
+}
+
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef EXECARENA_H
+#define EXECARENA_H
+
+#include <vector>
+
+#include "llvm/Support/Memory.h"
+
+#include "State.h"
+
+namespace QBDI {
+
+/*! Size of the code area of an arena, the size of a huge page.
+ */
+static const size_t ARENA_CODE_SIZE = 2 * 1024 * 1024;
+
+/*! A large mapping carved into the code and data blocks of several ExecBlocks. The code area is
+ *  aligned on a huge page and its protections are changed as a whole, such that it can stay
+ *  backed by a single huge page. The data area follows the code area and always stays RW.
+ */
+class ExecArena {
+private:
+
+    using PF = llvm::sys::Memory::ProtectionFlags;
+
+    llvm::sys::MemoryBlock  mapping;
+    llvm::sys::MemoryBlock  codeArea;
+    llvm::sys::MemoryBlock  dataArea;
+    size_t                  pageSize;
+    std::vector<bool>       codePages;
+    std::vector<bool>       dataPages;
+    unsigned                blockCount;
+    bool                    executable;
+    bool                    hugePages;
+
+    static size_t findPages(const std::vector<bool>& pages, size_t count);
+
+public:
+
+    /*! Map a new arena.
+     *
+     * @param[in] pageSize  The size of the pages carved into blocks.
+     */
+    ExecArena(size_t pageSize);
+
+    ~ExecArena();
+
+    /*! Check if the mapping of the arena succeeded.
+     *
+     * @return True if the arena can be used.
+     */
+    bool isValid() const { return mapping.base() != nullptr; }
+
+    /*! Check if the code area is backed by huge pages, as far as the system told.
+     *
+     * @return True if huge pages were granted.
+     */
+    bool hasHugePages() const { return hugePages; }
+
+    /*! Allocate the code and data blocks of an ExecBlock.
+     *
+     * @param[in]  codeSize  The size of the code block, a multiple of the page size.
+     * @param[in]  dataSize  The size of the data block, a multiple of the page size.
+     * @param[out] code      The allocated code block.
+     * @param[out] data      The allocated data block.
+     *
+     * @return False if the arena doesn't have enough free space.
+     */
+    bool allocate(size_t codeSize, size_t dataSize, llvm::sys::MemoryBlock& code, llvm::sys::MemoryBlock& data);
+
+    /*! Check if the arena has enough free space for the blocks of an ExecBlock.
+     *
+     * @param[in] codeSize  The size of the code block.
+     * @param[in] dataSize  The size of the data block.
+     *
+     * @return True if allocate would succeed.
+     */
+    bool canAllocate(size_t codeSize, size_t dataSize) const {
+        return findPages(codePages, codeSize / pageSize) != codePages.size() &&
+               findPages(dataPages, dataSize / pageSize) != dataPages.size();
+    }
+
+    /*! Give back the blocks of an ExecBlock to the arena.
+     *
+     * @param[in] code  The code block.
+     * @param[in] data  The data block.
+     */
+    void release(const llvm::sys::MemoryBlock& code, const llvm::sys::MemoryBlock& data);
+
+    /*! Check if no ExecBlock uses the arena anymore.
+     *
+     * @return True if the arena is empty.
+     */
+    bool isEmpty() const { return blockCount == 0; }
+
+    /*! Changes the permissions of the whole code area to RX.
+     */
+    void makeRX();
+
+    /*! Changes the permissions of the whole code area to RW.
+     */
+    void makeRW();
+};
+
+}
+
+#endif // EXECARENA_H
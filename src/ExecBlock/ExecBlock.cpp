@@ -15,10 +15,14 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <string.h>
+#include <algorithm>
+
 #include "llvm/Support/Format.h"
 #include "Patch/PatchRule.h"
 #include "ExecBlock.h"
 #include "Patch/Patch.h"
+#include "Patch/InstInfo.h"
 #include "Platform.h"
 #include "Memory.h"
 #include "Utility/LogSys.h"
@@ -47,7 +51,8 @@ RelocatableInst::SharedPtrVec ExecBlock::execBlockPrologue = RelocatableInst::Sh
 RelocatableInst::SharedPtrVec ExecBlock::execBlockEpilogue = RelocatableInst::SharedPtrVec();
 void (*ExecBlock::runCodeBlockFct)(void*) = NULL;
 
-ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(vminstance), assembly(assembly) {
+ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance, Options options, int contextHandle, size_t codeSize,
+                     ExecArena* arena) : vminstance(vminstance), arena(arena), assembly(assembly), options(options) {
     // Allocate memory blocks
     std::error_code ec;
 #ifdef QBDI_OS_IOS
@@ -62,22 +67,63 @@ ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(
              mflags |= PF::MF_EXEC;
 #endif
 
-    // Allocate 2 pages block
-    codeBlock = QBDI::allocateMappedMemory(2*pageSize, nullptr, mflags, ec);
-    RequireAction("ExecBlock::ExecBlock", codeBlock.base() != nullptr, abort());
-    // Split it in two blocks
-    dataBlock = llvm::sys::MemoryBlock((void*)((uint64_t) codeBlock.base() + pageSize), pageSize);
-    codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), pageSize);
-    LogDebug("ExecBlock::ExecBlock", "codeBlock @ 0x%" PRIRWORD " | dataBlock @ 0x%" PRIRWORD, (rword) codeBlock.base(), (rword) dataBlock.base());
+    if(codeSize == 0) {
+        codeSize = pageSize;
+    }
+    RequireAction("ExecBlock::ExecBlock", codeSize % pageSize == 0 && codeSize <= MAX_CODE_BLOCK_SIZE, abort());
+
+    // The shadows get as many pages as the code. A shared context gets a page of its own in front
+    // of the shadows, a private context which would leave less than half of a page to the shadows too
+    sharedContext = (contextHandle >= 0 && sizeof(Context) <= pageSize);
+    uint64_t dataSize = (sharedContext || sizeof(Context) > pageSize / 2) ? codeSize + pageSize : codeSize;
+
+    if(arena != nullptr) {
+        // Arenas toggle the protection of their whole code area, a shared memory alias would not be
+        // backed by transparent huge pages
+        RequireAction("ExecBlock::ExecBlock", arena->allocate(codeSize, dataSize, codeBlock, dataBlock), abort());
+        writeBlock = codeBlock;
+        pageState = RW;
+    }
+    else {
+        // Allocate code and data pages in one block
+        codeBlock = QBDI::allocateMappedMemory(codeSize + dataSize, nullptr, mflags, ec);
+        RequireAction("ExecBlock::ExecBlock", codeBlock.base() != nullptr, abort());
+        // Split it in two blocks
+        dataBlock = llvm::sys::MemoryBlock((void*)((uint64_t) codeBlock.base() + codeSize), dataSize);
+        codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), codeSize);
+        // Execute the code block RX and write it through an alias, W^X without protection changes
+        writeBlock = mapWriteAlias(codeBlock.base(), codeSize, ec);
+        if(writeBlock.base() == nullptr) {
+            LogDebug("ExecBlock::ExecBlock", "No write alias, switching protections: %s", ec.message().c_str());
+            writeBlock = codeBlock;
+            pageState = RW;
+        }
+        else {
+            pageState = RX;
+        }
+    }
+    LogDebug("ExecBlock::ExecBlock", "codeBlock @ 0x%" PRIRWORD " | writeBlock @ 0x%" PRIRWORD " | dataBlock @ 0x%" PRIRWORD,
+             (rword) codeBlock.base(), (rword) writeBlock.base(), (rword) dataBlock.base());
+
+    // Map the shared context over the first data page
+    if(sharedContext) {
+        mapSharedMemory(contextHandle, dataBlock.base(), pageSize, ec);
+        RequireAction("ExecBlock::ExecBlock", !ec, abort());
+        shadowsOffset = pageSize;
+    }
+    else {
+        shadowsOffset = sizeof(Context);
+    }
 
     // Other initializations
     context = (Context*) dataBlock.base();
-    shadows = (rword*) ((rword) dataBlock.base() + sizeof(Context));
+    shadows = (rword*) ((rword) dataBlock.base() + shadowsOffset);
     shadowIdx = 0;
+    fprUsed = false;
     currentSeq = 0;
     currentInst = 0;
-    codeStream = new memory_ostream(codeBlock);
-    pageState = RW;
+    hostCalls = 0;
+    codeStream = new memory_ostream(writeBlock);
 
     // Epilogue and prologue management. 
     // If epilogueSize == 0 then static members are not yet initialized
@@ -112,15 +158,116 @@ ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(
     for(auto &inst: execBlockPrologue) {
         assembly.writeInstruction(inst->reloc(this), codeStream);
     }
+    // JIT the indirect branch cache shared by the dynamic exits right after the prologue
+    indirectCacheOffset = 0;
+    exitSize = 0;
+    indirectCacheShadow = shadowIdx;
+    indirectCacheNext = 0;
+    indirectMissShadow = shadowIdx;
+    hasReturnStack = false;
+    returnStackShadow = shadowIdx;
+    returnTopShadow = shadowIdx;
+    returnNullShadow = shadowIdx;
+    returnScratchShadow = shadowIdx;
+    if(options & OPT_DIRECT_CHAINING) {
+        std::vector<std::pair<Offset, Offset>> slots;
+        for(uint16_t i = 0; i < INDIRECT_CACHE_SIZE; i++) {
+            uint16_t guestShadow = newShadow();
+            uint16_t hostShadow = newShadow();
+            slots.push_back(std::make_pair(Offset(getShadowOffset(guestShadow)), Offset(getShadowOffset(hostShadow))));
+        }
+        indirectMissShadow = newShadow();
+        RelocatableInst::SharedPtrVec indirectCache = getIndirectCache(slots, Offset(getShadowOffset(indirectMissShadow)));
+        if(indirectCache.size() > 0) {
+            indirectCacheOffset = codeStream->current_pos();
+            for(auto &inst: indirectCache) {
+                assembly.writeInstruction(inst->reloc(this), codeStream);
+            }
+            clearIndirectCache();
+            // Shadow return stack predicting the target of return instructions
+            if(RETURN_STACK_SIZE > 0) {
+                returnStackShadow = newShadow();
+                for(uint16_t i = 1; i < RETURN_STACK_SIZE; i++) {
+                    newShadow();
+                }
+                returnTopShadow = newShadow();
+                // Slot pair which never matches, used for the empty entries
+                returnNullShadow = newShadow();
+                newShadow();
+                returnScratchShadow = newShadow();
+                hasReturnStack = true;
+                clearReturnStack();
+            }
+            // Space reserved after each sequence for its exits, measured on the exits writeSequence
+            // generates. Static exits have at most two targets and use the indirect cache slots as
+            // stand-ins, the relocated size does not depend on the slot.
+            RelocatableInst::SharedPtrVec staticExit = getChainedExit({slots[0], slots[1]});
+            RelocatableInst::SharedPtrVec dynamicExit = getIndirectCacheJump((rword) codeBlock.base() + indirectCacheOffset);
+            if(hasReturnStack) {
+                prepend(staticExit, getReturnStackPush(Offset(getShadowOffset(returnTopShadow)),
+                                                       Offset(getShadowOffset(returnStackShadow)),
+                                                       Offset(getShadowOffset(returnNullShadow))));
+                prepend(dynamicExit, getReturnStackPredict(Offset(getShadowOffset(returnTopShadow)),
+                                                           Offset(getShadowOffset(returnStackShadow)),
+                                                           Offset(getShadowOffset(returnScratchShadow))));
+            }
+            exitSize = std::max(getRelocatedSize(staticExit), getRelocatedSize(dynamicExit));
+        }
+        else {
+            // Not supported by this architecture
+            shadowIdx = indirectCacheShadow;
+        }
+    }
+    // State restored by reset
+    resetOffset = codeStream->current_pos();
+    resetShadowIdx = shadowIdx;
 }
 
 ExecBlock::~ExecBlock() {
-    // Reunite the 2 blocks before freeing them
-    codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), codeBlock.size() + dataBlock.size());
-    QBDI::releaseMappedMemory(codeBlock);
+    if(arena != nullptr) {
+        // The data pages of the arena may be reused as shadows, they must not keep the shared context
+        if(sharedContext) {
+            std::error_code ec;
+            unmapSharedMemory(dataBlock.base(), shadowsOffset, ec);
+            Require("ExecBlock::~ExecBlock", !ec);
+        }
+        arena->release(codeBlock, dataBlock);
+    }
+    else {
+        if(isDualMapped()) {
+            QBDI::releaseMappedMemory(writeBlock);
+        }
+        // Reunite the 2 blocks before freeing them, this also unmaps the shared context and the
+        // RX mapping of the code
+        codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), codeBlock.size() + dataBlock.size());
+        QBDI::releaseMappedMemory(codeBlock);
+    }
     delete codeStream;
 }
 
+void ExecBlock::reset() {
+    LogDebug("ExecBlock::reset", "Resetting ExecBlock %p", this);
+    memset(&shadows[resetShadowIdx], 0, (shadowIdx - resetShadowIdx) * sizeof(rword));
+    shadowIdx = resetShadowIdx;
+    shadowRegistry.clear();
+    instMetadata.clear();
+    instRegistry.clear();
+    seqRegistry.clear();
+    instIndex.clear();
+    seqIndex.clear();
+    exitRegistry.clear();
+    fprUsed = false;
+    currentSeq = 0;
+    currentInst = 0;
+    // The shared context belongs to the VM and is kept
+    if(sharedContext == false) {
+        memset(context, 0, sizeof(Context));
+    }
+    codeStream->seek(resetOffset);
+    clearIndirectCache();
+    clearReturnStack();
+}
+
 void ExecBlock::show() const {
     rword i;
     uint64_t instSize;
@@ -173,7 +320,12 @@ void ExecBlock::run() {
 #else
     llvm::sys::Memory::InvalidateInstructionCache(codeBlock.base(), codeBlock.size());
 #endif // QBDI_OS_IOS
+    // The guest FPR state in the context stays valid while running code which does not touch it
+    context->hostState.fprSwitch = (fprUsed || (options & OPT_LAZY_FPR) == 0) ? 1 : 0;
     runCodeBlockFct(codeBlock.base());
+    if(context->hostState.fprSwitch != 0) {
+        completeFPRState(&context->fprState);
+    }
 }
 
 VMAction ExecBlock::execute() {
@@ -188,11 +340,10 @@ VMAction ExecBlock::execute() {
         run();
 
         if(context->hostState.callback != 0) {
-            currentInst = context->hostState.origin;
-
             LogDebug("ExecBlock::execute", "Callback request by ExecBlock %p for callback 0x%" PRIRWORD, 
                      this, context->hostState.callback);
-            Require("ExecBlock::execute", currentInst < instMetadata.size());
+            setCurrentInstID(context->hostState.origin);
+            hostCalls++;
 
             VMAction r = ((InstCallback)context->hostState.callback)(
                 vminstance,
@@ -230,8 +381,11 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
         return {EXEC_BLOCK_FULL, 0, 0};
     }
 
+    // Chained exits are written after the terminator and need to be accounted for
+    rword minimalSize = MINIMAL_BLOCK_SIZE + exitSize;
+
     // Check if there's enough space left
-    if(getEpilogueOffset() < MINIMAL_BLOCK_SIZE) {
+    if(getEpilogueOffset() < minimalSize) {
         LogDebug("ExecBlock::writeBasicBlock", "ExecBlock %p is full", this);
         return {EXEC_BLOCK_FULL, 0, 0};
     }
@@ -252,7 +406,7 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
         LogDebug("ExecBlock::writeBasicBlock", "Attempting to write patch of %zu RelocatableInst to ExecBlock %p", seqIt->metadata.patchSize, this);
         // Attempt to write a complete patch. If not, rollback to the last complete patch written
         for(const RelocatableInst::SharedPtr& inst : seqIt->insts) {
-            if(getEpilogueOffset() > MINIMAL_BLOCK_SIZE) {
+            if(getEpilogueOffset() > minimalSize) {
                 assembly.writeInstruction(inst->reloc(this), codeStream);
             }
             else {
@@ -280,9 +434,25 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
         }
         else {
             // Complete instruction was written, we add the metadata
+            uint16_t instID = getNextInstID();
             instMetadata.push_back(seqIt->metadata);
+            fprUsed |= seqIt->metadata.useFPR;
+            // Shadows are registered in instruction order, the ones of this instruction are last
+            size_t shadowOffset = shadowRegistry.size();
+            while(shadowOffset > 0 && shadowRegistry[shadowOffset - 1].instID == instID) {
+                shadowOffset--;
+            }
             // Register instruction
-            instRegistry.push_back(InstInfo {seqID, (uint16_t) rollbackOffset});
+            instRegistry.push_back(InstInfo {
+                seqID,
+                (uint16_t) rollbackOffset,
+                (uint16_t) shadowOffset,
+                (uint16_t) (shadowRegistry.size() - shadowOffset)
+            });
+            // The first copy of an instruction wins, as with a linear search
+            if(instIndex.count(seqIt->metadata.address) == 0) {
+                instIndex[seqIt->metadata.address] = instID;
+            }
             // Update indexes
             seqIt++;
             patchWritten += 1;
@@ -296,19 +466,136 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
             assembly.writeInstruction(inst->reloc(this), codeStream);
         }
     }
+    // JIT the chained exit for the statically known successors
+    std::vector<rword> targets;
+    if(options & OPT_DIRECT_CHAINING) {
+        if((seqType & SeqType::Exit) == 0) {
+            targets.push_back(seqIt->metadata.address);
+        }
+        else {
+            targets = getStaticTargets(instMetadata.back());
+        }
+        // Keep at least half of the shadows for the instrumentation
+        rword maxShadows = (dataBlock.size() - shadowsOffset) / sizeof(rword);
+        // Push the return site of calls on the shadow return stack, it is linked like any other exit
+        rword returnAddress = 0;
+        if(hasReturnStack && (seqType & SeqType::Exit)) {
+            returnAddress = getReturnAddress(instMetadata.back());
+        }
+        if(returnAddress != 0 && shadowIdx + 2 * targets.size() + 2 <= maxShadows / 2) {
+            rword epilogue = (rword) codeBlock.base() + codeBlock.size() - epilogueSize;
+            uint16_t guestShadow = newShadow();
+            uint16_t hostShadow = newShadow();
+            setShadow(guestShadow, 0);
+            setShadow(hostShadow, epilogue);
+            exitRegistry.push_back(ExitInfo {returnAddress, guestShadow, hostShadow});
+            LogDebug("ExecBlock::writeBasicBlock", "Writting return stack push for 0x%" PRIRWORD " to ExecBlock %p", returnAddress, this);
+            RelocatableInst::SharedPtrVec push = getReturnStackPush(Offset(getShadowOffset(returnTopShadow)),
+                                                                    Offset(getShadowOffset(returnStackShadow)),
+                                                                    Offset(getShadowOffset(guestShadow)));
+            for(RelocatableInst::SharedPtr &inst : push) {
+                assembly.writeInstruction(inst->reloc(this), codeStream);
+            }
+        }
+        if(targets.size() > 0 && shadowIdx + 2 * targets.size() <= maxShadows / 2) {
+            std::vector<std::pair<Offset, Offset>> slots;
+            rword epilogue = (rword) codeBlock.base() + codeBlock.size() - epilogueSize;
+            for(rword target : targets) {
+                uint16_t guestShadow = newShadow();
+                uint16_t hostShadow = newShadow();
+                setShadow(guestShadow, 0);
+                setShadow(hostShadow, epilogue);
+                exitRegistry.push_back(ExitInfo {target, guestShadow, hostShadow});
+                slots.push_back(std::make_pair(Offset(getShadowOffset(guestShadow)), Offset(getShadowOffset(hostShadow))));
+            }
+            LogDebug("ExecBlock::writeBasicBlock", "Writting chained exit with %zu targets to ExecBlock %p", slots.size(), this);
+            RelocatableInst::SharedPtrVec chainedExit = getChainedExit(slots);
+            for(RelocatableInst::SharedPtr &inst : chainedExit) {
+                assembly.writeInstruction(inst->reloc(this), codeStream);
+            }
+        }
+    }
+    // JIT the jump to the indirect branch cache for dynamic exits
+    if(indirectCacheOffset != 0 && (seqType & SeqType::Exit) && targets.size() == 0) {
+        // Returns first try the prediction of the shadow return stack
+        if(hasReturnStack && isReturn(instMetadata.back())) {
+            RelocatableInst::SharedPtrVec predict = getReturnStackPredict(Offset(getShadowOffset(returnTopShadow)),
+                                                                          Offset(getShadowOffset(returnStackShadow)),
+                                                                          Offset(getShadowOffset(returnScratchShadow)));
+            for(RelocatableInst::SharedPtr &inst : predict) {
+                assembly.writeInstruction(inst->reloc(this), codeStream);
+            }
+        }
+        rword indirectCache = (rword) codeBlock.base() + indirectCacheOffset;
+        RelocatableInst::SharedPtrVec jmpIndirectCache = getIndirectCacheJump(indirectCache);
+        for(RelocatableInst::SharedPtr &inst : jmpIndirectCache) {
+            assembly.writeInstruction(inst->reloc(this), codeStream);
+        }
+    }
     // JIT the jump to epilogue
-    RelocatableInst::SharedPtrVec jmpEpilogue = JmpEpilogue();
-    for(RelocatableInst::SharedPtr &inst : jmpEpilogue) {
-        assembly.writeInstruction(inst->reloc(this), codeStream);
+    else {
+        RelocatableInst::SharedPtrVec jmpEpilogue = JmpEpilogue();
+        for(RelocatableInst::SharedPtr &inst : jmpEpilogue) {
+            assembly.writeInstruction(inst->reloc(this), codeStream);
+        }
     }
+    // The exits must fit in the space reserved by minimalSize, else they overwrote the epilogue
+    Require("ExecBlock::writeBasicBlock", codeStream->current_pos() <= codeBlock.size() - epilogueSize);
     // Register sequence
     uint16_t endInstID = (uint16_t) (getNextInstID() - 1);
     seqRegistry.push_back(SeqInfo {startInstID, endInstID, seqType});
+    if(seqIndex.count(instMetadata[startInstID].address) == 0) {
+        seqIndex[instMetadata[startInstID].address] = seqID;
+    }
     // Return write results
     unsigned bytesWritten = (unsigned) (codeStream->current_pos() - startOffset);
     return SeqWriteResult {seqID, bytesWritten, patchWritten};
 }
 
+rword ExecBlock::getRelocatedSize(const RelocatableInst::SharedPtrVec& insts) {
+    // Large enough for a single instruction of any supported architecture
+    uint8_t buffer[32];
+    llvm::sys::MemoryBlock scratch(buffer, sizeof(buffer));
+    memory_ostream scratchStream(scratch);
+    rword size = 0;
+
+    for(const RelocatableInst::SharedPtr& inst : insts) {
+        scratchStream.seek(0);
+        assembly.writeInstruction(inst->reloc(this), &scratchStream);
+        size += scratchStream.current_pos();
+    }
+    return size;
+}
+
+std::vector<uint16_t> ExecBlock::invalidateSequences(Range<rword> range) {
+    std::vector<uint16_t> invalidated;
+    for(uint16_t seqID = 0; seqID < seqRegistry.size(); seqID++) {
+        for(uint16_t instID = seqRegistry[seqID].startInstID; instID <= seqRegistry[seqID].endInstID; instID++) {
+            if(range.overlaps(Range<rword>(instMetadata[instID].address, instMetadata[instID].endAddress()))) {
+                invalidated.push_back(seqID);
+                break;
+            }
+        }
+    }
+    // Only the index entries of the dropped sequences are removed, a later copy is indexed again
+    // when it is written
+    for(uint16_t seqID : invalidated) {
+        LogDebug("ExecBlock::invalidateSequences", "Dropping seqID %" PRIu16 " of ExecBlock %p", seqID, this);
+        for(uint16_t instID = seqRegistry[seqID].startInstID; instID <= seqRegistry[seqID].endInstID; instID++) {
+            rword address = instMetadata[instID].address;
+            const uint16_t* indexedSeq = seqIndex.find(address);
+            if(indexedSeq != nullptr && *indexedSeq == seqID) {
+                seqIndex.erase(address);
+            }
+            const uint16_t* indexedInst = instIndex.find(address);
+            if(indexedInst != nullptr && *indexedInst == instID) {
+                instIndex.erase(address);
+            }
+        }
+    }
+    return invalidated;
+}
+
 uint16_t ExecBlock::splitSequence(uint16_t instID) {
     Require("ExecBlock::splitSequence", instID < instRegistry.size());
     uint16_t seqID = instRegistry[instID].seqID;
@@ -317,10 +604,90 @@ uint16_t ExecBlock::splitSequence(uint16_t instID) {
         seqRegistry[seqID].endInstID, 
         (SeqType) (SeqType::Entry | seqRegistry[seqID].type)
     });
-    return getNextSeqID() - 1;
+    uint16_t newSeqID = getNextSeqID() - 1;
+    if(seqIndex.count(instMetadata[instID].address) == 0) {
+        seqIndex[instMetadata[instID].address] = newSeqID;
+    }
+    return newSeqID;
+}
+
+void ExecBlock::linkExits(rword address, uint16_t seqID) {
+    Require("ExecBlock::linkExits", seqID < seqRegistry.size());
+    rword host = (rword) codeBlock.base() + (rword) instRegistry[seqRegistry[seqID].startInstID].offset;
+    for(const ExitInfo& exit : exitRegistry) {
+        if(exit.target == address) {
+            LogDebug("ExecBlock::linkExits", "Linking exit to 0x%" PRIRWORD " with seqID %" PRIu16 " in ExecBlock %p", address, seqID, this);
+            shadows[exit.hostShadow] = host;
+            shadows[exit.guestShadow] = (rword) 0 - address;
+        }
+    }
+}
+
+void ExecBlock::unlinkExits() {
+    rword epilogue = (rword) codeBlock.base() + codeBlock.size() - epilogueSize;
+    for(const ExitInfo& exit : exitRegistry) {
+        shadows[exit.guestShadow] = 0;
+        shadows[exit.hostShadow] = epilogue;
+    }
+    clearIndirectCache();
+}
+
+rword ExecBlock::getIndirectMiss() const {
+    if(indirectCacheOffset == 0) {
+        return 0;
+    }
+    return shadows[indirectMissShadow];
+}
+
+void ExecBlock::cacheIndirectTarget(rword address, uint16_t seqID) {
+    Require("ExecBlock::cacheIndirectTarget", seqID < seqRegistry.size());
+    if(indirectCacheOffset == 0) {
+        return;
+    }
+    uint16_t entry = indirectCacheShadow + 2 * indirectCacheNext;
+    LogDebug("ExecBlock::cacheIndirectTarget", "Caching indirect target 0x%" PRIRWORD " with seqID %" PRIu16 " in ExecBlock %p", address, seqID, this);
+    shadows[entry] = (rword) 0 - address;
+    shadows[entry + 1] = (rword) codeBlock.base() + (rword) instRegistry[seqRegistry[seqID].startInstID].offset;
+    shadows[indirectMissShadow] = 0;
+    indirectCacheNext = (indirectCacheNext + 1) % INDIRECT_CACHE_SIZE;
+}
+
+void ExecBlock::clearIndirectCache() {
+    if(indirectCacheOffset == 0) {
+        return;
+    }
+    rword epilogue = (rword) codeBlock.base() + codeBlock.size() - epilogueSize;
+    for(uint16_t i = 0; i < INDIRECT_CACHE_SIZE; i++) {
+        shadows[indirectCacheShadow + 2 * i] = 0;
+        shadows[indirectCacheShadow + 2 * i + 1] = epilogue;
+    }
+    shadows[indirectMissShadow] = 0;
+    indirectCacheNext = 0;
+}
+
+void ExecBlock::clearReturnStack() {
+    if(hasReturnStack == false) {
+        return;
+    }
+    rword epilogue = (rword) codeBlock.base() + codeBlock.size() - epilogueSize;
+    shadows[returnNullShadow] = 0;
+    shadows[returnNullShadow + 1] = epilogue;
+    for(uint16_t i = 0; i < RETURN_STACK_SIZE; i++) {
+        shadows[returnStackShadow + i] = (rword) &shadows[returnNullShadow];
+    }
+    shadows[returnTopShadow] = 0;
 }
 
 void ExecBlock::makeRX() {
+    // A dual mapped code block is always RX
+    if(isDualMapped()) {
+        return;
+    }
+    // The protections of an arena are shared by all its blocks
+    if(arena != nullptr) {
+        arena->makeRX();
+        return;
+    }
     LogDebug("ExecBlock::makeRX", "Making ExecBlock %p RX", this);
     if(pageState != RX) {
         RequireAction(
@@ -333,6 +700,13 @@ void ExecBlock::makeRX() {
 }
 
 void ExecBlock::makeRW() {
+    if(isDualMapped()) {
+        return;
+    }
+    if(arena != nullptr) {
+        arena->makeRW();
+        return;
+    }
     LogDebug("ExecBlock::makeRX", "Making ExecBlock %p RW", this);
     if(pageState != RW) {
         RequireAction(
@@ -346,7 +720,7 @@ void ExecBlock::makeRW() {
 
 uint16_t ExecBlock::newShadow(uint16_t tag) {
     uint16_t id = shadowIdx++;
-    RequireAction("ExecBlock::newShadow", id * sizeof(rword) < dataBlock.size() - sizeof(Context), abort());
+    RequireAction("ExecBlock::newShadow", id * sizeof(rword) < dataBlock.size() - shadowsOffset, abort());
     if(tag != NO_REGISTRATION) {
         LogDebug("ExecBlock::newShadow", "Registering new tagged shadow %" PRIu16 "for instID %" PRIu16 " wih tag %" PRIu16, id, getNextInstID(), tag);
         shadowRegistry.push_back({
@@ -359,29 +733,73 @@ uint16_t ExecBlock::newShadow(uint16_t tag) {
     return id;
 }
 
+uint16_t ExecBlock::getLastShadow(uint16_t tag) const {
+    // The shadows of the instruction being written are the last ones of the registry
+    for(size_t i = shadowRegistry.size(); i > 0 && shadowRegistry[i - 1].instID == getNextInstID(); i--) {
+        if(shadowRegistry[i - 1].tag == tag) {
+            return shadowRegistry[i - 1].shadowID;
+        }
+    }
+    return NOT_FOUND;
+}
+
 void ExecBlock::setShadow(uint16_t id, rword v) {
-    RequireAction("ExecBlock::setShadow", id * sizeof(rword) < dataBlock.size() - sizeof(Context), abort());
+    RequireAction("ExecBlock::setShadow", id * sizeof(rword) < dataBlock.size() - shadowsOffset, abort());
     shadows[id] = v;
 }
 
 rword ExecBlock::getShadow(uint16_t id) const {
-    RequireAction("ExecBlock::getShadow", id * sizeof(rword) < dataBlock.size() - sizeof(Context), abort());
+    RequireAction("ExecBlock::getShadow", id * sizeof(rword) < dataBlock.size() - shadowsOffset, abort());
     return shadows[id];
 }
 
 rword ExecBlock::getShadowOffset(uint16_t id) const {
-    rword offset = sizeof(Context) + id*sizeof(rword);
+    rword offset = shadowsOffset + id*sizeof(rword);
     RequireAction("ExecBlock::getShadowOffset", offset < dataBlock.size(), abort());
     return offset;
 }
 
 uint16_t ExecBlock::getInstID(rword address) const {
-    for(size_t i = 0; i < instMetadata.size(); i++) {
-        if(instMetadata[i].address == address) {
-            return (uint16_t) i;
-        }
+    const uint16_t* instID = instIndex.find(address);
+    return instID != nullptr ? *instID : NOT_FOUND;
+}
+
+void ExecBlock::setCurrentInstID(uint16_t instID) {
+    Require("ExecBlock::setCurrentInstID", instID < instMetadata.size());
+    currentInst = instID;
+    // Chained exits may have moved the execution to another sequence
+    if(currentInst < seqRegistry[currentSeq].startInstID || currentInst > seqRegistry[currentSeq].endInstID) {
+        currentSeq = instRegistry[currentInst].seqID;
     }
-    return NOT_FOUND;
+}
+
+uint16_t ExecBlock::getInstIDByCodeAddress(rword address) const {
+    rword base = (rword) codeBlock.base();
+    if(address < base || address >= base + codeBlock.size() || instRegistry.empty()) {
+        return NOT_FOUND;
+    }
+    // Patches are written in instruction ID order, find the last one starting before address
+    rword offset = address - base;
+    std::vector<InstInfo>::const_iterator it = std::upper_bound(instRegistry.begin(), instRegistry.end(), offset,
+        [](rword offset, const InstInfo& info) { return offset < info.offset; });
+    if(it == instRegistry.begin()) {
+        return NOT_FOUND;
+    }
+    return (uint16_t) (it - instRegistry.begin() - 1);
+}
+
+bool ExecBlock::isMemoryWriteAt(rword address) const {
+    rword end = (rword) codeBlock.base() + codeBlock.size();
+    if(address < (rword) codeBlock.base() || address >= end) {
+        return false;
+    }
+    llvm::MCInst inst;
+    uint64_t size = 0;
+    llvm::ArrayRef<uint8_t> code((const uint8_t*) address, std::min((rword) 16, end - address));
+    if(assembly.getInstruction(inst, size, code, address) != llvm::MCDisassembler::Success) {
+        return false;
+    }
+    return getWriteSize(&inst) > 0;
 }
 
 const InstMetadata* ExecBlock::getInstMetadata(uint16_t instID) const {
@@ -400,12 +818,8 @@ const llvm::MCInst* ExecBlock::getOriginalMCInst(uint16_t instID) const {
 }
 
 uint16_t ExecBlock::getSeqID(rword address) const {
-    for(size_t i = 0; i < seqRegistry.size(); i++) {
-        if(instMetadata[seqRegistry[i].startInstID].address == address) {
-            return (uint16_t) i;
-        }
-    }
-    return NOT_FOUND;
+    const uint16_t* seqID = seqIndex.find(address);
+    return seqID != nullptr ? *seqID : NOT_FOUND;
 }
 
 uint16_t ExecBlock::getSeqID(uint16_t instID) const {
@@ -428,30 +842,25 @@ uint16_t ExecBlock::getSeqEnd(uint16_t seqID) const {
     return seqRegistry[seqID].endInstID;
 }
 
-std::vector<ShadowInfo> ExecBlock::queryShadowByInst(uint16_t instID, uint16_t tag) const {
-    std::vector<ShadowInfo> result;
-
-    for(const auto& reg: shadowRegistry) {
-        if((instID == ANY || reg.instID == instID) &&
-           (tag    == ANY || reg.tag    == tag)) {
-            result.push_back(reg);
-        }
+llvm::ArrayRef<ShadowInfo> ExecBlock::queryShadowByInst(uint16_t instID) const {
+    if(instID == ANY) {
+        return shadowRegistry;
     }
-
-    return result;
+    Require("ExecBlock::queryShadowByInst", instID < instRegistry.size());
+    const InstInfo& info = instRegistry[instID];
+    return llvm::ArrayRef<ShadowInfo>(shadowRegistry).slice(info.shadowOffset, info.shadowSize);
 }
 
-std::vector<ShadowInfo> ExecBlock::queryShadowBySeq(uint16_t seqID, uint16_t tag) const {
-    std::vector<ShadowInfo> result;
-
-    for(const auto& reg: shadowRegistry) {
-        if((seqID == ANY || reg.seqID  == seqID)  &&
-           (tag   == ANY || reg.tag   == tag)) {
-            result.push_back(reg);
-        }
+llvm::ArrayRef<ShadowInfo> ExecBlock::queryShadowBySeq(uint16_t seqID) const {
+    if(seqID == ANY) {
+        return shadowRegistry;
     }
-
-    return result;
+    Require("ExecBlock::queryShadowBySeq", seqID < seqRegistry.size());
+    // Instructions of a sequence are contiguous and so are their shadows
+    const InstInfo& start = instRegistry[seqRegistry[seqID].startInstID];
+    const InstInfo& end = instRegistry[seqRegistry[seqID].endInstID];
+    return llvm::ArrayRef<ShadowInfo>(shadowRegistry).slice(start.shadowOffset,
+                                                            end.shadowOffset + end.shadowSize - start.shadowOffset);
 }
 
 float ExecBlock::occupationRatio() const {
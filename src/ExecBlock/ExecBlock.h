@@ -22,13 +22,18 @@
 #include <memory>
 #include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/Support/Process.h"
 #include "llvm/Support/Memory.h"
 
 #include "Callback.h"
 #include "Context.h"
+#include "Options.h"
+#include "Range.h"
+#include "ExecBlock/ExecArena.h"
 #include "Patch/Types.h"
+#include "Utility/AddressMap.h"
 #include "Utility/memory_ostream.h"
 #include "Utility/Assembly.h"
 
@@ -45,6 +50,8 @@ enum SeqType {
 struct InstInfo {
     uint16_t seqID;
     uint16_t offset;
+    uint16_t shadowOffset;
+    uint16_t shadowSize;
 };
 
 struct SeqInfo {
@@ -66,10 +73,25 @@ struct ShadowInfo {
     uint16_t shadowID;
 };
 
+struct ExitInfo {
+    rword    target;
+    uint16_t guestShadow;
+    uint16_t hostShadow;
+};
+
 static const uint16_t EXEC_BLOCK_FULL = 0xFFFF;
 
-/*! Manages the concept of an exec block made of two contiguous memory blocks (one for the code, 
- *  the other for the data) used to store and execute instrumented basic blocks.
+static const uint16_t INDIRECT_CACHE_SIZE = 4;
+
+/*! Maximal size of the code block of an ExecBlock, the instruction offsets are 16 bits.
+ */
+static const size_t MAX_CODE_BLOCK_SIZE = 0x10000;
+
+/*! Manages the concept of an exec block made of two memory blocks (one for the code, the other
+ *  for the data) used to store and execute instrumented basic blocks. The blocks are contiguous
+ *  unless they are carved from an ExecArena. On X86_64, the code block of a block which is not
+ *  carved from an arena is mapped RX and written through a RW alias of the same memory, otherwise
+ *  its protections are switched between writes and executions.
  */
 class ExecBlock {
 private:
@@ -84,20 +106,42 @@ private:
     static void (*runCodeBlockFct)(void*);
 
     VMInstanceRef               vminstance;
+    ExecArena*                  arena;
     llvm::sys::MemoryBlock      codeBlock;
+    llvm::sys::MemoryBlock      writeBlock;
     llvm::sys::MemoryBlock      dataBlock;
     memory_ostream*             codeStream;
     Assembly&                   assembly;
     Context*                    context;
     rword*                      shadows;
+    rword                       shadowsOffset;
+    bool                        sharedContext;
     std::vector<ShadowInfo>     shadowRegistry;
     uint16_t                    shadowIdx;
     std::vector<InstMetadata>   instMetadata;
     std::vector<InstInfo>       instRegistry;
     std::vector<SeqInfo>        seqRegistry;
+    AddressMap<uint16_t>        instIndex;
+    AddressMap<uint16_t>        seqIndex;
+    std::vector<ExitInfo>       exitRegistry;
+    Options                     options;
+    bool                        fprUsed;
+    rword                       indirectCacheOffset;
+    rword                       exitSize;
+    uint16_t                    indirectCacheShadow;
+    uint16_t                    indirectCacheNext;
+    uint16_t                    indirectMissShadow;
+    bool                        hasReturnStack;
+    uint16_t                    returnStackShadow;
+    uint16_t                    returnTopShadow;
+    uint16_t                    returnNullShadow;
+    uint16_t                    returnScratchShadow;
     PageState                   pageState;
     uint16_t                    currentSeq;
     uint16_t                    currentInst;
+    uint64_t                    hostCalls;
+    rword                       resetOffset;
+    uint16_t                    resetShadowIdx;
 
     /*! Verify if the code block is in read execute mode.
      *
@@ -125,11 +169,25 @@ public:
      *
      * @param[in] assembly    Assembly used to assemble instructions in the ExecBlock.
      * @param[in] vminstance  Pointer to public engine interface
+     * @param[in] options     Execution options of the VM
+     * @param[in] contextHandle  Shared memory holding the context shared by all the ExecBlocks of the
+     *                           VM, or -1 to use a context private to this ExecBlock.
+     * @param[in] codeSize    Size of the code block, a multiple of the page size up to
+     *                        MAX_CODE_BLOCK_SIZE, or 0 for a single page.
+     * @param[in] arena       Arena to carve the code and data blocks from, or nullptr to map them.
+     *                        The arena must have enough free space.
      */
-    ExecBlock(Assembly& assembly, VMInstanceRef vminstance = nullptr);
+    ExecBlock(Assembly& assembly, VMInstanceRef vminstance = nullptr, Options options = NO_OPT, int contextHandle = -1,
+              size_t codeSize = 0, ExecArena* arena = nullptr);
 
     ~ExecBlock();
 
+    /*! Drop all the sequences of the exec block and bring it back to its state after construction.
+     *  The prologue, the epilogue and the indirect branch cache are kept, only the shadows used by
+     *  the sequences and the private context are cleared.
+     */
+    void reset();
+
     /*! Display the content of an exec block to stderr.
      */
     void show() const;
@@ -156,6 +214,16 @@ public:
      */
     SeqWriteResult writeSequence(std::vector<Patch>::const_iterator seqStart, std::vector<Patch>::const_iterator seqEnd, SeqType seqType);
 
+    /*! Drop the sequences having an instruction overlapping a guest address range from the
+     *  indexes of the exec block. Their code stays in place, such that a running sequence is not
+     *  affected, until the exec block is reset.
+     *
+     * @param range  [in] The guest address range.
+     *
+     * @return The IDs of the dropped sequences.
+     */
+    std::vector<uint16_t> invalidateSequences(Range<rword> range);
+
     /*! Split an existing sequence at instruction instID to create a new sequence.
      *
      * @param instID  [in] ID of the instruction where to split the sequence at.
@@ -164,6 +232,47 @@ public:
      */
     uint16_t splitSequence(uint16_t instID);
 
+    /*! Link the chained exits targeting an address to a sequence of this exec block such that
+     *  the execution continues directly to this sequence.
+     *
+     * @param address  [in] Guest address targeted by the exits.
+     * @param seqID    [in] ID of the sequence starting at this address.
+     */
+    void linkExits(rword address, uint16_t seqID);
+
+    /*! Unlink all the chained exits of the exec block. The sequences will then always return
+     *  to the VM at their end.
+     */
+    void unlinkExits();
+
+    /*! Get the chained exits written in the exec block.
+     *
+     * @return The list of chained exits.
+     */
+    const std::vector<ExitInfo>& getExits() const { return exitRegistry; }
+
+    /*! Get the guest address of the last dynamic exit which missed the indirect branch cache.
+     *
+     * @return The guest address or 0 if there is none.
+     */
+    rword getIndirectMiss() const;
+
+    /*! Add an entry to the indirect branch cache of the exec block. Entries are replaced in a
+     *  round robin fashion.
+     *
+     * @param address  [in] Guest address of the entry.
+     * @param seqID    [in] ID of the sequence starting at this address.
+     */
+    void cacheIndirectTarget(rword address, uint16_t seqID);
+
+    /*! Remove all the entries of the indirect branch cache of the exec block.
+     */
+    void clearIndirectCache();
+
+    /*! Empty the shadow return stack of the exec block.
+     */
+    void clearReturnStack();
+
     /*! Compute the offset between the current code stream position and the start of the data block.
      *  Used for pc relative memory access to the data block.
      *  
@@ -191,6 +300,15 @@ public:
         return (rword) codeBlock.base() + codeStream->current_pos();
     }
 
+    /*! Compute the size of a list of instructions once relocated at the current position and
+     *  assembled. The instructions are assembled in a scratch buffer and must not allocate shadows.
+     *
+     * @param[in] insts  The instructions to measure.
+     *
+     * @return The size in bytes of the assembled instructions.
+     */
+    rword getRelocatedSize(const std::vector<std::shared_ptr<RelocatableInst>>& insts);
+
     /*! Obtain the current instruction ID.
      *
      * @return The current instruction ID.
@@ -214,6 +332,36 @@ public:
      */
     uint16_t getCurrentInstID() const { return currentInst; }
 
+    /*! Obtain the number of breaks to the host made to call the callbacks requested by the
+     *  instrumentation since the creation of the ExecBlock.
+     *
+     * @return The number of callbacks called.
+     */
+    uint64_t getHostCalls() const { return hostCalls; }
+
+    /*! Set the current instruction, as done before calling a callback requested by the
+     *  instrumentation.
+     *
+     * @param instID The ID of the instruction.
+     */
+    void setCurrentInstID(uint16_t instID);
+
+    /*! Obtain the ID of the instruction whose patch contains an address of the code block.
+     *
+     * @param address An address in the code block.
+     *
+     * @return The instruction ID or NOT_FOUND.
+     */
+    uint16_t getInstIDByCodeAddress(rword address) const;
+
+    /*! Check if the JIT instruction at an address of the code block writes memory.
+     *
+     * @param address The address of a JIT instruction in the code block.
+     *
+     * @return True if the instruction writes memory.
+     */
+    bool isMemoryWriteAt(rword address) const;
+
     /*! Obtain the instruction metadata for a specific instruction ID.
      *
      * @param instID The instruction ID.
@@ -306,6 +454,12 @@ public:
      */
     Context* getContext() const {return context;}
 
+    /*! Check if the context of the ExecBlock is a mapping of the context shared by the VM.
+     *
+     * @return True if the context is shared.
+     */
+    bool isContextShared() const {return sharedContext;}
+
     /*! Allocate a new shadow within the data block. Used by relocation to load or store data from
      *  the instrumented code.
      *
@@ -338,27 +492,67 @@ public:
      */
     rword getShadowOffset(uint16_t id) const;
 
-    /* Query registered shadows and returns a vector of matching shadowID
+    /*! Get the last shadow registered with a tag by the instruction being written.
      *
-     * @param
+     *  @param tag [in] The tag of the shadow.
      *
-     * @return a vector of shadowID matching the query
+     *  @return The shadow id or NOT_FOUND.
      */
-    std::vector<ShadowInfo> queryShadowByInst(uint16_t instID, uint16_t tag) const;
+    uint16_t getLastShadow(uint16_t tag) const;
 
-    /* Query registered shadows and returns a vector of matching shadowID
+    /* Query the registered shadows of an instruction. Callers filter them by tag.
      *
-     * @param
+     * @param instID [in] ID of the instruction or ANY.
      *
-     * @return a vector of ShadowInfo matching the query
+     * @return the ShadowInfo of the instruction in registration order, valid until the next
+     *         write to the ExecBlock.
      */
-    std::vector<ShadowInfo> queryShadowBySeq(uint16_t seqID, uint16_t tag) const;
+    llvm::ArrayRef<ShadowInfo> queryShadowByInst(uint16_t instID) const;
+
+    /* Query the registered shadows of the instructions of a sequence. Callers filter them by tag.
+     *
+     * @param seqID [in] ID of the sequence or ANY.
+     *
+     * @return the ShadowInfo of the sequence in instruction order, valid until the next write
+     *         to the ExecBlock.
+     */
+    llvm::ArrayRef<ShadowInfo> queryShadowBySeq(uint16_t seqID) const;
 
     /* Compute the occupation ratio of the ExecBlock.
      *
      * @return the occupation ratio.
     */
     float occupationRatio() const;
+
+    /*! Get the size of the code block.
+     *
+     * @return The size in bytes.
+     */
+    size_t getCodeSize() const { return codeBlock.size(); }
+
+    /*! Get the size of the data block.
+     *
+     * @return The size in bytes.
+     */
+    size_t getDataSize() const { return dataBlock.size(); }
+
+    /*! Get the options the exec block was constructed with.
+     *
+     * @return The execution options.
+     */
+    Options getOptions() const { return options; }
+
+    /*! Check if the code block is written through a RW alias instead of changing its protections.
+     *
+     * @return True if the code block is dual mapped.
+     */
+    bool isDualMapped() const { return writeBlock.base() != codeBlock.base(); }
+
+    /*! Get the arena the blocks are carved from.
+     *
+     * @return The arena or nullptr if the blocks were mapped separately.
+     */
+    const ExecArena* getArena() const { return arena; }
 };
 
 }
@@ -19,6 +19,7 @@
 #include "ExecBlock/ExecBlockManager.h"
 #include "Patch/PatchRule.h"
 #include "Utility/LogSys.h"
+#include "Utility/System.h"
 
 #include <cstdint>
 #include <algorithm>
@@ -32,8 +33,28 @@
 
 namespace QBDI {
 
-ExecBlockManager::ExecBlockManager(llvm::MCInstrInfo& MCII, llvm::MCRegisterInfo& MRI, Assembly& assembly, VMInstanceRef vminstance) :
-   total_translated_size(1), total_translation_size(1), vminstance(vminstance), MCII(MCII), MRI(MRI), assembly(assembly) {
+ExecBlockManager::ExecBlockManager(llvm::MCInstrInfo& MCII, llvm::MCRegisterInfo& MRI, Assembly& assembly, VMInstanceRef vminstance,
+                                   Options options) :
+   total_translated_size(1), total_translation_size(1), cacheSize(0), cacheBudget(0), evictedRegions(0), useClock(0),
+   vminstance(vminstance), MCII(MCII), MRI(MRI), assembly(assembly),
+   options(options), chaining(false), chainingStop(0), tracing(false), contextHandle(-1), coverageMap(nullptr),
+   coverageSize(0), blockTrace(nullptr), blockCounters(nullptr) {
+    clearFrontCache();
+#if defined(QBDI_ARCH_X86_64)
+    // All the ExecBlocks map the same context page such that switching between them needs no copy.
+    // ARM reaches the data block with 12 bits PC relative offsets and can't afford a context page.
+    std::error_code ec;
+    size_t pageSize = llvm::sys::Process::getPageSize();
+    contextHandle = createSharedMemory(pageSize);
+    if(contextHandle >= 0) {
+        contextBlock = mapSharedMemory(contextHandle, nullptr, pageSize, ec);
+        if(ec) {
+            LogDebug("ExecBlockManager::ExecBlockManager", "Failed to map the shared context, using private contexts");
+            releaseSharedMemory(contextHandle);
+            contextHandle = -1;
+        }
+    }
+#endif
 }
 
 ExecBlockManager::~ExecBlockManager() {
@@ -41,6 +62,12 @@ ExecBlockManager::~ExecBlockManager() {
         this->printCacheStatistics(log);
     });
     clearCache();
+    releasePool();
+    releaseArenas();
+    if(contextHandle >= 0) {
+        releaseMappedMemory(contextBlock);
+        releaseSharedMemory(contextHandle);
+    }
 }
 
 float ExecBlockManager::getExpansionRatio() const { 
@@ -48,14 +75,132 @@ float ExecBlockManager::getExpansionRatio() const {
     return (float) total_translation_size / (float) total_translated_size; 
 }
 
+size_t ExecBlockManager::getCodeBlockSize(rword translated) const {
+#if defined(QBDI_ARCH_X86_64)
+    // Room for twice the predicted translation, such that the region can grow around it, in a
+    // power of two number of pages
+    size_t pageSize = llvm::sys::Process::getPageSize();
+    size_t predicted = (size_t) (2.0f * translated * getExpansionRatio());
+    size_t codeSize = pageSize;
+    while(codeSize < predicted && 2 * codeSize <= MAX_CODE_BLOCK_SIZE) {
+        codeSize *= 2;
+    }
+    return codeSize;
+#else
+    // ARM reaches the data block with 12 bits PC relative offsets, the blocks are a single page
+    return 0;
+#endif
+}
+
+ExecArena* ExecBlockManager::getArena(size_t codeSize) {
+    size_t pageSize = llvm::sys::Process::getPageSize();
+    if(codeSize == 0) {
+        codeSize = pageSize;
+    }
+    for(ExecArena* arena: arenas) {
+        if(arena->canAllocate(codeSize, codeSize + pageSize)) {
+            return arena;
+        }
+    }
+    ExecArena* arena = new ExecArena(pageSize);
+    if(arena->isValid() == false) {
+        LogDebug("ExecBlockManager::getArena", "Failed to map a new arena, using a separate mapping");
+        delete arena;
+        return nullptr;
+    }
+    arenas.push_back(arena);
+    return arena;
+}
+
+void ExecBlockManager::releaseArenas() {
+    for(size_t i = arenas.size(); i > 0; i--) {
+        if(arenas[i - 1]->isEmpty()) {
+            delete arenas[i - 1];
+            arenas.erase(arenas.begin() + i - 1);
+        }
+    }
+}
+
+void ExecBlockManager::releasePool() {
+    for(ExecBlock* block: blockPool) {
+        delete block;
+    }
+    blockPool.clear();
+}
+
+ExecBlock* ExecBlockManager::newExecBlock(rword translated) {
+    size_t codeSize = getCodeBlockSize(translated);
+    ExecArena* arena = nullptr;
+    // Reuse an erased block of the same shape, its prologue and epilogue are already written
+    for(size_t i = blockPool.size(); i > 0; i--) {
+        ExecBlock* block = blockPool[i - 1];
+        if(block->getOptions() == options && (codeSize == 0 || block->getCodeSize() == codeSize)) {
+            LogDebug("ExecBlockManager::newExecBlock", "Reusing ExecBlock %p", block);
+            blockPool.erase(blockPool.begin() + i - 1);
+            cacheSize += block->getCodeSize() + block->getDataSize();
+            return block;
+        }
+    }
+    // ARM can't reach the data block of an arena, iOS JIT pages come from the JIT server
+#if defined(QBDI_ARCH_X86_64) && !defined(QBDI_OS_IOS)
+    if(options & OPT_HUGE_PAGES) {
+        arena = getArena(codeSize);
+    }
+#endif
+    ExecBlock* block = new ExecBlock(assembly, vminstance, options, contextHandle, codeSize, arena);
+    cacheSize += block->getCodeSize() + block->getDataSize();
+    return block;
+}
+
+size_t ExecBlockManager::getRegionSize(size_t r) const {
+    size_t size = 0;
+    for(const ExecBlock* block: regions[r].blocks) {
+        size += block->getCodeSize() + block->getDataSize();
+    }
+    return size;
+}
+
+void ExecBlockManager::setCacheBudget(size_t budget) {
+    cacheBudget = budget;
+    evictRegions(regions.size());
+}
+
+void ExecBlockManager::evictRegions(size_t keep) {
+    // Regions queued by a pending flush are not evicted twice, the budget is checked again at the
+    // next write once it is committed
+    if(cacheBudget == 0 || cacheSize <= cacheBudget || isFlushPending()) {
+        return;
+    }
+    std::vector<size_t> lru;
+    for(size_t i = 0; i < regions.size(); i++) {
+        if(i != keep) {
+            lru.push_back(i);
+        }
+    }
+    std::sort(lru.begin(), lru.end(), [this](size_t a, size_t b) { return regions[a].lastUse < regions[b].lastUse; });
+    // Evict down to three quarters of the budget such that evictions are batched
+    size_t target = cacheBudget - cacheBudget / 4;
+    size_t remaining = cacheSize;
+    for(size_t i = 0; i < lru.size() && remaining > target; i++) {
+        LogDebug("ExecBlockManager::evictRegions", "Evicting region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "]",
+                 lru[i], regions[lru[i]].covered.start, regions[lru[i]].covered.end);
+        remaining -= getRegionSize(lru[i]);
+        flushList.push_back(lru[i]);
+        evictedRegions++;
+    }
+}
+
 void ExecBlockManager::printCacheStatistics(FILE* output) const {
     float mean_occupation = 0.0;
     size_t region_overflow = 0;
+    size_t huge_arenas = 0;
     fprintf(output, "\tCache made of %zu regions:\n", regions.size());
     for(size_t i = 0; i < regions.size(); i++) {
         float occupation = 0.0;
+        size_t code_size = 0;
         for(size_t j = 0; j < regions[i].blocks.size(); j++) {
             occupation += regions[i].blocks[j]->occupationRatio();
+            code_size += regions[i].blocks[j]->getCodeSize();
         }
         if(regions[i].blocks.size() > 1) {
             region_overflow += 1;
@@ -64,44 +209,69 @@ void ExecBlockManager::printCacheStatistics(FILE* output) const {
             occupation /= regions[i].blocks.size();
         }
         mean_occupation += occupation;
-        fprintf(output, "\t\t[0x%" PRIRWORD ", 0x%" PRIRWORD "]: %zu blocks, %f occupation ratio\n", regions[i].covered.start, regions[i].covered.end, regions[i].blocks.size(), occupation);
+        fprintf(output, "\t\t[0x%" PRIRWORD ", 0x%" PRIRWORD "]: %zu blocks, %zu code bytes, %f occupation ratio\n", regions[i].covered.start, regions[i].covered.end, regions[i].blocks.size(), code_size, occupation);
     }
     if(regions.size() > 0) {
         mean_occupation /= regions.size();
     }
+    for(const ExecArena* arena: arenas) {
+        if(arena->hasHugePages()) {
+            huge_arenas += 1;
+        }
+    }
     fprintf(output, "\tMean occupation ratio: %f\n", mean_occupation);
     fprintf(output, "\tRegion overflow count: %zu\n", region_overflow);
+    fprintf(output, "\tArena count: %zu (%zu with huge pages)\n", arenas.size(), huge_arenas);
+    fprintf(output, "\tPooled ExecBlocks: %zu\n", blockPool.size());
+    fprintf(output, "\tCache size: %zu bytes (budget %zu), %zu regions evicted\n", cacheSize, cacheBudget, evictedRegions);
+}
+
+void ExecBlockManager::clearFrontCache() {
+    frontCache.assign(FRONT_CACHE_SIZE, FrontCacheEntry {0, nullptr, 0, 0});
 }
 
 ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
+    // Fast path: most dispatches hit a recently resolved sequence
+    const FrontCacheEntry& entry = frontCache[frontCacheSlot(address)];
+    if(entry.address == address && entry.block != nullptr) {
+        regions[entry.region].lastUse = ++useClock;
+        entry.block->selectSeq(entry.seqID);
+        return entry.block;
+    }
+
     LogDebug("ExecBlockManager::getProgrammedExecBlock", "Looking up sequence at address %" PRIRWORD, address);
 
     size_t r = searchRegion(address);
 
     if(r < regions.size() && regions[r].covered.contains(address)) {
         ExecRegion& region = regions[r];
+        region.lastUse = ++useClock;
 
         // Attempting sequenceCache resolution
-        const std::map<rword, SeqLoc>::const_iterator seqLoc = region.sequenceCache.find(address);
-        if(seqLoc != region.sequenceCache.end()) {
+        const SeqLoc* seqLoc = region.sequenceCache.find(address);
+        if(seqLoc != nullptr) {
             LogDebug("ExecBlockManager::getProgrammedExecBlock", "Found sequence 0x%" PRIRWORD " in ExecBlock %p as seqID %" PRIu16, 
-                     address, region.blocks[seqLoc->second.blockIdx], seqLoc->second.seqID);
+                     address, region.blocks[seqLoc->blockIdx], seqLoc->seqID);
             // Select sequence and return execBlock
-            region.blocks[seqLoc->second.blockIdx]->selectSeq(seqLoc->second.seqID);
-            return region.blocks[seqLoc->second.blockIdx];
+            region.blocks[seqLoc->blockIdx]->selectSeq(seqLoc->seqID);
+            cacheFront(address, region.blocks[seqLoc->blockIdx], seqLoc->seqID, r);
+            return region.blocks[seqLoc->blockIdx];
         }
 
-        // Attempting instCache resolution    
-        const std::map<rword, InstLoc>::const_iterator instLoc = region.instCache.find(address);
-        if(instLoc != region.instCache.end()) {
+        // Attempting instCache resolution. A split sequence would miss the basic block entry hit,
+        // the basic block is translated again from that instruction instead.
+        const InstLoc* found = region.instCache.find(address);
+        if(found != nullptr && coverageMap == nullptr && blockTrace == nullptr && blockCounters == nullptr) {
+            // Copies as the insertion below invalidates the references to the cache entries
+            const InstLoc instLoc = *found;
             // Retrieving corresponding block and seqLoc
-            ExecBlock* block = region.blocks[instLoc->second.blockIdx];
-            uint16_t existingSeqId = block->getSeqID(instLoc->second.instID);
-            const SeqLoc& existingSeqLoc = region.sequenceCache[block->getInstMetadata(block->getSeqStart(existingSeqId))->address];
+            ExecBlock* block = region.blocks[instLoc.blockIdx];
+            uint16_t existingSeqId = block->getSeqID(instLoc.instID);
+            const SeqLoc existingSeqLoc = region.sequenceCache[block->getInstMetadata(block->getSeqStart(existingSeqId))->address];
             // Creating a new sequence at that instruction and saving it in the sequenceCache
-            uint16_t newSeqID = block->splitSequence(instLoc->second.instID);
+            uint16_t newSeqID = block->splitSequence(instLoc.instID);
             regions[r].sequenceCache[address] = SeqLoc {
-                instLoc->second.blockIdx,
+                instLoc.blockIdx,
                 newSeqID,
                 address,
                 existingSeqLoc.bbEnd,
@@ -109,8 +279,13 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
                 existingSeqLoc.seqEnd,
             };
             LogDebug("ExecBlockManager::getProgrammedExecBlock", "Splitted seqID %" PRIu16 " at instID %" PRIu16 " in ExecBlock %p as new sequence with seqID %" PRIu16,
-                     existingSeqId, instLoc->second.instID, block, newSeqID);
+                     existingSeqId, instLoc.instID, block, newSeqID);
+            // Exits of the block targeting the new sequence can now be linked
+            if(chaining) {
+                linkBlock(r, instLoc.blockIdx);
+            }
             block->selectSeq(newSeqID);
+            cacheFront(address, block, newSeqID, r);
             return block;
         }
     }
@@ -121,10 +296,7 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
 const SeqLoc* ExecBlockManager::getSeqLoc(rword address) const {
     size_t r = searchRegion(address);
     if(r < regions.size() && regions[r].covered.contains(address)) {
-        const std::map<rword, SeqLoc>::const_iterator seqLoc = regions[r].sequenceCache.find(address);
-        if(seqLoc != regions[r].sequenceCache.end()) {
-            return &(seqLoc->second);
-        }
+        return regions[r].sequenceCache.find(address);
     }
     return nullptr;
 }
@@ -138,9 +310,20 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
     rword bbStart = firstPatch.metadata.address;
     rword bbEnd = lastPatch.metadata.endAddress();
 
+    // The entry hit of the basic block is written with its first instruction, such that every
+    // entry of the basic block sequence, chained or not, goes through it
+    RelocatableInst::SharedPtrVec entryHit = getBlockEntryHit(bbStart);
+    std::vector<Patch> hitBlock;
+    if(entryHit.size() > 0) {
+        hitBlock = basicBlock;
+        hitBlock.front().prepend(entryHit);
+    }
+    const std::vector<Patch>& patches = entryHit.size() > 0 ? hitBlock : basicBlock;
+
     // Locating an approriate cache region
     size_t r = findRegion(Range<rword>(bbStart, bbEnd));
     ExecRegion& region = regions[r];
+    region.lastUse = ++useClock;
 
     // Basic block truncation to prevent dedoubled sequence
     for(size_t i = 0; i < basicBlock.size(); i++) {
@@ -164,14 +347,14 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
             // Optimally, a region should only have one ExecBlocks but misspredictions or oversized 
             // basic blocks can cause overflows.
             if(i >= region.blocks.size()) {
-                region.blocks.push_back(new ExecBlock(assembly, vminstance));
+                region.blocks.push_back(newExecBlock(basicBlock[patchEnd - 1].metadata.endAddress() - basicBlock[patchIdx].metadata.address));
             }
             // Determine sequence type
             SeqType seqType = (SeqType) 0;
             if(patchIdx == 0) seqType = (SeqType) (seqType | SeqType::Entry);
             if(patchEnd == basicBlock.size()) seqType = (SeqType) (seqType | SeqType::Exit);
             // Write sequence
-            SeqWriteResult res = region.blocks[i]->writeSequence(basicBlock.begin() + patchIdx, basicBlock.begin() + patchEnd, seqType);
+            SeqWriteResult res = region.blocks[i]->writeSequence(patches.begin() + patchIdx, patches.begin() + patchEnd, seqType);
             // Successful write
             if(res.seqID != EXEC_BLOCK_FULL) {
                 // Saving sequence in the sequence cache
@@ -193,6 +376,10 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
                          basicBlock[patchIdx].metadata.address,
                          basicBlock[patchIdx + res.patchWritten - 1].metadata.endAddress(),
                          region.blocks[i], res.seqID);
+                // Link the new sequence with the other sequences of the block
+                if(chaining) {
+                    linkBlock(r, (uint16_t) i);
+                }
                 // Updating counters
                 translated += basicBlock[patchIdx + res.patchWritten - 1].metadata.endAddress() - basicBlock[patchIdx].metadata.address;
                 translation += res.bytesWritten;
@@ -205,6 +392,7 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
     total_translation_size += translation;
     total_translated_size += translated;
     updateRegionStat(r, translated);
+    evictRegions(r);
 }
 
 size_t ExecBlockManager::searchRegion(rword address) const {
@@ -302,6 +490,17 @@ size_t ExecBlockManager::findRegion(Range<rword> codeRange) {
         codeRange.end
     );
     regions.insert(regions.begin() + insert, ExecRegion {codeRange, 0, 0, std::vector<ExecBlock*>()});
+    // The front cache entries and the pending flush of the following regions are shifted
+    for(FrontCacheEntry& entry: frontCache) {
+        if(entry.block != nullptr && entry.region >= insert) {
+            entry.region++;
+        }
+    }
+    for(size_t& r: flushList) {
+        if(r >= insert) {
+            r++;
+        }
+    }
     return insert;
 }
 
@@ -309,15 +508,17 @@ void ExecBlockManager::updateRegionStat(size_t r, rword translated) {
     regions[r].translated += translated;
     // Remaining code block space
     regions[r].available = regions[r].blocks[0]->getEpilogueOffset();
-    // Space which needs to be reserved for the non translated part of the covered region
-    unsigned reserved = (unsigned) (((float) (regions[r].covered.size() - regions[r].translated)) * getExpansionRatio());
+    // Space which needs to be reserved for the non translated part of the covered region.
+    // Invalidated sequences are counted again when translated again.
+    rword untranslated = regions[r].covered.size() > regions[r].translated ? regions[r].covered.size() - regions[r].translated : 0;
+    unsigned reserved = (unsigned) (((float) untranslated) * getExpansionRatio());
     LogDebug(
         "ExecBlockManager::updateRegionStat", 
         "Region %zu has %zu bytes available of which %u are reserved for %zu bytes of untranslated code",
         r,
         regions[r].available,
         reserved,
-        (regions[r].covered.size() - regions[r].translated)
+        untranslated
     );
     if(reserved > regions[r].available) {
         regions[r].available = 0;
@@ -327,6 +528,265 @@ void ExecBlockManager::updateRegionStat(size_t r, rword translated) {
     }
 }
 
+void ExecBlockManager::linkBlock(size_t r, uint16_t blockIdx) {
+    ExecBlock* block = regions[r].blocks[blockIdx];
+    // Exits can only be linked to sequences of the same block as they share the same context
+    for(const ExitInfo& exit : block->getExits()) {
+        // The stop address of the current run must always go back to the engine
+        if(exit.target == chainingStop) {
+            continue;
+        }
+        const SeqLoc* seqLoc = regions[r].sequenceCache.find(exit.target);
+        if(seqLoc != nullptr && seqLoc->blockIdx == blockIdx) {
+            block->linkExits(exit.target, seqLoc->seqID);
+        }
+    }
+}
+
+void ExecBlockManager::setChaining(bool enable) {
+    if(enable == chaining) {
+        return;
+    }
+    LogDebug("ExecBlockManager::setChaining", "%s direct chaining", enable ? "Enabling" : "Disabling");
+    chaining = enable;
+    for(size_t r = 0; r < regions.size(); r++) {
+        for(size_t i = 0; i < regions[r].blocks.size(); i++) {
+            if(chaining) {
+                linkBlock(r, (uint16_t) i);
+            }
+            else {
+                regions[r].blocks[i]->unlinkExits();
+            }
+        }
+    }
+}
+
+bool ExecBlockManager::traceReaches(size_t r, const SeqLoc& seqLoc, rword address) const {
+    const ExecBlock* block = regions[r].blocks[seqLoc.blockIdx];
+    // Inside a sequence, only the basic blocks appended by a trace follow an instruction modifying the PC
+    for(uint16_t instID = block->getSeqStart(seqLoc.seqID) + 1; instID <= block->getSeqEnd(seqLoc.seqID); instID++) {
+        if(block->getInstAddress(instID) == address && block->getInstMetadata((uint16_t) (instID - 1))->modifyPC) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ExecBlockManager::setChainingStop(rword stop) {
+    if(stop == chainingStop) {
+        return;
+    }
+    chainingStop = stop;
+    // The traces running through the new stop address are translated again, they are formed
+    // anew without it once hot
+    if(tracing) {
+        for(size_t r = 0; r < regions.size(); r++) {
+            for(const std::pair<rword, SeqLoc>& entry: regions[r].sequenceCache) {
+                if(traceReaches(r, entry.second, stop)) {
+                    LogDebug("ExecBlockManager::setChainingStop", "Dropping trace 0x%" PRIRWORD " containing the stop address", entry.first);
+                    invalidList.add(Range<rword>(entry.first, entry.first + 1));
+                }
+            }
+        }
+    }
+    if(chaining == false) {
+        return;
+    }
+    LogDebug("ExecBlockManager::setChainingStop", "Relinking exec blocks for stop address 0x%" PRIRWORD, stop);
+    for(size_t r = 0; r < regions.size(); r++) {
+        for(size_t i = 0; i < regions[r].blocks.size(); i++) {
+            regions[r].blocks[i]->unlinkExits();
+            linkBlock(r, (uint16_t) i);
+        }
+    }
+}
+
+void ExecBlockManager::setTracing(bool enable) {
+    if(enable == tracing) {
+        return;
+    }
+    LogDebug("ExecBlockManager::setTracing", "%s hot traces", enable ? "Enabling" : "Disabling");
+    tracing = enable;
+    // Traces merge basic blocks together, drop them
+    if(tracing == false) {
+        clearCache(Range<rword>(0, (rword) -1));
+    }
+}
+
+bool ExecBlockManager::setCoverageMap(uint8_t* map, size_t size) {
+    if(map != nullptr) {
+        // The previous location is kept in the context and needs to be seen by every ExecBlock
+        RequireAction("ExecBlockManager::setCoverageMap", contextHandle >= 0, return false);
+        RequireAction("ExecBlockManager::setCoverageMap", size >= 2 && (size & (size - 1)) == 0, return false);
+    }
+    LogDebug("ExecBlockManager::setCoverageMap", "Coverage map set to %p of %zu bytes", map, size);
+    // The coverage hits are part of the translated code
+    clearCache(Range<rword>(0, (rword) -1));
+    coverageMap = map;
+    coverageSize = map != nullptr ? size : 0;
+    resetCoverageLocation();
+    return true;
+}
+
+void ExecBlockManager::resetCoverageLocation() {
+    if(contextHandle >= 0) {
+        getSharedContext()->hostState.coveragePrev = 0;
+    }
+}
+
+void ExecBlockManager::setBlockTrace(const BlockTrace* trace) {
+    LogDebug("ExecBlockManager::setBlockTrace", "Basic block trace set to %p", trace);
+    // The trace hits are part of the translated code
+    clearCache(Range<rword>(0, (rword) -1));
+    blockTrace = trace;
+}
+
+void ExecBlockManager::setBlockCounters(std::map<rword, uint64_t>* counters) {
+    LogDebug("ExecBlockManager::setBlockCounters", "Basic block counters set to %p", counters);
+    // The counter hits are part of the translated code
+    clearCache(Range<rword>(0, (rword) -1));
+    blockCounters = counters;
+}
+
+RelocatableInst::SharedPtrVec ExecBlockManager::getBlockEntryHit(rword address) const {
+    RelocatableInst::SharedPtrVec hit;
+    if(coverageMap != nullptr) {
+        // The slot of an edge is the sum of both locations, each one has to stay in half of the map
+        rword mask = (rword) (coverageSize / 2 - 1);
+        rword location = (rword) (((uint64_t) address * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+        append(hit, getCoverageHit((rword) coverageMap + location, Offset(offsetof(Context, hostState.coveragePrev)),
+                                   location >> 1));
+    }
+    if(blockTrace != nullptr) {
+        append(hit, getBlockTraceHit(address, blockTrace));
+    }
+    if(blockCounters != nullptr) {
+        // The counter is created by the first translation of the basic block, the map nodes never move
+        append(hit, getCounterHit((rword) &(*blockCounters)[address]));
+    }
+    return hit;
+}
+
+SeqLoc* ExecBlockManager::findSeqLoc(rword address) {
+    // The profiled sequences were just dispatched, their front cache entry usually gives the region
+    const FrontCacheEntry& entry = frontCache[frontCacheSlot(address)];
+    size_t r = (entry.address == address && entry.block != nullptr) ? entry.region : searchRegion(address);
+    if(r < regions.size() && regions[r].covered.contains(address)) {
+        return regions[r].sequenceCache.find(address);
+    }
+    return nullptr;
+}
+
+bool ExecBlockManager::profileSequence(rword address) {
+    SeqLoc* seqLoc = findSeqLoc(address);
+    return seqLoc != nullptr && ++seqLoc->hits == HOT_TRACE_THRESHOLD;
+}
+
+void ExecBlockManager::profileEdge(rword from, rword to) {
+    SeqLoc* seqLoc = findSeqLoc(from);
+    if(seqLoc == nullptr) {
+        return;
+    }
+    // Majority vote: the kept successor is the most frequent one if there is a majority
+    if(seqLoc->successor == to) {
+        seqLoc->confidence++;
+    }
+    else if(seqLoc->confidence == 0) {
+        seqLoc->successor = to;
+        seqLoc->confidence = 1;
+    }
+    else {
+        seqLoc->confidence--;
+    }
+}
+
+rword ExecBlockManager::getHotSuccessor(const std::vector<Patch>& basicBlock) const {
+    std::vector<rword> targets = getStaticTargets(basicBlock.back().metadata);
+    const SeqLoc* seqLoc = getSeqLoc(basicBlock.front().metadata.address);
+    // The profiled successor is only trusted if the exit can actually reach it
+    if(seqLoc != nullptr && seqLoc->confidence > 0) {
+        rword successor = seqLoc->successor;
+        if(targets.size() == 0 || std::find(targets.begin(), targets.end(), successor) != targets.end()) {
+            return successor;
+        }
+    }
+    if(targets.size() == 1) {
+        return targets[0];
+    }
+    return 0;
+}
+
+bool ExecBlockManager::writeTrace(const std::vector<std::vector<Patch>>& basicBlocks) {
+    if(basicBlocks.size() < 2) {
+        return false;
+    }
+    rword head = basicBlocks.front().front().metadata.address;
+    size_t r = searchRegion(head);
+    if(r >= regions.size() || regions[r].covered.contains(head) == false || regions[r].sequenceCache.count(head) == 0) {
+        return false;
+    }
+    ExecRegion& region = regions[r];
+
+    // Concatenate the basic blocks, guarding each transition with a side exit
+    std::vector<Patch> trace;
+    size_t traced = 0;
+    for(const std::vector<Patch>& basicBlock : basicBlocks) {
+        Range<rword> bbRange(basicBlock.front().metadata.address, basicBlock.back().metadata.endAddress());
+        // Basic blocks outside of the region would not be flushed with it
+        if(region.covered.contains(bbRange) == false) {
+            break;
+        }
+        // The run has to go back to the engine on its stop address
+        if(trace.size() > 0 && bbRange.start == chainingStop) {
+            break;
+        }
+        if(trace.size() > 0) {
+            RelocatableInst::SharedPtrVec guard = getTraceGuard(bbRange.start);
+            if(guard.size() == 0) {
+                // Not supported by this architecture
+                return false;
+            }
+            trace.back().append(guard);
+            // The basic blocks inside the trace are not entered through their own sequence
+            trace.back().append(getBlockEntryHit(bbRange.start));
+        }
+        trace.insert(trace.end(), basicBlock.begin(), basicBlock.end());
+        traced++;
+    }
+    if(traced < 2) {
+        LogDebug("ExecBlockManager::writeTrace", "Trace 0x%" PRIRWORD " is too short", head);
+        return false;
+    }
+    trace.front().prepend(getBlockEntryHit(head));
+
+    for(size_t i = 0; true; i++) {
+        if(i >= region.blocks.size()) {
+            rword traceSize = 0;
+            for(const Patch& patch: trace) {
+                traceSize += patch.metadata.instSize;
+            }
+            region.blocks.push_back(newExecBlock(traceSize));
+        }
+        SeqWriteResult res = region.blocks[i]->writeSequence(trace.begin(), trace.end(), (SeqType) (SeqType::Entry | SeqType::Exit));
+        if(res.seqID != EXEC_BLOCK_FULL) {
+            // The trace replaces the head sequence, the sequence metadata stay the ones of its first basic block
+            SeqLoc& seqLoc = region.sequenceCache[head];
+            seqLoc.blockIdx = (uint16_t) i;
+            seqLoc.seqID = res.seqID;
+            cacheFront(head, region.blocks[i], res.seqID, r);
+            LogDebug("ExecBlockManager::writeTrace", "Trace 0x%" PRIRWORD " of %zu basic blocks written in ExecBlock %p as seqID %" PRIu16,
+                     head, traced, region.blocks[i], res.seqID);
+            if(chaining) {
+                linkBlock(r, (uint16_t) i);
+            }
+            break;
+        }
+    }
+    updateRegionStat(r, 0);
+    evictRegions(r);
+    return true;
+}
+
 static void analyseRegister(OperandAnalysis& opa, unsigned int regNo, const llvm::MCRegisterInfo& MRI) {
     opa.regName = MRI.getName(regNo);
     opa.value = regNo;
@@ -609,18 +1069,81 @@ const InstAnalysis* ExecBlockManager::analyzeInstMetadata(const InstMetadata* in
 void ExecBlockManager::eraseRegion(size_t r) {
     LogDebug("ExecBlockManager::eraseRegion", "Erasing region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "]", 
              r, regions[r].covered.start, regions[r].covered.end);
-    // Delete cached blocks
+    // Reset cached blocks into the pool, the ones which don't fit are deleted
+    cacheSize -= getRegionSize(r);
     for(ExecBlock* block: regions[r].blocks) {
-        LogDebug("ExecBlockManager::eraseRegion", "Dropping ExecBlock %p", block);
-        delete block;
+        if(blockPool.size() < EXEC_BLOCK_POOL_SIZE) {
+            LogDebug("ExecBlockManager::eraseRegion", "Pooling ExecBlock %p", block);
+            block->reset();
+            blockPool.push_back(block);
+        }
+        else {
+            LogDebug("ExecBlockManager::eraseRegion", "Dropping ExecBlock %p", block);
+            delete block;
+        }
     }
     // Delete cached analysis
-    for(std::pair<rword, InstAnalysis*> analysis: regions[r].analysisCache) {
+    for(const std::pair<rword, InstAnalysis*>& analysis: regions[r].analysisCache) {
         freeInstAnalysis(analysis.second);
     }
     regions.erase(regions.begin() + r);
 }
 
+void ExecBlockManager::invalidateSequences(size_t r, Range<rword> range) {
+    ExecRegion& region = regions[r];
+    LogDebug("ExecBlockManager::invalidateSequences", "Invalidating range [0x%" PRIRWORD ", 0x%" PRIRWORD "] in region %zu",
+             range.start, range.end, r);
+    std::vector<std::vector<uint16_t>> invalidated;
+    for(ExecBlock* block: region.blocks) {
+        invalidated.push_back(block->invalidateSequences(range));
+    }
+    auto isInvalidated = [&invalidated](uint16_t blockIdx, uint16_t seqID) -> bool {
+        const std::vector<uint16_t>& seqIDs = invalidated[blockIdx];
+        return std::find(seqIDs.begin(), seqIDs.end(), seqID) != seqIDs.end();
+    };
+    // Drop the sequences from the caches, they are translated again on their next execution. The
+    // keys are collected first as erasing moves the entries.
+    std::vector<rword> dropped;
+    for(const std::pair<rword, SeqLoc>& entry: region.sequenceCache) {
+        if(isInvalidated(entry.second.blockIdx, entry.second.seqID)) {
+            dropped.push_back(entry.first);
+        }
+    }
+    for(rword address: dropped) {
+        region.sequenceCache.erase(address);
+    }
+    dropped.clear();
+    for(const std::pair<rword, InstLoc>& entry: region.instCache) {
+        ExecBlock* block = region.blocks[entry.second.blockIdx];
+        if(isInvalidated(entry.second.blockIdx, block->getSeqID(entry.second.instID))) {
+            dropped.push_back(entry.first);
+        }
+    }
+    for(rword address: dropped) {
+        region.instCache.erase(address);
+    }
+    dropped.clear();
+    for(const std::pair<rword, InstAnalysis*>& analysis: region.analysisCache) {
+        if(range.contains(analysis.first)) {
+            freeInstAnalysis(analysis.second);
+            dropped.push_back(analysis.first);
+        }
+    }
+    for(rword address: dropped) {
+        region.analysisCache.erase(address);
+    }
+    // The chained exits and the indirect branch caches leading to the dropped sequences go back to
+    // the VM instead, until they are linked to the new translations
+    for(size_t i = 0; i < region.blocks.size(); i++) {
+        if(invalidated[i].size() > 0) {
+            region.blocks[i]->unlinkExits();
+            if(chaining) {
+                linkBlock(r, (uint16_t) i);
+            }
+        }
+    }
+}
+
 void ExecBlockManager::clearCache(RangeSet<rword> rangeSet) {
     const std::vector<Range<rword>>& ranges = rangeSet.getRanges();
     for(Range<rword> r: ranges) {
@@ -632,6 +1155,28 @@ void ExecBlockManager::clearCache(RangeSet<rword> rangeSet) {
 }
 
 void ExecBlockManager::flushCommit() {
+    // Sequences are invalidated first as it doesn't move the regions
+    if(invalidList.getRanges().size() > 0) {
+        for(size_t r = 0; r < regions.size(); r++) {
+            for(Range<rword> range: invalidList.getRanges()) {
+                if(regions[r].covered.overlaps(range)) {
+                    invalidateSequences(r, range);
+                }
+            }
+        }
+        std::vector<rword> dropped;
+        for(const std::pair<rword, InstAnalysis*>& analysis: analysisCache) {
+            if(invalidList.contains(analysis.first)) {
+                freeInstAnalysis(analysis.second);
+                dropped.push_back(analysis.first);
+            }
+        }
+        for(rword address: dropped) {
+            analysisCache.erase(address);
+        }
+        invalidList.clear();
+        clearFrontCache();
+    }
     // It needs to be erased from last to first to preserve index validity
     if(flushList.size() > 0) {
         LogDebug("ExecBlockManager::flushCommit", "Flushing analysis caches");
@@ -642,8 +1187,10 @@ void ExecBlockManager::flushCommit() {
             eraseRegion(r);
         }
         flushList.clear();
+        // The erased ExecBlocks may be referenced from anywhere in the front cache
+        clearFrontCache();
         // Clear global cache
-        for(std::pair<rword, InstAnalysis*> analysis: analysisCache) {
+        for(const std::pair<rword, InstAnalysis*>& analysis: analysisCache) {
             freeInstAnalysis(analysis.second);
         }
         analysisCache.clear();
@@ -655,7 +1202,14 @@ void ExecBlockManager::clearCache(Range<rword> range) {
     LogDebug("ExecBlockManager::clearCache", "Erasing range [0x%" PRIRWORD ", 0x%" PRIRWORD "]", range.start, range.end);
     for(i = 0; i < regions.size(); i++) {
         if(regions[i].covered.overlaps(range)) {
-            flushList.push_back(i);
+            // Only the sequences overlapping a partial range are translated again, the rest of
+            // the region is kept
+            if(range.contains(regions[i].covered)) {
+                flushList.push_back(i);
+            }
+            else {
+                invalidList.add(range);
+            }
         }
     }
 }
@@ -665,6 +1219,8 @@ void ExecBlockManager::clearCache() {
     while(regions.size() > 0) {
         eraseRegion(regions.size() - 1);
     }
+    clearFrontCache();
+    releaseArenas();
 }
 
 }
@@ -24,9 +24,12 @@
 
 #include "Context.h"
 #include "InstAnalysis.h"
+#include "Options.h"
 #include "Range.h"
 #include "Utility/Assembly.h"
+#include "Utility/AddressMap.h"
 #include "ExecBlock/ExecBlock.h"
+#include "Patch/RelocatableInst.h"
 
 
 namespace QBDI {
@@ -45,6 +48,30 @@ struct SeqLoc {
     rword bbEnd;
     rword seqStart;
     rword seqEnd;
+    // Trace profile, reset with the entry when the sequence is translated again
+    uint32_t hits;
+    rword    successor;
+    uint32_t confidence;
+};
+
+static const uint32_t HOT_TRACE_THRESHOLD = 64;
+
+static const size_t MAX_TRACE_BLOCKS = 8;
+
+/*! Direct mapped cache resolving a sequence address to its ExecBlock and seqID without going
+ *  through the region search. Must be a power of two.
+ */
+static const size_t FRONT_CACHE_SIZE = 4096;
+
+/*! Maximal number of erased ExecBlocks kept to be reused instead of being mapped again.
+ */
+static const size_t EXEC_BLOCK_POOL_SIZE = 64;
+
+struct FrontCacheEntry {
+    rword      address;
+    ExecBlock* block;
+    uint16_t   seqID;
+    uint32_t   region;
 };
 
 struct ExecRegion {
@@ -52,39 +79,93 @@ struct ExecRegion {
     unsigned                        translated; 
     unsigned                        available;
     std::vector<ExecBlock*>         blocks;
-    std::map<rword, SeqLoc>         sequenceCache;
-    std::map<rword, InstLoc>        instCache;
-    std::map<rword, InstAnalysis*>  analysisCache;
+    AddressMap<SeqLoc>              sequenceCache;
+    AddressMap<InstLoc>             instCache;
+    AddressMap<InstAnalysis*>       analysisCache;
+    uint64_t                        lastUse;
 };
 
 class ExecBlockManager {
 private:
 
     std::vector<ExecRegion>         regions;
-    std::map<rword, InstAnalysis*>  analysisCache;
+    std::vector<FrontCacheEntry>    frontCache;
+    AddressMap<InstAnalysis*>       analysisCache;
     std::vector<size_t>             flushList;
+    RangeSet<rword>                 invalidList;
+    std::vector<ExecArena*>         arenas;
+    std::vector<ExecBlock*>         blockPool;
     rword                           total_translated_size;
     rword                           total_translation_size;
+    size_t                          cacheSize;
+    size_t                          cacheBudget;
+    size_t                          evictedRegions;
+    uint64_t                        useClock;
 
     VMInstanceRef              vminstance;
     llvm::MCInstrInfo&         MCII;
     llvm::MCRegisterInfo&      MRI;
     Assembly&                  assembly;
+    Options                    options;
+    bool                       chaining;
+    rword                      chainingStop;
+    bool                       tracing;
+    int                        contextHandle;
+    llvm::sys::MemoryBlock     contextBlock;
+    uint8_t*                   coverageMap;
+    size_t                     coverageSize;
+    const BlockTrace*          blockTrace;
+    std::map<rword, uint64_t>* blockCounters;
+
+    static size_t frontCacheSlot(rword address) {
+        return (size_t) (((uint64_t) address * 0x9E3779B97F4A7C15ull) >> 32) & (FRONT_CACHE_SIZE - 1);
+    }
+
+    void cacheFront(rword address, ExecBlock* block, uint16_t seqID, size_t region) {
+        frontCache[frontCacheSlot(address)] = FrontCacheEntry {address, block, seqID, (uint32_t) region};
+    }
+
+    void clearFrontCache();
+
+    SeqLoc* findSeqLoc(rword address);
 
     void eraseRegion(size_t r);
 
+    void invalidateSequences(size_t r, Range<rword> range);
+
     size_t searchRegion(rword start) const;
 
     size_t findRegion(Range<rword> codeRange);
 
     void updateRegionStat(size_t r, rword translated);
 
+    size_t getRegionSize(size_t r) const;
+
+    void evictRegions(size_t keep);
+
+    void linkBlock(size_t r, uint16_t blockIdx);
+
+    bool traceReaches(size_t r, const SeqLoc& seqLoc, rword address) const;
+
     float getExpansionRatio() const;
 
+    size_t getCodeBlockSize(rword translated) const;
+
+    ExecArena* getArena(size_t codeSize);
+
+    void releaseArenas();
+
+    void releasePool();
+
+    ExecBlock* newExecBlock(rword translated);
+
+    RelocatableInst::SharedPtrVec getBlockEntryHit(rword address) const;
+
 
 public:
 
-    ExecBlockManager(llvm::MCInstrInfo& MCII, llvm::MCRegisterInfo& MRI, Assembly& assembly, VMInstanceRef vminstance = nullptr);
+    ExecBlockManager(llvm::MCInstrInfo& MCII, llvm::MCRegisterInfo& MRI, Assembly& assembly, VMInstanceRef vminstance = nullptr,
+                     Options options = NO_OPT);
 
     ~ExecBlockManager();
 
@@ -98,7 +179,7 @@ public:
 
     const InstAnalysis* analyzeInstMetadata(const InstMetadata* instMetadata, AnalysisType type);
 
-    bool isFlushPending() { return this->flushList.size() > 0; }
+    bool isFlushPending() { return this->flushList.size() > 0 || this->invalidList.getRanges().size() > 0; }
 
     void flushCommit();
 
@@ -107,6 +188,46 @@ public:
     void clearCache(Range<rword> range);
 
     void clearCache(RangeSet<rword> rangeSet);
+
+    void setOptions(Options options) { this->options = options; }
+
+    size_t getCacheSize() const { return cacheSize; }
+
+    size_t getCacheBudget() const { return cacheBudget; }
+
+    void setCacheBudget(size_t budget);
+
+    bool isChaining() const { return chaining; }
+
+    void setChaining(bool enable);
+
+    rword getChainingStop() const { return chainingStop; }
+
+    void setChainingStop(rword stop);
+
+    Context* getSharedContext() const { return (Context*) contextBlock.base(); }
+
+    bool isTracing() const { return tracing; }
+
+    void setTracing(bool enable);
+
+    bool profileSequence(rword address);
+
+    void profileEdge(rword from, rword to);
+
+    rword getHotSuccessor(const std::vector<Patch>& basicBlock) const;
+
+    bool writeTrace(const std::vector<std::vector<Patch>>& basicBlocks);
+
+    bool isCoverageEnabled() const { return coverageMap != nullptr; }
+
+    bool setCoverageMap(uint8_t* map, size_t size);
+
+    void resetCoverageLocation();
+
+    void setBlockTrace(const BlockTrace* trace);
+
+    void setBlockCounters(std::map<rword, uint64_t>* counters);
 };
 
 }
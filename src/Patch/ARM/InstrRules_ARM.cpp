@@ -40,4 +40,11 @@ RelocatableInst::SharedPtrVec getBreakToHost(Reg temp) {
     return breakToHost;
 }
 
+/* Memory range filtering is not implemented on ARM, the break to host is always taken and the
+ * memory gates do the filtering.
+*/
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(Reg temp, const MemRangeFilter* filter) {
+    return getBreakToHost(temp);
+}
+
 }
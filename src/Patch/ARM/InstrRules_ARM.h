@@ -32,6 +32,8 @@ namespace QBDI {
 
 RelocatableInst::SharedPtrVec getBreakToHost(Reg temp);
 
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(Reg temp, const MemRangeFilter* filter);
+
 }
 
 #endif
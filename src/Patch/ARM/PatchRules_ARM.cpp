@@ -253,6 +253,9 @@ PatchRule::SharedPtrVec getDefaultPatchRules() {
     return rules;
 }
 
+void completeFPRState(FPRState* fprState) {
+}
+
 // Patch allowing to terminate a basic block early by writing address into DataBlock[Offset(PC)]
 RelocatableInst::SharedPtrVec getTerminator(rword address) {
     RelocatableInst::SharedPtrVec terminator;
@@ -265,4 +268,57 @@ RelocatableInst::SharedPtrVec getTerminator(rword address) {
     return terminator;
 }
 
+// Direct chaining is not supported on ARM yet: no exit is ever reported as static.
+std::vector<rword> getStaticTargets(const InstMetadata& metadata) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getChainedExit(const std::vector<std::pair<Offset, Offset>>& slots) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getIndirectCache(const std::vector<std::pair<Offset, Offset>>& slots, Offset missRecord) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getIndirectCacheJump(rword cache) {
+    return {};
+}
+
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    return true;
+}
+
+rword getReturnAddress(const InstMetadata& metadata) {
+    return 0;
+}
+
+bool isReturn(const InstMetadata& metadata) {
+    return false;
+}
+
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset stack, Offset entry) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getReturnStackPredict(Offset top, Offset stack, Offset scratch) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getTraceGuard(rword expected) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getCoverageHit(rword slot, Offset prev, rword next) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getBlockTraceHit(rword address, const BlockTrace* trace) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getCounterHit(rword counter) {
+    return {};
+}
+
 }
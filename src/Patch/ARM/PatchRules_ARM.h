@@ -19,6 +19,7 @@
 #define PATCHRULES_ARM_H
 
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "Patch/ARM/PatchGenerator_ARM.h"
@@ -29,12 +30,42 @@ class PatchRule;
 
 static const uint32_t MINIMAL_BLOCK_SIZE = 32;
 
+static const uint32_t RETURN_STACK_SIZE = 0;
+
 RelocatableInst::SharedPtrVec getExecBlockPrologue();
 
 RelocatableInst::SharedPtrVec getExecBlockEpilogue();
 
+void completeFPRState(FPRState* fprState);
+
 RelocatableInst::SharedPtrVec getTerminator(rword address);
 
+std::vector<rword> getStaticTargets(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getChainedExit(const std::vector<std::pair<Offset, Offset>>& slots);
+
+RelocatableInst::SharedPtrVec getIndirectCache(const std::vector<std::pair<Offset, Offset>>& slots, Offset missRecord);
+
+RelocatableInst::SharedPtrVec getIndirectCacheJump(rword cache);
+
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI);
+
+rword getReturnAddress(const InstMetadata& metadata);
+
+bool isReturn(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset stack, Offset entry);
+
+RelocatableInst::SharedPtrVec getReturnStackPredict(Offset top, Offset stack, Offset scratch);
+
+RelocatableInst::SharedPtrVec getTraceGuard(rword expected);
+
+RelocatableInst::SharedPtrVec getCoverageHit(rword slot, Offset prev, rword next);
+
+RelocatableInst::SharedPtrVec getBlockTraceHit(rword address, const BlockTrace* trace);
+
+RelocatableInst::SharedPtrVec getCounterHit(rword counter);
+
 std::vector<std::shared_ptr<PatchRule>> getDefaultPatchRules();
 
 
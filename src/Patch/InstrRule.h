@@ -46,6 +46,7 @@ class InstrRule : public AutoAlloc<InstrRule, InstrRule> {
     PatchGenerator::SharedPtrVec  patchGen;
     InstPosition                  position;
     bool                          breakToHost;
+    const MemRangeFilter*         filter;
 
 public:
 
@@ -63,10 +64,14 @@ public:
      *                         before the instruction or after it.
      * @param[in] breakToHost  A boolean determining whether this instrumentation should end with
      *                         a break to host (in the case of a callback for example).
+     * @param[in] filter       An optional memory range filter: the break to host is only taken
+     *                         when the address written by the generators in hostState.scratch
+     *                         hits the filter bounding box.
     */
     InstrRule(PatchCondition::SharedPtr condition, PatchGenerator::SharedPtrVec patchGen,
-              InstPosition position, bool breakToHost) : condition(condition),
-              patchGen(patchGen), position(position), breakToHost(breakToHost) {}
+              InstPosition position, bool breakToHost, const MemRangeFilter* filter = nullptr) :
+              condition(condition), patchGen(patchGen), position(position), breakToHost(breakToHost),
+              filter(filter) {}
 
     InstPosition getPosition() { return position; }
 
@@ -168,7 +173,12 @@ public:
             for(uint32_t i = 1; i < usedRegisters.size(); i++) {
                 append(instru, LoadReg(usedRegisters[i], Offset(usedRegisters[i])));
             }
-            append(instru, getBreakToHost(usedRegisters[0]));
+            if(filter != nullptr) {
+                append(instru, getFilteredBreakToHost(usedRegisters[0], filter));
+            }
+            else {
+                append(instru, getBreakToHost(usedRegisters[0]));
+            }
         }
         // Normal case where we append the temporary register restoration code to the instrumentation
         else {
@@ -35,10 +35,14 @@ public:
     
     Patch() {
         metadata.patchSize = 0;
+        metadata.useFPR = false;
+        metadata.tempRegs = 0;
     }
 
     Patch(llvm::MCInst inst, rword address, rword instSize) {
         metadata.patchSize = 0;
+        metadata.useFPR = false;
+        metadata.tempRegs = 0;
         setInst(inst, address, instSize);
     }
 
@@ -50,6 +54,10 @@ public:
         metadata.modifyPC = modifyPC;
     }
 
+    void setUseFPR(bool useFPR) {
+        metadata.useFPR = useFPR;
+    }
+
     void setInst(llvm::MCInst inst, rword address, rword instSize) {
         metadata.inst = inst;
         metadata.address = address;
@@ -102,11 +102,13 @@ public:
         }
         patch.setMerge(merge);
         patch.setModifyPC(modifyPC);
+        patch.setUseFPR(useFPR(inst, MCII, MRI) || (toMerge != nullptr && toMerge->metadata.useFPR));
 
         Reg::Vec used_registers = temp_manager.getUsedRegisters();
 
         for(unsigned int i = 0; i < used_registers.size(); i++) {
             patch.prepend(SaveReg(used_registers[i], Offset(used_registers[i])));
+            patch.metadata.tempRegs |= 1u << used_registers[i].id;
         }
 
         for(unsigned int i = 0; i < used_registers.size(); i++) {
@@ -20,6 +20,7 @@
 
 #include "llvm/MC/MCInst.h"
 
+#include "Callback.h"
 #include "ExecBlock/Context.h"
 
 namespace QBDI {
@@ -181,6 +182,27 @@ public:
     }
 };
 
+/*! Bounding box of the memory ranges watched by a memory gate, read by the instrumentation to
+ *  only break to the host when an access may hit one of the ranges. The box is stored in a
+ *  flag free form: an address hits when (address - start) < size with size lower than 2^56.
+*/
+struct MemRangeFilter {
+    rword negStart; /*!< Two's complement negation of the box start */
+    rword negSize;  /*!< Two's complement negation of the box size */
+    rword writeFallback; /*!< Address tested when the write address can not be computed */
+};
+
+/*! Buffer of the basic block trace, appended by the instrumentation at the entry of every basic
+ *  block. The instrumentation breaks to the host with the flush callback when the cursor reaches
+ *  the end of the buffer.
+*/
+struct BlockTrace {
+    rword        cursor; /*!< Address of the next entry of the buffer */
+    rword        negEnd; /*!< Two's complement negation of the end of the buffer */
+    InstCallback flush;  /*!< Callback emptying the buffer */
+    void*        data;   /*!< Data of the flush callback */
+};
+
 class InstMetadata {
 public:
     llvm::MCInst inst;
@@ -189,6 +211,8 @@ public:
     uint32_t patchSize;
     bool modifyPC;
     bool merge;
+    bool useFPR;
+    uint32_t tempRegs; // Bitmask of the registers used as temporaries around the instruction
 
     inline rword endAddress() const {
         return address + instSize;
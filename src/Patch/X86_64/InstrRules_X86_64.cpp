@@ -40,6 +40,71 @@ RelocatableInst::SharedPtrVec getBreakToHost(Reg temp) {
     return breakToHost;
 }
 
+/* Generate a break to host which is only taken if the address stored in hostState.scratch hits
+ * the bounding box of a memory range filter. The test only uses LEA, MOV and JRCXZ such that the
+ * flags of the guest are preserved: with d = address - start and e = d - size, the sum of the top
+ * bytes of d and e is 0xFF if and only if d < size (or in the harmless 2^63 <= d < 2^63 + size case
+ * which is a false positive filtered by the gate).
+*/
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(Reg temp, const MemRangeFilter* filter) {
+    RelocatableInst::SharedPtrVec filteredBreak;
+    RelocatableInst::SharedPtrVec hit;
+    RelocatableInst::SharedPtrVec miss;
+    Reg rcx = Reg(2);
+    Reg rdx = Reg(3);
+    Reg::Vec scratchRegs;
+    rword scratch = offsetof(Context, hostState.scratch);
+
+    // RCX is needed by JRCXZ and RDX is a second scratch. The temporary register guest value has
+    // already been saved in the context.
+    for(Reg reg : {rcx, rdx}) {
+        if(reg.id != temp.id) {
+            append(filteredBreak, SaveReg(reg, Offset(reg)));
+            scratchRegs.push_back(reg);
+        }
+    }
+    // RCX = d = address - start
+    append(filteredBreak, LoadReg(rcx, Offset(scratch)));
+    filteredBreak.push_back(Mov(rdx, Constant((rword) &filter->negStart)));
+    filteredBreak.push_back(NoReloc(mov64rm(rdx, rdx, 1, 0, 0, 0)));
+    filteredBreak.push_back(NoReloc(lea(rcx, rcx, 1, rdx, 0, 0)));
+    // RDX = e = d - size
+    filteredBreak.push_back(Mov(rdx, Constant((rword) &filter->negSize)));
+    filteredBreak.push_back(NoReloc(mov64rm(rdx, rdx, 1, 0, 0, 0)));
+    filteredBreak.push_back(NoReloc(lea(rdx, rcx, 1, rdx, 0, 0)));
+    // RCX = top byte of d + top byte of e - 0xFF, which is zero on a hit
+    append(filteredBreak, SaveReg(rcx, Offset(scratch)));
+    filteredBreak.push_back(Movzx8(llvm::X86::ECX, Offset(scratch + 7)));
+    append(filteredBreak, SaveReg(rdx, Offset(scratch)));
+    filteredBreak.push_back(Movzx8(llvm::X86::EDX, Offset(scratch + 7)));
+    filteredBreak.push_back(NoReloc(lea(rcx, rcx, 1, rdx, (rword) -0xFF, 0)));
+
+    // On a hit restore the scratch registers and break to the host, the execution is resumed at
+    // the miss code which restores the guest state again.
+    for(Reg reg : scratchRegs) {
+        append(hit, LoadReg(reg, Offset(reg)));
+    }
+    append(hit, getBreakToHost(temp));
+
+    // On a miss the callback set up by the instrumentation must be cancelled, else it would be
+    // called at the next exit of the ExecBlock.
+    miss.push_back(Mov(rcx, Constant(0)));
+    append(miss, SaveReg(rcx, Offset(offsetof(Context, hostState.callback))));
+    for(Reg reg : scratchRegs) {
+        append(miss, LoadReg(reg, Offset(reg)));
+    }
+    append(miss, LoadReg(temp, Offset(temp)));
+
+    // JRCXZ over the JMP to the hit code, else JMP over the hit code
+    RelocatableInst::SharedPtr jmpMiss = JmpOver(hit);
+    filteredBreak.push_back(JrcxzOver({jmpMiss}));
+    filteredBreak.push_back(jmpMiss);
+    append(filteredBreak, hit);
+    append(filteredBreak, miss);
+
+    return filteredBreak;
+}
+
 std::vector<std::shared_ptr<InstrRule>> getMemAccessInstrRules() {
     // TODO: Insert here memory access rules
     return {};
@@ -33,6 +33,8 @@ class InstrRule;
 
 RelocatableInst::SharedPtrVec getBreakToHost(Reg temp);
 
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(Reg temp, const MemRangeFilter* filter);
+
 std::vector<std::shared_ptr<InstrRule>> getMemAccessInstrRules();
 
 }
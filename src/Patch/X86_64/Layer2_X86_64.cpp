@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 #include "Patch/X86_64/Layer2_X86_64.h"
+#include "Patch/X86_64/RelocatableInst_X86_64.h"
 
 namespace QBDI {
 
@@ -54,6 +55,20 @@ llvm::MCInst mov64mr(unsigned int base, rword scale, unsigned int offset, rword
     return inst;
 }
 
+llvm::MCInst mov8mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOV8mr);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createReg(src));
+
+    return inst;
+}
+
 llvm::MCInst mov32rm8(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg) {
     llvm::MCInst inst;
 
@@ -133,6 +148,15 @@ llvm::MCInst jmp(rword offset) {
     return inst;
 }
 
+llvm::MCInst jrcxz(rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::JRCXZ);
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+
+    return inst;
+}
+
 llvm::MCInst fxsave(unsigned int base, rword offset) {
     llvm::MCInst inst;
 
@@ -159,6 +183,45 @@ llvm::MCInst fxrstor(unsigned int base, rword offset) {
     return inst;
 }
 
+llvm::MCInst xsave(unsigned int base, rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::XSAVE);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(1));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+
+    return inst;
+}
+
+llvm::MCInst xsaveopt(unsigned int base, rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::XSAVEOPT);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(1));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+
+    return inst;
+}
+
+llvm::MCInst xrstor(unsigned int base, rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::XRSTOR);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(1));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+
+    return inst;
+}
+
 llvm::MCInst vextractf128(unsigned int base, rword offset, unsigned int src, uint8_t regoffset) {
     llvm::MCInst inst;
 
@@ -277,10 +340,37 @@ RelocatableInst::SharedPtr Mov(Reg reg, Offset offset) {
     return DataBlockRel(mov64rm(reg, Reg(REG_PC), 0, 0, 0, 0), 4, offset - 7);
 }
 
+// src needs to be a legacy 8 bits register (AL, CL, DL or BL) for the 6 bytes encoding
+RelocatableInst::SharedPtr Mov8(Offset offset, unsigned int src) {
+    return DataBlockRel(mov8mr(Reg(REG_PC), 0, 0, 0, 0, src), 3, offset - 6);
+}
+
+// dst needs to be a legacy 32 bits register (EAX, ECX, EDX or EBX) for the 7 bytes encoding
+RelocatableInst::SharedPtr Movzx8(unsigned int dst, Offset offset) {
+    return DataBlockRel(mov32rm8(dst, Reg(REG_PC), 0, 0, 0, 0), 4, offset - 7);
+}
+
+RelocatableInst::SharedPtr Lea(Reg reg, Offset offset) {
+    return DataBlockRel(lea(reg, Reg(REG_PC), 0, 0, 0, 0), 4, offset - 7);
+}
+
 RelocatableInst::SharedPtr Jmp64m(Offset offset) {
     return DataBlockRel(jmp64m(Reg(REG_PC), 0), 3, offset - 6);
 }
 
+// The encoder removes the size of the immediate from the branch offset
+RelocatableInst::SharedPtr JmpOver(RelocatableInst::SharedPtrVec skipped) {
+    return SkipRel(jmp(0), 0, 4, skipped);
+}
+
+RelocatableInst::SharedPtr JmpTo(rword target) {
+    return TargetRel(jmp(0), 0, 4, target);
+}
+
+RelocatableInst::SharedPtr JrcxzOver(RelocatableInst::SharedPtrVec skipped) {
+    return SkipRel(jrcxz(0), 0, 1, skipped);
+}
+
 RelocatableInst::SharedPtr Fxsave(Offset offset) {
     return DataBlockRel(fxsave(Reg(REG_PC), 0), 3, offset-7);
 }
@@ -289,6 +379,18 @@ RelocatableInst::SharedPtr Fxrstor(Offset offset) {
     return DataBlockRel(fxrstor(Reg(REG_PC), 0), 3, offset-7);
 }
 
+RelocatableInst::SharedPtr Xsave(Offset offset) {
+    return DataBlockRel(xsave(Reg(REG_PC), 0), 3, offset-7);
+}
+
+RelocatableInst::SharedPtr Xsaveopt(Offset offset) {
+    return DataBlockRel(xsaveopt(Reg(REG_PC), 0), 3, offset-7);
+}
+
+RelocatableInst::SharedPtr Xrstor(Offset offset) {
+    return DataBlockRel(xrstor(Reg(REG_PC), 0), 3, offset-7);
+}
+
 RelocatableInst::SharedPtr Vextractf128(Offset offset, unsigned int src, Constant regoffset) {
     return DataBlockRel(vextractf128(Reg(REG_PC), 0, src, regoffset), 3, offset-10);
 }
@@ -31,6 +31,8 @@ llvm::MCInst mov64ri(unsigned int reg, rword imm);
 
 llvm::MCInst mov64mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src);
 
+llvm::MCInst mov8mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src);
+
 llvm::MCInst mov32rm8(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
 
 llvm::MCInst mov32rm16(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
@@ -45,6 +47,12 @@ llvm::MCInst fxsave(unsigned int base, rword offset);
 
 llvm::MCInst fxrstor(unsigned int base, rword offset);
 
+llvm::MCInst xsave(unsigned int base, rword offset);
+
+llvm::MCInst xsaveopt(unsigned int base, rword offset);
+
+llvm::MCInst xrstor(unsigned int base, rword offset);
+
 llvm::MCInst vextractf128(unsigned int base, rword offset, unsigned int src, uint8_t regoffset);
 
 llvm::MCInst vinsertf128(unsigned int dst, unsigned int base, rword offset, uint8_t regoffset);
@@ -63,6 +71,8 @@ llvm::MCInst popf();
 
 llvm::MCInst jmp(rword offset);
 
+llvm::MCInst jrcxz(rword offset);
+
 llvm::MCInst ret();
 
 // high level layer 2
@@ -75,12 +85,30 @@ RelocatableInst::SharedPtr Mov(Offset offset, Reg reg);
 
 RelocatableInst::SharedPtr Mov(Reg reg, Offset offset);
 
+RelocatableInst::SharedPtr Mov8(Offset offset, unsigned int src);
+
+RelocatableInst::SharedPtr Movzx8(unsigned int dst, Offset offset);
+
+RelocatableInst::SharedPtr Lea(Reg reg, Offset offset);
+
 RelocatableInst::SharedPtr Jmp64m(Offset offset);
 
+RelocatableInst::SharedPtr JmpOver(RelocatableInst::SharedPtrVec skipped);
+
+RelocatableInst::SharedPtr JmpTo(rword target);
+
+RelocatableInst::SharedPtr JrcxzOver(RelocatableInst::SharedPtrVec skipped);
+
 RelocatableInst::SharedPtr Fxsave(Offset offset);
 
 RelocatableInst::SharedPtr Fxrstor(Offset offset);
 
+RelocatableInst::SharedPtr Xsave(Offset offset);
+
+RelocatableInst::SharedPtr Xsaveopt(Offset offset);
+
+RelocatableInst::SharedPtr Xrstor(Offset offset);
+
 RelocatableInst::SharedPtr Vextractf128(Offset offset, unsigned int src, Constant regoffset);
 
 RelocatableInst::SharedPtr Vinsertf128(unsigned int dst, Offset offset, Constant regoffset);
@@ -18,6 +18,9 @@
 #ifndef PATCHGENERATOR_X86_64_H
 #define PATCHGENERATOR_X86_64_H
 
+#include <stddef.h>
+#include <string.h>
+
 #include "Patch/X86_64/Layer2_X86_64.h"
 #include "Patch/PatchUtils.h"
 #include "Patch/X86_64/RelocatableInst_X86_64.h"
@@ -289,6 +292,159 @@ public:
     }
 };
 
+class GetMemFilterAddress : public PatchGenerator, public AutoAlloc<PatchGenerator, GetMemFilterAddress> {
+
+    Temp                  temp;
+    bool                  writeGate;
+    const MemRangeFilter* filter;
+
+public:
+
+    /*! Resolve the memory address tested by a memory range filter and copy it in a temporary. The
+     * read gate tests the read address before the instruction. The write gate tests the write
+     * address after the instruction, like the memory access recording does. When the write
+     * address can not be computed after the instruction, the write gate tests the write fallback
+     * address of the filter. The read only instructions are not handled by the write gate, see
+     * ReadShadow.
+     *
+     * @param[in] temp       A temporary where the address will be copied.
+     * @param[in] writeGate  True for the write gate, false for the read gate.
+     * @param[in] filter     The memory range filter of the gate.
+    */
+    GetMemFilterAddress(Temp temp, bool writeGate, const MemRangeFilter* filter) :
+        temp(temp), writeGate(writeGate), filter(filter) {}
+
+    /*! Output:
+     *
+     * if read gate:
+     * GetReadAddress temp
+     *
+     * else if single write address:
+     * GetWriteAddress temp
+     *
+     * else:
+     * MOV REG64 temp, IMM64 &filter->writeFallback
+     * MOV REG64 temp, MEM64 [temp]
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+        if(writeGate == false) {
+            return GetReadAddress(temp).generate(inst, address, instSize, temp_manager, toMerge);
+        }
+        if(getWriteSize(inst) > 0 && (getReadSize(inst) == 0 || (isStackRead(inst) == false && isStackWrite(inst) == false))) {
+            return GetWriteAddress(temp).generate(inst, address, instSize, temp_manager, toMerge);
+        }
+        // The write of a stack mixing instruction like push [mem] or pop [mem] may hit any write range
+        Reg reg = temp_manager->getRegForTemp(temp);
+        return {
+            Mov(reg, Constant((rword) &filter->writeFallback)),
+            NoReloc(mov64rm(reg, reg, 1, 0, 0, 0))
+        };
+    }
+};
+
+class IncrementCounter : public PatchGenerator, public AutoAlloc<PatchGenerator, IncrementCounter> {
+
+    Temp     temp;
+    Temp     value;
+    Constant counter;
+
+public:
+
+    /*! Increment a 64 bits counter in memory. The flags are not modified such that the
+     * increment does not need to save them.
+     *
+     * @param[in] temp     A temporary used for the counter address.
+     * @param[in] value    A temporary used for the counter value.
+     * @param[in] counter  The address of the counter.
+    */
+    IncrementCounter(Temp temp, Temp value, Constant counter) : temp(temp), value(value), counter(counter) {}
+
+    /*! Output:
+     *
+     * MOV REG64 temp, IMM64 counter
+     * MOV REG64 value, MEM64 [temp]
+     * LEA REG64 value, MEM64 [value + 1]
+     * MOV MEM64 [temp], REG64 value
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+        Reg addressReg = temp_manager->getRegForTemp(temp);
+        Reg valueReg = temp_manager->getRegForTemp(value);
+        return {
+            Mov(addressReg, counter),
+            NoReloc(mov64rm(valueReg, addressReg, 1, 0, 0, 0)),
+            NoReloc(lea(valueReg, valueReg, 1, 0, 1, 0)),
+            NoReloc(mov64mr(addressReg, 1, 0, 0, 0, valueReg))
+        };
+    }
+};
+
+class WriteMemTraceRecord : public PatchGenerator, public AutoAlloc<PatchGenerator, WriteMemTraceRecord> {
+
+    Temp             address;
+    Temp             value;
+    Temp             cursor;
+    MemoryAccessType type;
+    Constant         cursorAddress;
+
+public:
+
+    /*! Append a MemoryAccess record to a memory trace buffer and advance the cursor of the buffer.
+     * The flags are not modified.
+     *
+     * @param[in] address        A temporary holding the accessed address, overwritten.
+     * @param[in] value          A temporary holding the accessed value.
+     * @param[in] cursor         A temporary where the new cursor will be copied.
+     * @param[in] type           The type of the recorded access, MEMORY_READ or MEMORY_WRITE.
+     * @param[in] cursorAddress  The address of the cursor, a pointer to the next record.
+    */
+    WriteMemTraceRecord(Temp address, Temp value, Temp cursor, MemoryAccessType type, Constant cursorAddress) :
+        address(address), value(value), cursor(cursor), type(type), cursorAddress(cursorAddress) {}
+
+    /*! Output:
+     *
+     * MOV REG64 cursor, IMM64 cursorAddress
+     * MOV REG64 cursor, MEM64 [cursor]
+     * MOV MEM64 [cursor + accessAddress], REG64 address
+     * MOV MEM64 [cursor + value], REG64 value
+     * MOV REG64 address, IMM64 instAddress
+     * MOV MEM64 [cursor + instAddress], REG64 address
+     * MOV REG64 address, IMM64 (size, type)
+     * MOV MEM64 [cursor + size], REG64 address
+     * LEA REG64 cursor, MEM64 [cursor + sizeof(MemoryAccess)]
+     * MOV REG64 address, IMM64 cursorAddress
+     * MOV MEM64 [address], REG64 cursor
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+        static_assert(sizeof(MemoryAccess) == offsetof(MemoryAccess, size) + sizeof(rword),
+                      "The size and type of a record are written as a single word");
+        Reg addressReg = temp_manager->getRegForTemp(this->address);
+        Reg valueReg = temp_manager->getRegForTemp(value);
+        Reg cursorReg = temp_manager->getRegForTemp(cursor);
+        // The last word of the record holds the size, the type and the padding
+        MemoryAccess record = MemoryAccess();
+        record.size = (uint8_t) (type == MEMORY_READ ? getReadSize(inst) : getWriteSize(inst));
+        record.type = type;
+        rword tail;
+        memcpy(&tail, &record.size, sizeof(rword));
+        return {
+            Mov(cursorReg, cursorAddress),
+            NoReloc(mov64rm(cursorReg, cursorReg, 1, 0, 0, 0)),
+            NoReloc(mov64mr(cursorReg, 1, 0, offsetof(MemoryAccess, accessAddress), 0, addressReg)),
+            NoReloc(mov64mr(cursorReg, 1, 0, offsetof(MemoryAccess, value), 0, valueReg)),
+            NoReloc(mov64ri(addressReg, address)),
+            NoReloc(mov64mr(cursorReg, 1, 0, offsetof(MemoryAccess, instAddress), 0, addressReg)),
+            NoReloc(mov64ri(addressReg, tail)),
+            NoReloc(mov64mr(cursorReg, 1, 0, offsetof(MemoryAccess, size), 0, addressReg)),
+            NoReloc(lea(cursorReg, cursorReg, 1, 0, sizeof(MemoryAccess), 0)),
+            Mov(addressReg, cursorAddress),
+            NoReloc(mov64mr(addressReg, 1, 0, 0, 0, cursorReg))
+        };
+    }
+};
+
 class GetReadValue : public PatchGenerator, public AutoAlloc<PatchGenerator, GetReadValue> {
  
     Temp temp;
@@ -583,6 +739,35 @@ public:
     }
 };
 
+class ReadShadow : public PatchGenerator, public AutoAlloc<PatchGenerator, ReadShadow> {
+
+    Temp   temp;
+    Shadow shadow;
+
+public:
+
+    /*! Read in a temporary the shadow written earlier with the same tag by the patch of the
+     * instruction, like the addresses recorded before the instruction.
+     *
+     * @param[in] temp      A temporary where the shadow value will be copied.
+     * @param[in] shadow    The shadow to read.
+    */
+    ReadShadow(Temp temp, Shadow shadow): temp(temp), shadow(shadow) {}
+
+    /*! Output:
+     *
+     * MOV REG64 temp, MEM64 Shadow(tag)
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+        return {TaggedShadowRef(
+            mov64rm(temp_manager->getRegForTemp(temp), Reg(REG_PC), 0, 0, 0, 0),
+            4,
+            shadow.getTag()
+        )};
+    }
+};
+
 class SaveReg : public PatchGenerator, public AutoAlloc<PatchGenerator, SaveReg>,
     public PureEval<SaveReg> {
 
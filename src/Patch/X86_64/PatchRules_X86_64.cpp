@@ -15,14 +15,117 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#include "MCTargetDesc/X86BaseInfo.h"
+
 #include "Patch/PatchRule.h"
 #include "Patch/X86_64/PatchRules_X86_64.h"
+#include "Patch/X86_64/InstrRules_X86_64.h"
 #include "Patch/X86_64/Layer2_X86_64.h"
 #include "Utility/LogSys.h"
 #include "Utility/System.h"
 
 namespace QBDI {
 
+// Check that the offset of an XSAVE state component in the standard format, given by the EBX
+// register of the CPUID leaf 0xD sub-leaf of the component, matches its offset in the FPRState.
+static bool checkXSaveOffset(unsigned int component, size_t offset) {
+    unsigned int ebx;
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuidex(regs, 0xD, component);
+    ebx = (unsigned int) regs[1];
+#else
+    unsigned int eax, ecx, edx;
+    __cpuid_count(0xD, component, eax, ebx, ecx, edx);
+#endif
+    if(ebx != offset) {
+        LogWarning("computeXSaveMask", "XSAVE state component %u is at offset %u instead of %zu, it will not be switched",
+                   component, ebx, offset);
+        return false;
+    }
+    return true;
+}
+
+/* Mask of the XSAVE state components switched between the host and the guest: x87 and SSE, plus AVX
+ * and the three AVX-512 components (opmask, ZMM_Hi256 and Hi16_ZMM) if the host supports them. The
+ * FPRState structure follows the standard (non compacted) XSAVE layout, the components which the
+ * host places at another offset are left out. 0 if XSAVE is not supported, the FXSAVE area is then
+ * switched instead.
+*/
+static rword computeXSaveMask() {
+    rword mask = 0;
+
+    if(isHostCPUFeaturePresent("xsave")) {
+        mask = 0x3;
+        if(isHostCPUFeaturePresent("avx") && checkXSaveOffset(2, offsetof(FPRState, ymm0))) {
+            mask |= 0x4;
+            // The AVX-512 components are enabled together
+            if(isHostCPUFeaturePresent("avx512f") &&
+               checkXSaveOffset(5, offsetof(FPRState, k0)) &&
+               checkXSaveOffset(6, offsetof(FPRState, zmm0)) &&
+               checkXSaveOffset(7, offsetof(FPRState, zmm16))) {
+                mask |= 0xE0;
+            }
+        }
+    }
+    LogDebug("computeXSaveMask", "XSAVE state components mask 0x%" PRIRWORD, mask);
+    return mask;
+}
+
+rword getXSaveMask() {
+    static const rword mask = computeXSaveMask();
+    return mask;
+}
+
+/* FPR state switch written in the prologue and the epilogue. It is only executed if the fprSwitch
+ * flag of the host state is set, which allows ExecBlocks whose guest code never uses the FPU or the
+ * vector registers to skip it (see OPT_LAZY_FPR):
+ *
+ *     MOVZX ECX, BYTE DataBlock[Offset(fprSwitch)]
+ *     JRCXZ SKIP
+ *     JMP SWITCH
+ * SKIP:
+ *     JMP END
+ * SWITCH:
+ *     fpr
+ * END:
+ *
+ * RCX is free in both cases as the guest GPR are restored after the switch in the prologue and
+ * saved before it in the epilogue.
+*/
+static RelocatableInst::SharedPtrVec switchFPR(const RelocatableInst::SharedPtrVec& fpr) {
+    RelocatableInst::SharedPtrVec sw;
+    RelocatableInst::SharedPtr jmpEnd = JmpOver(fpr);
+    RelocatableInst::SharedPtr jmpSwitch = JmpOver({jmpEnd});
+
+    sw.push_back(Movzx8(llvm::X86::ECX, Offset(offsetof(Context, hostState.fprSwitch))));
+    sw.push_back(JrcxzOver({jmpSwitch}));
+    sw.push_back(jmpSwitch);
+    sw.push_back(jmpEnd);
+    sw.insert(sw.end(), fpr.begin(), fpr.end());
+
+    return sw;
+}
+
+/* XRSTOR only loads the components flagged in the XSTATE_BV field of the XSAVE header, the others
+ * being reset to their initial configuration. The header is thus rewritten before loading such
+ * that the FPRState, which may have been modified by the VM API or by callbacks, is always used
+ * as is. The reserved bytes checked by XRSTOR are also cleared:
+ *
+ *     MOV RAX, IMM64 mask
+ *     DataBlock[Offset(xstatebv)] := RAX
+ *     MOV RDX, IMM64 0
+ *     DataBlock[Offset(xcompbv)] := RDX
+ *     DataBlock[Offset(rsrv4)] := RDX
+ *     XRSTOR DataBlock[Offset(fprState)]
+*/
 RelocatableInst::SharedPtrVec getExecBlockPrologue() {
     RelocatableInst::SharedPtrVec prologue;
     
@@ -32,25 +135,21 @@ RelocatableInst::SharedPtrVec getExecBlockPrologue() {
     append(prologue, SaveReg(Reg(REG_SP), Offset(offsetof(Context, hostState.rsp))));
     // Restore FPR
 #ifndef _QBDI_ASAN_ENABLED_ // Disabled if ASAN is enabled as it breaks context alignment
-    prologue.push_back(Fxrstor(Offset(offsetof(Context, fprState))));
-    if(isHostCPUFeaturePresent("avx")) {
-        LogDebug("getExecBlockPrologue", "AVX support enabled in guest context switches");
-        prologue.push_back(Vinsertf128(llvm::X86::YMM0, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM1, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM2, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM3, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM4, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM5, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM6, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM7, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM8, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM9, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM10, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM11, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM12, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM13, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM14, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM15, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), 1));
+    RelocatableInst::SharedPtrVec fpr;
+    rword mask = getXSaveMask();
+    if(mask != 0) {
+        LogDebug("getExecBlockPrologue", "XSAVE support enabled in guest context switches");
+        fpr.push_back(NoReloc(mov64ri(Reg(0), mask)));
+        append(fpr, SaveReg(Reg(0), Offset(offsetof(Context, fprState) + offsetof(FPRState, xstatebv))));
+        fpr.push_back(NoReloc(mov64ri(Reg(3), 0)));
+        append(fpr, SaveReg(Reg(3), Offset(offsetof(Context, fprState) + offsetof(FPRState, xcompbv))));
+        append(fpr, SaveReg(Reg(3), Offset(offsetof(Context, fprState) + offsetof(FPRState, rsrv4))));
+        fpr.push_back(Xrstor(Offset(offsetof(Context, fprState))));
+        append(prologue, switchFPR(fpr));
+    }
+    else {
+        fpr.push_back(Fxrstor(Offset(offsetof(Context, fprState))));
+        append(prologue, switchFPR(fpr));
     }
 #endif
     // Restore EFLAGS
@@ -66,6 +165,16 @@ RelocatableInst::SharedPtrVec getExecBlockPrologue() {
     return prologue;
 }
 
+/* The FPR are saved using XSAVEOPT when available, which skips the components that were not
+ * modified since the XRSTOR of the prologue:
+ *
+ *     MOV RAX, IMM64 mask
+ *     MOV RDX, IMM64 0
+ *     XSAVEOPT DataBlock[Offset(fprState)]
+ *
+ * XSAVEOPT does not write the components in their initial configuration either, see
+ * completeFPRState.
+*/
 RelocatableInst::SharedPtrVec getExecBlockEpilogue() {
     RelocatableInst::SharedPtrVec epilogue;
 
@@ -74,25 +183,23 @@ RelocatableInst::SharedPtrVec getExecBlockEpilogue() {
         append(epilogue, SaveReg(Reg(i), Offset(Reg(i))));
     // Save FPR
 #ifndef _QBDI_ASAN_ENABLED_ // Disabled if ASAN is enabled as it breaks context alignment
-    epilogue.push_back(Fxsave(Offset(offsetof(Context, fprState))));
-    if(isHostCPUFeaturePresent("avx")) {
-        LogDebug("getExecBlockEpilogue", "AVX support enabled in guest context switches");
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), llvm::X86::YMM0, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), llvm::X86::YMM1, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), llvm::X86::YMM2, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), llvm::X86::YMM3, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), llvm::X86::YMM4, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), llvm::X86::YMM5, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), llvm::X86::YMM6, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), llvm::X86::YMM7, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), llvm::X86::YMM8, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), llvm::X86::YMM9, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), llvm::X86::YMM10, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), llvm::X86::YMM11, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), llvm::X86::YMM12, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), llvm::X86::YMM13, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), llvm::X86::YMM14, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), llvm::X86::YMM15, 1));
+    RelocatableInst::SharedPtrVec fpr;
+    rword mask = getXSaveMask();
+    if(mask != 0) {
+        LogDebug("getExecBlockEpilogue", "XSAVE support enabled in guest context switches");
+        fpr.push_back(NoReloc(mov64ri(Reg(0), mask)));
+        fpr.push_back(NoReloc(mov64ri(Reg(3), 0)));
+        if(isHostCPUFeaturePresent("xsaveopt")) {
+            fpr.push_back(Xsaveopt(Offset(offsetof(Context, fprState))));
+        }
+        else {
+            fpr.push_back(Xsave(Offset(offsetof(Context, fprState))));
+        }
+        append(epilogue, switchFPR(fpr));
+    }
+    else {
+        fpr.push_back(Fxsave(Offset(offsetof(Context, fprState))));
+        append(epilogue, switchFPR(fpr));
     }
 #endif
     // Restore host RBP, RSP
@@ -108,6 +215,40 @@ RelocatableInst::SharedPtrVec getExecBlockEpilogue() {
     return epilogue;
 }
 
+// XSAVEOPT (and XSAVE on some processors) leave the memory of the components which are in their
+// initial configuration untouched and only clear their XSTATE_BV bit, write this configuration in
+// the FPRState.
+void completeFPRState(FPRState* fprState) {
+    rword mask = getXSaveMask() & ~fprState->xstatebv;
+
+    if(mask & 0x1) {
+        fprState->rfcw = 0x37F;
+        fprState->rfsw = 0;
+        fprState->ftw = 0;
+        fprState->fop = 0;
+        fprState->ip = 0;
+        fprState->cs = 0;
+        fprState->dp = 0;
+        fprState->ds = 0;
+        memset(&fprState->stmm0, 0, 8 * sizeof(MMSTReg));
+    }
+    if(mask & 0x2) {
+        memset(fprState->xmm0, 0, 16 * 16);
+    }
+    if(mask & 0x4) {
+        memset(fprState->ymm0, 0, 16 * 16);
+    }
+    if(mask & 0x20) {
+        memset(fprState->k0, 0, 8 * 8);
+    }
+    if(mask & 0x40) {
+        memset(fprState->zmm0, 0, 16 * 32);
+    }
+    if(mask & 0x80) {
+        memset(fprState->zmm16, 0, 16 * 64);
+    }
+}
+
 PatchRule::SharedPtrVec getDefaultPatchRules() {
     PatchRule::SharedPtrVec rules;
 
@@ -464,4 +605,503 @@ RelocatableInst::SharedPtrVec getTerminator(rword address) {
     return terminator;
 }
 
+// Return the possible targets of a sequence exit when they can be statically determined from the
+// instruction ending it: direct jumps, direct calls and conditional jumps (taken and fall through).
+std::vector<rword> getStaticTargets(const InstMetadata& metadata) {
+    const llvm::MCInst& inst = metadata.inst;
+
+    switch(inst.getOpcode()) {
+        case llvm::X86::JMP_1:
+        case llvm::X86::JMP_2:
+        case llvm::X86::JMP_4:
+        case llvm::X86::CALL64pcrel32:
+        case llvm::X86::CALLpcrel16:
+        case llvm::X86::CALLpcrel32:
+            return {metadata.endAddress() + inst.getOperand(0).getImm()};
+        case llvm::X86::JNE_1:
+        case llvm::X86::JE_1:
+        case llvm::X86::JG_1:
+        case llvm::X86::JGE_1:
+        case llvm::X86::JA_1:
+        case llvm::X86::JAE_1:
+        case llvm::X86::JL_1:
+        case llvm::X86::JLE_1:
+        case llvm::X86::JB_1:
+        case llvm::X86::JBE_1:
+        case llvm::X86::JP_1:
+        case llvm::X86::JNP_1:
+        case llvm::X86::JO_1:
+        case llvm::X86::JNO_1:
+        case llvm::X86::JS_1:
+        case llvm::X86::JNS_1:
+        case llvm::X86::JNE_2:
+        case llvm::X86::JE_2:
+        case llvm::X86::JG_2:
+        case llvm::X86::JGE_2:
+        case llvm::X86::JA_2:
+        case llvm::X86::JAE_2:
+        case llvm::X86::JL_2:
+        case llvm::X86::JLE_2:
+        case llvm::X86::JB_2:
+        case llvm::X86::JBE_2:
+        case llvm::X86::JP_2:
+        case llvm::X86::JNP_2:
+        case llvm::X86::JO_2:
+        case llvm::X86::JNO_2:
+        case llvm::X86::JS_2:
+        case llvm::X86::JNS_2:
+        case llvm::X86::JNE_4:
+        case llvm::X86::JE_4:
+        case llvm::X86::JG_4:
+        case llvm::X86::JGE_4:
+        case llvm::X86::JA_4:
+        case llvm::X86::JAE_4:
+        case llvm::X86::JL_4:
+        case llvm::X86::JLE_4:
+        case llvm::X86::JB_4:
+        case llvm::X86::JBE_4:
+        case llvm::X86::JP_4:
+        case llvm::X86::JNP_4:
+        case llvm::X86::JO_4:
+        case llvm::X86::JNO_4:
+        case llvm::X86::JS_4:
+        case llvm::X86::JNS_4:
+            return {metadata.endAddress() + inst.getOperand(0).getImm(), metadata.endAddress()};
+        default:
+            return {};
+    }
+}
+
+/* Lookup of the guest RIP in a list of slots. Each slot is a pair of data block offsets: the first
+ * one holds the negated guest address (0 if unused) and the second one the host address where the
+ * execution continues on a match. RCX := slot + RIP is computed using LEA and tested using JRCXZ
+ * such that the guest flags are preserved. On a miss, RIP can optionally be recorded in the data
+ * block before returning to the VM.
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     RDX := DataBlock[Offset(RIP)]
+ *     RCX := DataBlock[slot[i].first]         (for each slot)
+ *     LEA RCX, [RCX + RDX]
+ *     JRCXZ HIT_i
+ *     DataBlock[missRecord] := RDX            (optional)
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+ *     JMP Epilogue
+ * HIT_i:                                      (for each slot)
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+ *     JMP DataBlock[slot[i].second]
+*/
+static RelocatableInst::SharedPtrVec lookupSlots(const std::vector<std::pair<Offset, Offset>>& slots, const Offset* missRecord) {
+    RelocatableInst::SharedPtrVec lookup;
+    RelocatableInst::SharedPtrVec miss;
+    std::vector<RelocatableInst::SharedPtrVec> tests;
+    std::vector<RelocatableInst::SharedPtrVec> hits;
+    size_t n = slots.size();
+
+    if(n == 0) {
+        return lookup;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        RelocatableInst::SharedPtrVec test;
+        append(test, LoadReg(Reg(2), slots[i].first));
+        test.push_back(NoReloc(lea(Reg(2), Reg(2), 1, Reg(3), 0, 0)));
+        tests.push_back(test);
+        RelocatableInst::SharedPtrVec hit;
+        append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+        append(hit, LoadReg(Reg(3), Offset(Reg(3))));
+        hit.push_back(Jmp64m(slots[i].second));
+        hits.push_back(hit);
+    }
+    if(missRecord != nullptr) {
+        append(miss, SaveReg(Reg(3), *missRecord));
+    }
+    append(miss, LoadReg(Reg(2), Offset(Reg(2))));
+    append(miss, LoadReg(Reg(3), Offset(Reg(3))));
+    append(miss, JmpEpilogue());
+
+    append(lookup, SaveReg(Reg(2), Offset(Reg(2))));
+    append(lookup, SaveReg(Reg(3), Offset(Reg(3))));
+    append(lookup, LoadReg(Reg(3), Offset(Reg(REG_PC))));
+    for(size_t i = 0; i < n; i++) {
+        // JRCXZ over the following tests, the miss path and the previous hit paths. The JRCXZ of the
+        // following tests are measured using a placeholder of the same size.
+        RelocatableInst::SharedPtrVec skipped;
+        for(size_t j = i + 1; j < n; j++) {
+            append(skipped, tests[j]);
+            skipped.push_back(NoReloc(jrcxz(0)));
+        }
+        append(skipped, miss);
+        for(size_t j = 0; j < i; j++) {
+            append(skipped, hits[j]);
+        }
+        append(lookup, tests[i]);
+        lookup.push_back(JrcxzOver(skipped));
+    }
+    append(lookup, miss);
+    for(size_t i = 0; i < n; i++) {
+        append(lookup, hits[i]);
+    }
+
+    return lookup;
+}
+
+// Chained exit written at the end of a sequence, before the jump to the epilogue.
+RelocatableInst::SharedPtrVec getChainedExit(const std::vector<std::pair<Offset, Offset>>& slots) {
+    return lookupSlots(slots, nullptr);
+}
+
+// Indirect branch target cache shared by the dynamic exits of an ExecBlock. Misses are recorded such
+// that the VM can fill the cache.
+RelocatableInst::SharedPtrVec getIndirectCache(const std::vector<std::pair<Offset, Offset>>& slots, Offset missRecord) {
+    return lookupSlots(slots, &missRecord);
+}
+
+// Jump from a dynamic exit to the indirect branch cache.
+RelocatableInst::SharedPtrVec getIndirectCacheJump(rword cache) {
+    return {JmpTo(cache)};
+}
+
+static bool isFPRegister(unsigned int reg, const llvm::MCRegisterInfo* MRI) {
+    static const unsigned int FPR_CLASSES[] = {
+        llvm::X86::RSTRegClassID, llvm::X86::RFP80RegClassID, llvm::X86::VR64RegClassID,
+        llvm::X86::VR128XRegClassID, llvm::X86::VR256XRegClassID, llvm::X86::VR512RegClassID,
+        llvm::X86::VK64RegClassID
+    };
+    for(unsigned int regClass : FPR_CLASSES) {
+        if(MRI->getRegClass(regClass).contains(reg)) {
+            return true;
+        }
+    }
+    return reg == llvm::X86::FPSW;
+}
+
+// Conservatively check if an instruction uses the x87, MMX, SSE or AVX state. Instructions without
+// any register operand are caught using their opcode: the x87 escape opcodes and the 0F AE (FXSAVE,
+// LDMXCSR, ...), 0F C7 (XSAVEC, XRSTORS, ...), 0F 77 (EMMS) and 0F 0E (FEMMS) groups.
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    const llvm::MCInstrDesc& desc = MCII->get(inst->getOpcode());
+    uint64_t opMap = desc.TSFlags & llvm::X86II::OpMapMask;
+    uint8_t opcode = llvm::X86II::getBaseOpcodeFor(desc.TSFlags);
+
+    // VEX, XOP and EVEX encoded instructions
+    if((desc.TSFlags & llvm::X86II::EncodingMask) != 0) {
+        return true;
+    }
+    if(opMap == llvm::X86II::OB && ((opcode >= 0xD8 && opcode <= 0xDF) || opcode == 0x9B)) {
+        return true;
+    }
+    if(opMap == llvm::X86II::TB && (opcode == 0xAE || opcode == 0xC7 || opcode == 0x77 || opcode == 0x0E)) {
+        return true;
+    }
+    for(unsigned int i = 0; i < inst->getNumOperands(); i++) {
+        const llvm::MCOperand& op = inst->getOperand(i);
+        if(op.isReg() && isFPRegister(op.getReg(), MRI)) {
+            return true;
+        }
+    }
+    for(const uint16_t* reg = desc.getImplicitUses(); reg != nullptr && *reg != 0; reg++) {
+        if(isFPRegister(*reg, MRI)) {
+            return true;
+        }
+    }
+    for(const uint16_t* reg = desc.getImplicitDefs(); reg != nullptr && *reg != 0; reg++) {
+        if(isFPRegister(*reg, MRI)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Return the address pushed by a call instruction or 0 if the instruction is not a call.
+rword getReturnAddress(const InstMetadata& metadata) {
+    switch(metadata.inst.getOpcode()) {
+        case llvm::X86::CALL64pcrel32:
+        case llvm::X86::CALLpcrel16:
+        case llvm::X86::CALLpcrel32:
+        case llvm::X86::CALL64r:
+        case llvm::X86::CALL64m:
+            return metadata.endAddress();
+        default:
+            return 0;
+    }
+}
+
+bool isReturn(const InstMetadata& metadata) {
+    switch(metadata.inst.getOpcode()) {
+        case llvm::X86::RETQ:
+        case llvm::X86::RETIQ:
+        case llvm::X86::RETW:
+        case llvm::X86::RETIW:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Shadow return stack. The stack is a ring of RETURN_STACK_SIZE entries in the data block, each
+ * entry is the address of a slot pair as used by lookupSlots (negated guest address followed by the
+ * host address). The top of the stack is the byte offset of the last pushed entry and is stored as
+ * a single byte such that it wraps around the 256 bytes ring without any flag modification.
+ *
+ * Push, written at the end of a call sequence with the slot pair of its return site:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     MOVZX ECX, BYTE DataBlock[top]
+ *     LEA RCX, [RCX + 8]
+ *     MOV BYTE DataBlock[top], CL
+ *     LEA RDX, DataBlock[stack]
+ *     LEA RCX, [RDX + RCX]
+ *     LEA RDX, DataBlock[entry]
+ *     MOV [RCX], RDX
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+*/
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset stack, Offset entry) {
+    RelocatableInst::SharedPtrVec push;
+
+    append(push, SaveReg(Reg(2), Offset(Reg(2))));
+    append(push, SaveReg(Reg(3), Offset(Reg(3))));
+    push.push_back(Movzx8(llvm::X86::ECX, top));
+    push.push_back(NoReloc(lea(Reg(2), Reg(2), 1, 0, 8, 0)));
+    push.push_back(Mov8(top, llvm::X86::CL));
+    push.push_back(Lea(Reg(3), stack));
+    push.push_back(NoReloc(lea(Reg(2), Reg(3), 1, Reg(2), 0, 0)));
+    push.push_back(Lea(Reg(3), entry));
+    push.push_back(NoReloc(mov64mr(Reg(2), 1, 0, 0, 0, Reg(3))));
+    append(push, LoadReg(Reg(2), Offset(Reg(2))));
+    append(push, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return push;
+}
+
+/* Return prediction, written at the end of a return sequence before the jump to the indirect branch
+ * cache. The top entry is popped and its slot pair is tested against the guest RIP:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     MOVZX ECX, BYTE DataBlock[top]
+ *     LEA RDX, DataBlock[stack]
+ *     LEA RDX, [RDX + RCX]
+ *     LEA RCX, [RCX - 8]
+ *     MOV BYTE DataBlock[top], CL
+ *     MOV RDX, [RDX]
+ *     DataBlock[scratch] := RDX
+ *     MOV RCX, [RDX]
+ *     RDX := DataBlock[Offset(RIP)]
+ *     LEA RCX, [RCX + RDX]
+ *     JRCXZ HIT
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+ *     JMP END
+ * HIT:
+ *     RDX := DataBlock[scratch]
+ *     MOV RCX, [RDX + 8]
+ *     DataBlock[scratch] := RCX
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+ *     JMP DataBlock[scratch]
+ * END:
+*/
+RelocatableInst::SharedPtrVec getReturnStackPredict(Offset top, Offset stack, Offset scratch) {
+    RelocatableInst::SharedPtrVec predict;
+    RelocatableInst::SharedPtrVec miss;
+    RelocatableInst::SharedPtrVec hit;
+
+    append(hit, LoadReg(Reg(3), scratch));
+    hit.push_back(NoReloc(mov64rm(Reg(2), Reg(3), 1, 0, 8, 0)));
+    append(hit, SaveReg(Reg(2), scratch));
+    append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(hit, LoadReg(Reg(3), Offset(Reg(3))));
+    hit.push_back(Jmp64m(scratch));
+    append(miss, LoadReg(Reg(2), Offset(Reg(2))));
+    append(miss, LoadReg(Reg(3), Offset(Reg(3))));
+    miss.push_back(JmpOver(hit));
+
+    append(predict, SaveReg(Reg(2), Offset(Reg(2))));
+    append(predict, SaveReg(Reg(3), Offset(Reg(3))));
+    predict.push_back(Movzx8(llvm::X86::ECX, top));
+    predict.push_back(Lea(Reg(3), stack));
+    predict.push_back(NoReloc(lea(Reg(3), Reg(3), 1, Reg(2), 0, 0)));
+    predict.push_back(NoReloc(lea(Reg(2), Reg(2), 1, 0, -8, 0)));
+    predict.push_back(Mov8(top, llvm::X86::CL));
+    predict.push_back(NoReloc(mov64rm(Reg(3), Reg(3), 1, 0, 0, 0)));
+    append(predict, SaveReg(Reg(3), scratch));
+    predict.push_back(NoReloc(mov64rm(Reg(2), Reg(3), 1, 0, 0, 0)));
+    append(predict, LoadReg(Reg(3), Offset(Reg(REG_PC))));
+    predict.push_back(NoReloc(lea(Reg(2), Reg(2), 1, Reg(3), 0, 0)));
+    predict.push_back(JrcxzOver(miss));
+    append(predict, miss);
+    append(predict, hit);
+
+    return predict;
+}
+
+/* Guard written inside a trace after the last instruction of a basic block. Execution continues in
+ * the trace only if the guest RIP is the expected start of the next basic block, otherwise the
+ * trace is left through a side exit:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     RDX := DataBlock[Offset(RIP)]
+ *     MOV RCX, IMM64 -expected
+ *     LEA RCX, [RCX + RDX]
+ *     JRCXZ CONTINUE
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+ *     JMP Epilogue
+ * CONTINUE:
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+*/
+RelocatableInst::SharedPtrVec getTraceGuard(rword expected) {
+    RelocatableInst::SharedPtrVec guard;
+    RelocatableInst::SharedPtrVec sideExit;
+
+    append(sideExit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(sideExit, LoadReg(Reg(3), Offset(Reg(3))));
+    append(sideExit, JmpEpilogue());
+
+    append(guard, SaveReg(Reg(2), Offset(Reg(2))));
+    append(guard, SaveReg(Reg(3), Offset(Reg(3))));
+    append(guard, LoadReg(Reg(3), Offset(Reg(REG_PC))));
+    guard.push_back(NoReloc(mov64ri(Reg(2), (rword) 0 - expected)));
+    guard.push_back(NoReloc(lea(Reg(2), Reg(2), 1, Reg(3), 0, 0)));
+    guard.push_back(JrcxzOver(sideExit));
+    append(guard, sideExit);
+    append(guard, LoadReg(Reg(2), Offset(Reg(2))));
+    append(guard, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return guard;
+}
+
+/* Edge coverage hit, written at the entry of a basic block. The bitmap slot of the edge is the sum of
+ * the location of the basic block and of the location stored by the previous one, such that the
+ * slot is computed and incremented without any flag modification:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     RCX := DataBlock[prev]
+ *     MOV RDX, IMM64 slot
+ *     LEA RDX, [RDX + RCX]
+ *     MOVZX ECX, BYTE [RDX]
+ *     LEA RCX, [RCX + 1]
+ *     MOV BYTE [RDX], CL
+ *     MOV RCX, IMM64 next
+ *     DataBlock[prev] := RCX
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+*/
+RelocatableInst::SharedPtrVec getCoverageHit(rword slot, Offset prev, rword next) {
+    RelocatableInst::SharedPtrVec hit;
+
+    append(hit, SaveReg(Reg(2), Offset(Reg(2))));
+    append(hit, SaveReg(Reg(3), Offset(Reg(3))));
+    hit.push_back(Mov(Reg(2), prev));
+    hit.push_back(NoReloc(mov64ri(Reg(3), slot)));
+    hit.push_back(NoReloc(lea(Reg(3), Reg(3), 1, Reg(2), 0, 0)));
+    hit.push_back(NoReloc(mov32rm8(llvm::X86::ECX, Reg(3), 1, 0, 0, 0)));
+    hit.push_back(NoReloc(lea(Reg(2), Reg(2), 1, 0, 1, 0)));
+    hit.push_back(NoReloc(mov8mr(Reg(3), 1, 0, 0, 0, llvm::X86::CL)));
+    hit.push_back(NoReloc(mov64ri(Reg(2), next)));
+    hit.push_back(Mov(prev, Reg(2)));
+    append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(hit, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return hit;
+}
+
+/* Basic block trace entry, written at the entry of a basic block after the coverage hit. The address
+ * of the basic block is appended to the trace buffer, then the execution breaks to the host to flush
+ * the buffer if the new cursor is its end:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     MOV RDX, IMM64 &trace->cursor
+ *     MOV RCX, [RDX]
+ *     MOV RDX, IMM64 address
+ *     MOV [RCX], RDX
+ *     LEA RCX, [RCX + 8]
+ *     MOV RDX, IMM64 &trace->cursor
+ *     MOV [RDX], RCX
+ *     MOV RDX, IMM64 &trace->negEnd
+ *     MOV RDX, [RDX]
+ *     LEA RCX, [RCX + RDX]
+ *     JRCXZ FULL
+ *     JMP DONE
+ * FULL:
+ *     DataBlock[Offset(callback)] := trace->flush
+ *     DataBlock[Offset(data)] := trace->data
+ *     DataBlock[Offset(origin)] := instID
+ *     RDX := DataBlock[Offset(RDX)]
+ *     BreakToHost(RCX)
+ * DONE:
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+*/
+RelocatableInst::SharedPtrVec getBlockTraceHit(rword address, const BlockTrace* trace) {
+    RelocatableInst::SharedPtrVec hit;
+    RelocatableInst::SharedPtrVec full;
+
+    full.push_back(NoReloc(mov64ri(Reg(2), (rword) trace->flush)));
+    append(full, SaveReg(Reg(2), Offset(offsetof(Context, hostState.callback))));
+    full.push_back(NoReloc(mov64ri(Reg(2), (rword) trace->data)));
+    append(full, SaveReg(Reg(2), Offset(offsetof(Context, hostState.data))));
+    full.push_back(InstId(mov64ri(Reg(2), 0), 1));
+    append(full, SaveReg(Reg(2), Offset(offsetof(Context, hostState.origin))));
+    append(full, LoadReg(Reg(3), Offset(Reg(3))));
+    append(full, getBreakToHost(Reg(2)));
+    RelocatableInst::SharedPtr jmpDone = JmpOver(full);
+
+    append(hit, SaveReg(Reg(2), Offset(Reg(2))));
+    append(hit, SaveReg(Reg(3), Offset(Reg(3))));
+    hit.push_back(NoReloc(mov64ri(Reg(3), (rword) &trace->cursor)));
+    hit.push_back(NoReloc(mov64rm(Reg(2), Reg(3), 1, 0, 0, 0)));
+    hit.push_back(NoReloc(mov64ri(Reg(3), address)));
+    hit.push_back(NoReloc(mov64mr(Reg(2), 1, 0, 0, 0, Reg(3))));
+    hit.push_back(NoReloc(lea(Reg(2), Reg(2), 1, 0, sizeof(rword), 0)));
+    hit.push_back(NoReloc(mov64ri(Reg(3), (rword) &trace->cursor)));
+    hit.push_back(NoReloc(mov64mr(Reg(3), 1, 0, 0, 0, Reg(2))));
+    hit.push_back(NoReloc(mov64ri(Reg(3), (rword) &trace->negEnd)));
+    hit.push_back(NoReloc(mov64rm(Reg(3), Reg(3), 1, 0, 0, 0)));
+    hit.push_back(NoReloc(lea(Reg(2), Reg(2), 1, Reg(3), 0, 0)));
+    hit.push_back(JrcxzOver({jmpDone}));
+    hit.push_back(jmpDone);
+    append(hit, full);
+    append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(hit, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return hit;
+}
+
+/* Basic block counter hit, written at the entry of a basic block. The 64 bits counter of the basic
+ * block is incremented without any flag modification:
+ *
+ *     DataBlock[Offset(RCX)] := RCX
+ *     DataBlock[Offset(RDX)] := RDX
+ *     MOV RDX, IMM64 counter
+ *     MOV RCX, [RDX]
+ *     LEA RCX, [RCX + 1]
+ *     MOV [RDX], RCX
+ *     RCX := DataBlock[Offset(RCX)]
+ *     RDX := DataBlock[Offset(RDX)]
+*/
+RelocatableInst::SharedPtrVec getCounterHit(rword counter) {
+    RelocatableInst::SharedPtrVec hit;
+
+    append(hit, SaveReg(Reg(2), Offset(Reg(2))));
+    append(hit, SaveReg(Reg(3), Offset(Reg(3))));
+    hit.push_back(NoReloc(mov64ri(Reg(3), counter)));
+    hit.push_back(NoReloc(mov64rm(Reg(2), Reg(3), 1, 0, 0, 0)));
+    hit.push_back(NoReloc(lea(Reg(2), Reg(2), 1, 0, 1, 0)));
+    hit.push_back(NoReloc(mov64mr(Reg(3), 1, 0, 0, 0, Reg(2))));
+    append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(hit, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return hit;
+}
+
 }
@@ -49,6 +49,44 @@ public:
     }
 };
 
+/*! Relative branch over a list of instructions. The size of the skipped instructions is only known
+ *  once they are assembled and is added to the offset when the branch is relocated.
+*/
+class SkipRel : public RelocatableInst, public AutoAlloc<RelocatableInst, SkipRel> {
+    unsigned int                  opn;
+    rword                         offset;
+    RelocatableInst::SharedPtrVec skipped;
+
+public:
+    SkipRel(llvm::MCInst inst, unsigned int opn, rword offset, RelocatableInst::SharedPtrVec skipped)
+        : RelocatableInst(inst), opn(opn), offset(offset), skipped(skipped) {};
+
+    llvm::MCInst reloc(ExecBlock *exec_block) {
+        inst.getOperand(opn).setImm(offset + exec_block->getRelocatedSize(skipped));
+        return inst;
+    }
+};
+
+/*! Relative branch to an absolute address of the code. The branch is relative to its end, whose
+ *  address is only known once the branch is assembled at the current position.
+*/
+class TargetRel : public RelocatableInst, public AutoAlloc<RelocatableInst, TargetRel> {
+    unsigned int opn;
+    rword        offset;
+    rword        target;
+
+public:
+    TargetRel(llvm::MCInst inst, unsigned int opn, rword offset, rword target)
+        : RelocatableInst(inst), opn(opn), offset(offset), target(target) {};
+
+    llvm::MCInst reloc(ExecBlock *exec_block) {
+        // The size of the branch does not depend on its immediate
+        rword end = exec_block->getCurrentPC() + exec_block->getRelocatedSize({NoReloc(inst)});
+        inst.getOperand(opn).setImm(offset + target - end);
+        return inst;
+    }
+};
+
 class TaggedShadow : public RelocatableInst, public AutoAlloc<RelocatableInst, TaggedShadow> {
 
     unsigned int opn;
@@ -67,6 +105,27 @@ public:
     }
 };
 
+/*! Access to the shadow registered earlier with the same tag by the patch of the instruction.
+*/
+class TaggedShadowRef : public RelocatableInst, public AutoAlloc<RelocatableInst, TaggedShadowRef> {
+
+    unsigned int opn;
+    uint16_t tag;
+
+public:
+    TaggedShadowRef(llvm::MCInst inst, unsigned int opn, uint16_t tag)
+        : RelocatableInst(inst), opn(opn), tag(tag) {};
+
+    llvm::MCInst reloc(ExecBlock *exec_block) {
+        uint16_t id = exec_block->getLastShadow(tag);
+        RequireAction("TaggedShadowRef::reloc", id != NOT_FOUND, abort());
+        inst.getOperand(opn).setImm(
+            exec_block->getDataBlockOffset() + exec_block->getShadowOffset(id) - 7
+        );
+        return inst;
+    }
+};
+
 }
 
 #endif
@@ -0,0 +1,210 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ADDRESSMAP_H
+#define ADDRESSMAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <utility>
+#include <vector>
+
+#include "State.h"
+#include "Utility/LogSys.h"
+
+namespace QBDI {
+
+/*! Hash table keyed by guest addresses using open addressing with linear probing. Entries are
+ *  stored inline in a single array such that a lookup usually touches a single cache line.
+ *  Iteration order is unspecified and references to the values are invalidated by insertions
+ *  and erasures.
+ */
+template<typename T>
+class AddressMap {
+public:
+
+    using Entry = std::pair<rword, T>;
+
+    /*! Iterator over the entries of the map, in unspecified order.
+     */
+    class const_iterator {
+    private:
+
+        const std::vector<Entry>* slots;
+        size_t                    idx;
+
+        void skipEmpty() {
+            while(idx < slots->size() && (*slots)[idx].first == EMPTY_KEY) {
+                idx++;
+            }
+        }
+
+    public:
+
+        const_iterator(const std::vector<Entry>* slots, size_t idx) : slots(slots), idx(idx) {
+            skipEmpty();
+        }
+
+        const Entry& operator*() const { return (*slots)[idx]; }
+
+        const Entry* operator->() const { return &(*slots)[idx]; }
+
+        const_iterator& operator++() {
+            idx++;
+            skipEmpty();
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const { return idx == other.idx; }
+
+        bool operator!=(const const_iterator& other) const { return idx != other.idx; }
+    };
+
+private:
+
+    // Instructions can not start at the very last address of the address space
+    static const rword  EMPTY_KEY = (rword) -1;
+    static const size_t MIN_CAPACITY = 16;
+
+    std::vector<Entry> slots;
+    size_t             used;
+
+    size_t slotOf(rword key) const {
+        // Fibonacci hashing: instruction addresses are clustered and their low bits are not random
+        return (size_t) (((uint64_t) key * 0x9E3779B97F4A7C15ull) >> 32) & (slots.size() - 1);
+    }
+
+    size_t lookup(rword key) const {
+        size_t i = slotOf(key);
+        while(slots[i].first != key && slots[i].first != EMPTY_KEY) {
+            i = (i + 1) & (slots.size() - 1);
+        }
+        return i;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Entry> old(capacity, Entry(EMPTY_KEY, T()));
+        // old now holds the previous entries and slots the new empty table
+        old.swap(slots);
+        for(Entry& entry : old) {
+            if(entry.first != EMPTY_KEY) {
+                slots[lookup(entry.first)] = std::move(entry);
+            }
+        }
+    }
+
+public:
+
+    AddressMap() : slots(MIN_CAPACITY, Entry(EMPTY_KEY, T())), used(0) {}
+
+    /*! Find the value associated with an address.
+     *
+     * @param key  The address.
+     *
+     * @return A pointer to the value or nullptr if the address is not in the map.
+     */
+    T* find(rword key) {
+        size_t i = lookup(key);
+        return (slots[i].first == key && key != EMPTY_KEY) ? &slots[i].second : nullptr;
+    }
+
+    const T* find(rword key) const {
+        size_t i = lookup(key);
+        return (slots[i].first == key && key != EMPTY_KEY) ? &slots[i].second : nullptr;
+    }
+
+    size_t count(rword key) const {
+        return find(key) != nullptr ? 1 : 0;
+    }
+
+    /*! Get the value associated with an address, inserting a default constructed value if the
+     *  address is not in the map yet.
+     *
+     * @param key  The address.
+     *
+     * @return A reference to the value, valid until the next insertion or erasure.
+     */
+    T& operator[](rword key) {
+        RequireAction("AddressMap::operator[]", key != EMPTY_KEY, abort());
+        size_t i = lookup(key);
+        if(slots[i].first == key) {
+            return slots[i].second;
+        }
+        // Keep the load factor under 1/2 such that probe sequences stay short
+        if(2 * (used + 1) > slots.size()) {
+            rehash(2 * slots.size());
+            i = lookup(key);
+        }
+        slots[i] = Entry(key, T());
+        used++;
+        return slots[i].second;
+    }
+
+    /*! Remove an address from the map. The following entries of the probe sequence are shifted
+     *  back such that no tombstone is needed.
+     *
+     * @param key  The address.
+     *
+     * @return The number of erased entries (0 or 1).
+     */
+    size_t erase(rword key) {
+        size_t mask = slots.size() - 1;
+        size_t i = lookup(key);
+        if(slots[i].first != key) {
+            return 0;
+        }
+        size_t j = i;
+        while(true) {
+            j = (j + 1) & mask;
+            if(slots[j].first == EMPTY_KEY) {
+                break;
+            }
+            // Move the entry back if its home slot is not cyclically in ]i, j]
+            size_t home = slotOf(slots[j].first);
+            if(((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = std::move(slots[j]);
+                i = j;
+            }
+        }
+        slots[i] = Entry(EMPTY_KEY, T());
+        used--;
+        return 1;
+    }
+
+    void clear() {
+        std::vector<Entry>(MIN_CAPACITY, Entry(EMPTY_KEY, T())).swap(slots);
+        used = 0;
+    }
+
+    size_t size() const { return used; }
+
+    bool empty() const { return used == 0; }
+
+    const_iterator begin() const { return const_iterator(&slots, 0); }
+
+    const_iterator end() const { return const_iterator(&slots, slots.size()); }
+};
+
+template<typename T>
+const rword AddressMap<T>::EMPTY_KEY;
+
+template<typename T>
+const size_t AddressMap<T>::MIN_CAPACITY;
+
+}
+
+#endif // ADDRESSMAP_H
@@ -0,0 +1,131 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef RANGEINDEX_H
+#define RANGEINDEX_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "Range.h"
+#include "State.h"
+
+namespace QBDI {
+
+/*! Static index of possibly overlapping address ranges. The boundaries of the ranges split the
+ *  address space in sorted non overlapping segments, each one listing the ranges covering it,
+ *  such that an overlap query is a binary search followed by the scan of the hit segments.
+ *  The index is rebuilt as a whole when the set of ranges changes.
+ */
+template<typename T>
+class RangeIndex {
+public:
+
+    using Entry = std::pair<Range<rword>, T>;
+
+private:
+
+    std::vector<Entry>    entries;
+    // Segment k is [bounds[k], bounds[k+1]) and is covered by members[offsets[k]:offsets[k+1]]
+    std::vector<rword>    bounds;
+    std::vector<size_t>   offsets;
+    std::vector<uint32_t> members;
+    uint64_t              generation;
+
+public:
+
+    RangeIndex() : generation(0) {}
+
+    /*! Replace the indexed ranges.
+     *
+     * @param newEntries  The ranges and their associated values. Empty ranges are ignored.
+     */
+    void build(const std::vector<Entry>& newEntries) {
+        entries.clear();
+        bounds.clear();
+        for(const Entry& entry : newEntries) {
+            if(entry.first.size() > 0) {
+                entries.push_back(entry);
+                bounds.push_back(entry.first.start);
+                bounds.push_back(entry.first.end);
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        // Count the ranges covering each segment, then fill the segments in entries order
+        offsets.assign(bounds.size() + 1, 0);
+        for(const Entry& entry : entries) {
+            size_t first = std::lower_bound(bounds.begin(), bounds.end(), entry.first.start) - bounds.begin();
+            size_t last = std::lower_bound(bounds.begin(), bounds.end(), entry.first.end) - bounds.begin();
+            for(size_t k = first; k < last; k++) {
+                offsets[k + 1]++;
+            }
+        }
+        for(size_t k = 1; k < offsets.size(); k++) {
+            offsets[k] += offsets[k - 1];
+        }
+        members.resize(offsets.back());
+        std::vector<size_t> cursor(offsets.begin(), offsets.end() - 1);
+        for(size_t i = 0; i < entries.size(); i++) {
+            size_t first = std::lower_bound(bounds.begin(), bounds.end(), entries[i].first.start) - bounds.begin();
+            size_t last = std::lower_bound(bounds.begin(), bounds.end(), entries[i].first.end) - bounds.begin();
+            for(size_t k = first; k < last; k++) {
+                members[cursor[k]++] = (uint32_t) i;
+            }
+        }
+        generation++;
+    }
+
+    /*! Visit the values of the ranges overlapping a range, each one once.
+     *
+     * @param range  The range to look up. An empty range is looked up as its start address.
+     * @param visit  Functor called with each value, returning false to stop the lookup.
+     */
+    template<typename F>
+    void forEachOverlap(Range<rword> range, F visit) const {
+        rword end = range.size() > 0 ? range.end : range.start + 1;
+        size_t k = std::upper_bound(bounds.begin(), bounds.end(), range.start) - bounds.begin();
+        size_t first = k > 0 ? k - 1 : 0;
+        for(k = first; k + 1 < bounds.size() && bounds[k] < end; k++) {
+            for(size_t i = offsets[k]; i < offsets[k + 1]; i++) {
+                const Entry& entry = entries[members[i]];
+                // Ranges starting before this segment were already visited in the previous one
+                if(k != first && entry.first.start < bounds[k]) {
+                    continue;
+                }
+                if(visit(entry.second) == false) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /*! Incremented by every build, allowing a visitor to detect that the index changed.
+     */
+    uint64_t getGeneration() const { return generation; }
+
+    size_t size() const { return entries.size(); }
+
+    bool empty() const { return entries.empty(); }
+};
+
+}
+
+#endif // RANGEINDEX_H
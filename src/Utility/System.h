@@ -30,6 +30,17 @@ namespace QBDI {
                                                 unsigned PFlags,
                                                 std::error_code &EC);
     void releaseMappedMemory(llvm::sys::MemoryBlock& block);
+    int createSharedMemory(size_t numBytes);
+    llvm::sys::MemoryBlock mapSharedMemory(int handle,
+                                           void* address,
+                                           size_t numBytes,
+                                           std::error_code &EC);
+    void releaseSharedMemory(int handle);
+    void unmapSharedMemory(void* address, size_t numBytes, std::error_code &EC);
+    bool adviseHugePages(void* address, size_t numBytes);
+    llvm::sys::MemoryBlock mapWriteAlias(void* address,
+                                         size_t numBytes,
+                                         std::error_code &EC);
     const std::string getHostCPUName();
     const std::vector<std::string> getHostCPUFeatures();
     bool isHostCPUFeaturePresent(const char* f);
@@ -17,9 +17,24 @@
  */
 #include "Platform.h"
 
+#include <cerrno>
+
 #include "llvm/Support/Host.h"
 #include "llvm/Support/Process.h"
 
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+#endif
+
+// Older C libraries don't define the memfd_create flags
+#if (defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)) && !defined(MFD_CLOEXEC)
+#define MFD_CLOEXEC 0x0001U
+#endif
+
 #include "Utility/LogSys.h"
 #include "System.h"
 
@@ -45,6 +60,124 @@ void releaseMappedMemory(llvm::sys::MemoryBlock& block) {
 }
 
 
+// Shared memory is an anonymous file which can be mapped several times, -1 if not supported. The
+// handle is closed on exec, the guest must not inherit it.
+int createSharedMemory(size_t numBytes) {
+    int handle = -1;
+#if (defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)) && defined(SYS_memfd_create)
+    handle = (int) syscall(SYS_memfd_create, "qbdi-shared", MFD_CLOEXEC);
+#elif defined(QBDI_OS_MACOS)
+    static unsigned counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/qbdi-%d-%u", getpid(), counter++);
+    handle = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(handle >= 0) {
+        shm_unlink(name);
+        fcntl(handle, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if(handle < 0) {
+        return -1;
+    }
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS)
+    if(ftruncate(handle, numBytes) != 0) {
+        close(handle);
+        return -1;
+    }
+#endif
+    return handle;
+}
+
+
+llvm::sys::MemoryBlock mapSharedMemory(int handle,
+                                       void* address,
+                                       size_t numBytes,
+                                       std::error_code &ec) {
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS)
+    int flags = MAP_SHARED;
+    // Replace the existing mapping at the given address
+    if(address != nullptr) {
+        flags |= MAP_FIXED;
+    }
+    void* base = mmap(address, numBytes, PROT_READ | PROT_WRITE, flags, handle, 0);
+    if(base == MAP_FAILED) {
+        ec = std::error_code(errno, std::generic_category());
+        return llvm::sys::MemoryBlock();
+    }
+    ec = std::error_code();
+    return llvm::sys::MemoryBlock(base, numBytes);
+#else
+    ec = std::error_code(ENOSYS, std::generic_category());
+    return llvm::sys::MemoryBlock();
+#endif
+}
+
+
+void releaseSharedMemory(int handle) {
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS)
+    if(handle >= 0) {
+        close(handle);
+    }
+#endif
+}
+
+
+// Replace a shared memory mapping by private memory, keeping the address range reserved
+void unmapSharedMemory(void* address, size_t numBytes, std::error_code &ec) {
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS)
+    void* base = mmap(address, numBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if(base == MAP_FAILED) {
+        ec = std::error_code(errno, std::generic_category());
+        return;
+    }
+    ec = std::error_code();
+#else
+    ec = std::error_code(ENOSYS, std::generic_category());
+#endif
+}
+
+
+// Replace a range by shared memory mapped RX there and RW at the returned alias, such that code
+// can be written and executed without changing protections. An empty block if not supported.
+// Only X86_64 keeps its instruction cache coherent with writes through another mapping, ARM relies
+// on the protection changes to invalidate it.
+llvm::sys::MemoryBlock mapWriteAlias(void* address, size_t numBytes, std::error_code &ec) {
+#if defined(QBDI_ARCH_X86_64) && (defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID) || defined(QBDI_OS_MACOS))
+    int handle = createSharedMemory(numBytes);
+    if(handle < 0) {
+        ec = std::error_code(ENOSYS, std::generic_category());
+        return llvm::sys::MemoryBlock();
+    }
+    llvm::sys::MemoryBlock alias = mapSharedMemory(handle, nullptr, numBytes, ec);
+    if(!ec) {
+        // Policies denying executable shared mappings fail before the range is replaced
+        void* base = mmap(address, numBytes, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, handle, 0);
+        if(base == MAP_FAILED) {
+            ec = std::error_code(errno, std::generic_category());
+            munmap(alias.base(), numBytes);
+            alias = llvm::sys::MemoryBlock();
+        }
+    }
+    // The mappings keep the shared memory alive
+    releaseSharedMemory(handle);
+    return alias;
+#else
+    ec = std::error_code(ENOSYS, std::generic_category());
+    return llvm::sys::MemoryBlock();
+#endif
+}
+
+
+// Ask for the range to be backed by transparent huge pages, false if not supported
+bool adviseHugePages(void* address, size_t numBytes) {
+#if (defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)) && defined(MADV_HUGEPAGE)
+    return madvise(address, numBytes, MADV_HUGEPAGE) == 0;
+#else
+    return false;
+#endif
+}
+
+
 const std::string getHostCPUName() {
     const std::string& cpuname = llvm::sys::getHostCPUName();
     // set default ARM CPU
@@ -185,6 +185,41 @@ void releaseMappedMemory(llvm::sys::MemoryBlock& block) {
 }
 
 
+// Not supported: JIT pages may come from the JIT server
+int createSharedMemory(size_t numBytes) {
+    return -1;
+}
+
+
+llvm::sys::MemoryBlock mapSharedMemory(int handle,
+                                       void* address,
+                                       size_t numBytes,
+                                       std::error_code &ec) {
+    ec = std::error_code(ENOSYS, std::generic_category());
+    return llvm::sys::MemoryBlock();
+}
+
+
+void releaseSharedMemory(int handle) {
+}
+
+
+void unmapSharedMemory(void* address, size_t numBytes, std::error_code &ec) {
+    ec = std::error_code(ENOSYS, std::generic_category());
+}
+
+
+bool adviseHugePages(void* address, size_t numBytes) {
+    return false;
+}
+
+
+llvm::sys::MemoryBlock mapWriteAlias(void* address, size_t numBytes, std::error_code &ec) {
+    ec = std::error_code(ENOSYS, std::generic_category());
+    return llvm::sys::MemoryBlock();
+}
+
+
 const std::string getHostCPUName() {
     host_basic_info_data_t        hostInfo;
     mach_msg_type_number_t        infoCount;
@@ -0,0 +1,545 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Trace.h"
+#include "Utility/LogSys.h"
+
+namespace QBDI {
+
+// File layout:
+//   FileHeader
+//   { ChunkHeader, payload[ChunkHeader.size] } *
+//   ChunkIndex[FileFooter.chunkCount]   (missing if the writer was not closed)
+//   FileFooter
+//
+// Record layout, every integer being a LEB128 varint and every delta zigzag encoded:
+//   TRACE_BASIC_BLOCK    delta(address)
+//   TRACE_MEMORY_ACCESS  size << 2 | type, delta(instAddress), delta(accessAddress), value
+//   TRACE_REGISTERS      changed register mask, delta(register) for each bit of the mask
+//   TRACE_MODULE         start, size, permission, name length, name
+
+static const char     TRACE_MAGIC[8] = {'Q', 'B', 'D', 'I', 'T', 'R', 'C', 'E'};
+static const char     INDEX_MAGIC[8] = {'Q', 'B', 'D', 'I', 'I', 'N', 'D', 'X'};
+static const uint32_t CHUNK_MAGIC = 0x4b484351; // "QCHK"
+static const uint16_t TRACE_VERSION = 1;
+static const unsigned TRACE_GPR = sizeof(GPRState) / sizeof(rword);
+
+static_assert(TRACE_GPR <= 32, "The register mask is limited to 32 registers");
+
+struct FileHeader {
+    char     magic[8];
+    uint16_t version;
+    uint8_t  wordSize;
+    uint8_t  gprCount;
+    uint32_t reserved;
+};
+
+struct ChunkHeader {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t records;
+    uint32_t reserved;
+};
+
+struct FileFooter {
+    uint64_t indexOffset;
+    uint64_t chunkCount;
+    uint64_t recordCount;
+    char     magic[8];
+};
+
+struct TraceFile {
+    struct Chunk {
+        const uint8_t* payload;
+        uint32_t       size;
+        uint32_t       records;
+        uint64_t       firstRecord;
+    };
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    std::vector<Chunk>                  chunks;
+    uint64_t                            records;
+};
+
+static inline uint64_t zigzag(rword current, rword previous) {
+    int64_t delta = (int64_t) (std::make_signed<rword>::type) (current - previous);
+    return ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63);
+}
+
+static inline rword unzigzag(uint64_t value, rword previous) {
+    int64_t delta = (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    return previous + (rword) delta;
+}
+
+static inline bool readVarint(const uint8_t*& cursor, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for(unsigned shift = 0; shift < 64 && cursor < end; shift += 7) {
+        uint8_t byte = *cursor++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// TraceWriter
+
+TraceWriter::TraceWriter(size_t chunkSize) : file(nullptr), chunkSize(chunkSize), chunkRecords(0),
+    records(0), offset(0) {
+    chunk.reserve(chunkSize + 64);
+    resetDelta();
+}
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+void TraceWriter::resetDelta() {
+    prevBlock = 0;
+    prevInst = 0;
+    prevAccess = 0;
+    memset(&prevGPR, 0, sizeof(GPRState));
+}
+
+void TraceWriter::writeVarint(uint64_t value) {
+    while(value >= 0x80) {
+        chunk.push_back((uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    chunk.push_back((uint8_t) value);
+}
+
+void TraceWriter::writeSigned(rword current, rword previous) {
+    writeVarint(zigzag(current, previous));
+}
+
+void TraceWriter::endRecord() {
+    chunkRecords++;
+    records++;
+    if(chunk.size() >= chunkSize) {
+        writeChunk();
+    }
+}
+
+bool TraceWriter::writeChunk() {
+    if(chunkRecords == 0) {
+        return true;
+    }
+    ChunkHeader header = {CHUNK_MAGIC, (uint32_t) chunk.size(), chunkRecords, 0};
+    bool written = fwrite(&header, sizeof(ChunkHeader), 1, file) == 1 &&
+                   fwrite(chunk.data(), chunk.size(), 1, file) == 1;
+    if(written) {
+        index.push_back(ChunkIndex {offset, records - chunkRecords});
+        offset += sizeof(ChunkHeader) + chunk.size();
+    }
+    else {
+        LogError("TraceWriter::writeChunk", "Failed to write a chunk of %u records", chunkRecords);
+    }
+    chunk.clear();
+    chunkRecords = 0;
+    resetDelta();
+    return written;
+}
+
+bool TraceWriter::open(const char* path) {
+    close();
+    file = fopen(path, "wb");
+    RequireAction("TraceWriter::open", file != nullptr, return false);
+
+    FileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.version = TRACE_VERSION;
+    header.wordSize = sizeof(rword);
+    header.gprCount = TRACE_GPR;
+    header.reserved = 0;
+    if(fwrite(&header, sizeof(FileHeader), 1, file) != 1) {
+        LogError("TraceWriter::open", "Failed to write the header of %s", path);
+        fclose(file);
+        file = nullptr;
+        return false;
+    }
+    offset = sizeof(FileHeader);
+    records = 0;
+    index.clear();
+    chunk.clear();
+    chunkRecords = 0;
+    resetDelta();
+    return true;
+}
+
+bool TraceWriter::flush() {
+    RequireAction("TraceWriter::flush", file != nullptr, return false);
+    bool written = writeChunk();
+    return fflush(file) == 0 && written;
+}
+
+bool TraceWriter::close() {
+    if(file == nullptr) {
+        return true;
+    }
+    bool written = writeChunk();
+
+    FileFooter footer = {offset, index.size(), records, {}};
+    memcpy(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    if(index.size() > 0) {
+        written = fwrite(index.data(), sizeof(ChunkIndex), index.size(), file) == index.size() && written;
+    }
+    written = fwrite(&footer, sizeof(FileFooter), 1, file) == 1 && written;
+    written = fclose(file) == 0 && written;
+    file = nullptr;
+    index.clear();
+    return written;
+}
+
+void TraceWriter::writeBasicBlock(rword address) {
+    RequireAction("TraceWriter::writeBasicBlock", file != nullptr, return);
+    chunk.push_back(TRACE_BASIC_BLOCK);
+    writeSigned(address, prevBlock);
+    prevBlock = address;
+    endRecord();
+}
+
+void TraceWriter::writeBasicBlocks(const rword* blocks, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        writeBasicBlock(blocks[i]);
+    }
+}
+
+void TraceWriter::writeMemoryAccess(const MemoryAccess& access) {
+    RequireAction("TraceWriter::writeMemoryAccess", file != nullptr, return);
+    chunk.push_back(TRACE_MEMORY_ACCESS);
+    writeVarint(((uint64_t) access.size << 2) | (access.type & MEMORY_READ_WRITE));
+    writeSigned(access.instAddress, prevInst);
+    writeSigned(access.accessAddress, prevAccess);
+    writeVarint(access.value);
+    prevInst = access.instAddress;
+    prevAccess = access.accessAddress;
+    endRecord();
+}
+
+void TraceWriter::writeMemoryAccesses(const MemoryAccess* accesses, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        writeMemoryAccess(accesses[i]);
+    }
+}
+
+void TraceWriter::writeRegisters(const GPRState* gprState) {
+    RequireAction("TraceWriter::writeRegisters", file != nullptr, return);
+    uint32_t mask = 0;
+    for(unsigned i = 0; i < TRACE_GPR; i++) {
+        if(QBDI_GPR_GET(gprState, i) != QBDI_GPR_GET(&prevGPR, i)) {
+            mask |= 1u << i;
+        }
+    }
+    chunk.push_back(TRACE_REGISTERS);
+    writeVarint(mask);
+    for(unsigned i = 0; i < TRACE_GPR; i++) {
+        if(mask & (1u << i)) {
+            writeSigned(QBDI_GPR_GET(gprState, i), QBDI_GPR_GET(&prevGPR, i));
+        }
+    }
+    prevGPR = *gprState;
+    endRecord();
+}
+
+void TraceWriter::writeModule(const MemoryMap& module) {
+    RequireAction("TraceWriter::writeModule", file != nullptr, return);
+    chunk.push_back(TRACE_MODULE);
+    writeVarint(module.range.start);
+    writeVarint(module.range.size());
+    writeVarint(module.permission);
+    writeVarint(module.name.size());
+    chunk.insert(chunk.end(), module.name.begin(), module.name.end());
+    endRecord();
+}
+
+void TraceWriter::blockTraceCallback(VMInstanceRef vm, const rword* blocks, size_t count, void* data) {
+    static_cast<TraceWriter*>(data)->writeBasicBlocks(blocks, count);
+}
+
+void TraceWriter::memTraceCallback(VMInstanceRef vm, const MemoryAccess* accesses, size_t count, void* data) {
+    static_cast<TraceWriter*>(data)->writeMemoryAccesses(accesses, count);
+}
+
+VMAction TraceWriter::registersCallback(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    static_cast<TraceWriter*>(data)->writeRegisters(gprState);
+    return VMAction::CONTINUE;
+}
+
+VMAction TraceWriter::basicBlockCallback(VMInstanceRef vm, const VMState* vmState, GPRState* gprState,
+                                         FPRState* fprState, void* data) {
+    static_cast<TraceWriter*>(data)->writeBasicBlock(vmState->basicBlockStart);
+    return VMAction::CONTINUE;
+}
+
+// TraceReader
+
+static bool loadIndex(TraceFile* traceFile) {
+    const uint8_t* base = (const uint8_t*) traceFile->buffer->getBufferStart();
+    size_t size = traceFile->buffer->getBufferSize();
+    FileFooter footer;
+
+    if(size < sizeof(FileHeader) + sizeof(FileFooter)) {
+        return false;
+    }
+    memcpy(&footer, base + size - sizeof(FileFooter), sizeof(FileFooter));
+    if(memcmp(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+       footer.indexOffset < sizeof(FileHeader) + sizeof(ChunkHeader) ||
+       footer.indexOffset > size - sizeof(FileFooter)) {
+        return false;
+    }
+    // Compare the entry count to the index size without multiplying an untrusted count
+    size_t indexSize = size - sizeof(FileFooter) - footer.indexOffset;
+    if(indexSize % (2 * sizeof(uint64_t)) != 0 || footer.chunkCount != indexSize / (2 * sizeof(uint64_t))) {
+        return false;
+    }
+    // The chunks must follow each other in record order, otherwise seek would pick the wrong one
+    uint64_t records = 0;
+    for(uint64_t i = 0; i < footer.chunkCount; i++) {
+        uint64_t entry[2];
+        ChunkHeader header;
+        memcpy(entry, base + footer.indexOffset + i * sizeof(entry), sizeof(entry));
+        if(entry[0] < sizeof(FileHeader) || entry[0] > footer.indexOffset - sizeof(ChunkHeader)) {
+            return false;
+        }
+        memcpy(&header, base + entry[0], sizeof(ChunkHeader));
+        if(header.magic != CHUNK_MAGIC ||
+           header.size > footer.indexOffset - sizeof(ChunkHeader) - entry[0] ||
+           entry[1] != records) {
+            return false;
+        }
+        traceFile->chunks.push_back(TraceFile::Chunk {base + entry[0] + sizeof(ChunkHeader), header.size,
+                                                      header.records, entry[1]});
+        records += header.records;
+    }
+    if(records != footer.recordCount) {
+        return false;
+    }
+    traceFile->records = records;
+    return true;
+}
+
+static void scanChunks(TraceFile* traceFile) {
+    const uint8_t* base = (const uint8_t*) traceFile->buffer->getBufferStart();
+    size_t size = traceFile->buffer->getBufferSize();
+    size_t offset = sizeof(FileHeader);
+
+    traceFile->chunks.clear();
+    traceFile->records = 0;
+    while(offset + sizeof(ChunkHeader) <= size) {
+        ChunkHeader header;
+        memcpy(&header, base + offset, sizeof(ChunkHeader));
+        if(header.magic != CHUNK_MAGIC || header.size > size - offset - sizeof(ChunkHeader)) {
+            break;
+        }
+        traceFile->chunks.push_back(TraceFile::Chunk {base + offset + sizeof(ChunkHeader), header.size,
+                                                      header.records, traceFile->records});
+        traceFile->records += header.records;
+        offset += sizeof(ChunkHeader) + header.size;
+    }
+}
+
+TraceReader::TraceReader() : traceFile(nullptr) {}
+
+TraceReader::~TraceReader() {
+    close();
+}
+
+bool TraceReader::open(const char* path) {
+    close();
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+    if(!buffer) {
+        LogError("TraceReader::open", "Failed to map %s: %s", path, buffer.getError().message().c_str());
+        return false;
+    }
+
+    FileHeader header;
+    RequireAction("TraceReader::open", (*buffer)->getBufferSize() >= sizeof(FileHeader), return false);
+    memcpy(&header, (*buffer)->getBufferStart(), sizeof(FileHeader));
+    if(memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || header.version != TRACE_VERSION) {
+        LogError("TraceReader::open", "%s is not a trace of version %u", path, TRACE_VERSION);
+        return false;
+    }
+    if(header.wordSize != sizeof(rword) || header.gprCount != TRACE_GPR) {
+        LogError("TraceReader::open", "%s was not recorded on this architecture", path);
+        return false;
+    }
+
+    traceFile = new TraceFile {std::move(*buffer), {}, 0};
+    if(loadIndex(traceFile) == false) {
+        LogDebug("TraceReader::open", "No valid index in %s, scanning the chunks", path);
+        scanChunks(traceFile);
+    }
+    return true;
+}
+
+void TraceReader::close() {
+    delete traceFile;
+    traceFile = nullptr;
+}
+
+size_t TraceReader::getChunkCount() const {
+    return traceFile != nullptr ? traceFile->chunks.size() : 0;
+}
+
+uint64_t TraceReader::getRecordCount() const {
+    return traceFile != nullptr ? traceFile->records : 0;
+}
+
+TraceReader::iterator TraceReader::begin() const {
+    if(traceFile == nullptr) {
+        return iterator();
+    }
+    return iterator(traceFile, 0);
+}
+
+TraceReader::iterator TraceReader::end() const {
+    if(traceFile == nullptr) {
+        return iterator();
+    }
+    return iterator(traceFile, traceFile->chunks.size());
+}
+
+TraceReader::iterator TraceReader::seek(uint64_t position) const {
+    if(traceFile == nullptr || position >= traceFile->records) {
+        return end();
+    }
+    std::vector<TraceFile::Chunk>::const_iterator chunk = std::upper_bound(
+        traceFile->chunks.begin(), traceFile->chunks.end(), position,
+        [](uint64_t position, const TraceFile::Chunk& chunk) { return position < chunk.firstRecord; });
+    iterator it(traceFile, chunk - traceFile->chunks.begin() - 1);
+    while(it.getPosition() < position) {
+        ++it;
+    }
+    return it;
+}
+
+// TraceReader::iterator
+
+TraceReader::iterator::iterator() : traceFile(nullptr), chunk(0), cursor(nullptr), end(nullptr),
+    remaining(0), position(0) {
+    memset(&record.access, 0, sizeof(MemoryAccess));
+    memset(&record.gprState, 0, sizeof(GPRState));
+}
+
+TraceReader::iterator::iterator(const TraceFile* traceFile, size_t chunk) : iterator() {
+    this->traceFile = traceFile;
+    loadChunk(chunk);
+}
+
+void TraceReader::iterator::loadChunk(size_t chunk) {
+    // Empty chunks are skipped, past the last chunk the iterator is the end iterator
+    while(chunk < traceFile->chunks.size() && traceFile->chunks[chunk].records == 0) {
+        chunk++;
+    }
+    this->chunk = chunk;
+    if(chunk >= traceFile->chunks.size()) {
+        cursor = end = nullptr;
+        remaining = 0;
+        position = traceFile->records;
+        return;
+    }
+    const TraceFile::Chunk& current = traceFile->chunks[chunk];
+    cursor = current.payload;
+    end = current.payload + current.size;
+    remaining = current.records;
+    position = current.firstRecord;
+    // The delta state is reset at every chunk start
+    record.address = 0;
+    memset(&record.access, 0, sizeof(MemoryAccess));
+    memset(&record.gprState, 0, sizeof(GPRState));
+    decode();
+}
+
+TraceReader::iterator& TraceReader::iterator::operator++() {
+    RequireAction("TraceReader::iterator::operator++", remaining > 0, return *this);
+    remaining--;
+    position++;
+    if(remaining == 0) {
+        loadChunk(chunk + 1);
+    }
+    else {
+        decode();
+    }
+    return *this;
+}
+
+void TraceReader::iterator::decode() {
+    uint64_t value = 0, size = 0;
+    bool valid = cursor < end;
+
+    if(valid) {
+        record.type = (TraceRecordType) *cursor++;
+        switch(record.type) {
+            case TRACE_BASIC_BLOCK:
+                valid = readVarint(cursor, end, value);
+                record.address = unzigzag(value, record.address);
+                break;
+            case TRACE_MEMORY_ACCESS:
+                valid = readVarint(cursor, end, value);
+                record.access.size = (uint8_t) (value >> 2);
+                record.access.type = (MemoryAccessType) (value & MEMORY_READ_WRITE);
+                valid = valid && readVarint(cursor, end, value);
+                record.access.instAddress = unzigzag(value, record.access.instAddress);
+                valid = valid && readVarint(cursor, end, value);
+                record.access.accessAddress = unzigzag(value, record.access.accessAddress);
+                valid = valid && readVarint(cursor, end, value);
+                record.access.value = (rword) value;
+                break;
+            case TRACE_REGISTERS:
+                valid = readVarint(cursor, end, value);
+                for(unsigned i = 0; valid && i < TRACE_GPR; i++) {
+                    uint64_t delta = 0;
+                    if(value & (1u << i)) {
+                        valid = readVarint(cursor, end, delta);
+                        QBDI_GPR_SET(&record.gprState, i, unzigzag(delta, QBDI_GPR_GET(&record.gprState, i)));
+                    }
+                }
+                break;
+            case TRACE_MODULE:
+                valid = readVarint(cursor, end, value);
+                record.module.range.start = (rword) value;
+                valid = valid && readVarint(cursor, end, value);
+                record.module.range.end = record.module.range.start + (rword) value;
+                valid = valid && readVarint(cursor, end, value);
+                record.module.permission = (Permission) value;
+                valid = valid && readVarint(cursor, end, size) && size <= (uint64_t) (end - cursor);
+                if(valid) {
+                    record.module.name.assign((const char*) cursor, size);
+                    cursor += size;
+                }
+                break;
+            default:
+                valid = false;
+        }
+    }
+    if(valid == false) {
+        LogError("TraceReader::iterator::decode", "Invalid record %llu in chunk %llu, skipping the chunk",
+                 (unsigned long long) position, (unsigned long long) chunk);
+        loadChunk(chunk + 1);
+    }
+}
+
+}
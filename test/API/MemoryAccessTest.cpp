@@ -91,6 +91,21 @@ QBDI::rword arrayWrite32(volatile uint32_t* buffer, size_t size) {
     return sum;
 }
 
+QBDI::rword stackMixingWrite(QBDI::rword* src, QBDI::rword* dst) {
+#if defined(QBDI_ARCH_X86_64) && !defined(QBDI_OS_WIN)
+    // Skip the red zone, the pushed value is written below the stack pointer
+    asm volatile("subq $128, %%rsp; pushq (%0); popq (%1); addq $128, %%rsp" :: "r"(src), "r"(dst) : "memory");
+#endif
+    return *dst;
+}
+
+QBDI::rword incrementInPlace(volatile uint32_t* value) {
+#if defined(QBDI_ARCH_X86_64) && !defined(QBDI_OS_WIN)
+    asm volatile("addl $1, (%0)" :: "r"(value) : "memory");
+#endif
+    return *value;
+}
+
 QBDI::rword unrolledRead(volatile char* buffer) {
     size_t sum = buffer[0];
     sum += buffer[1];
@@ -274,6 +289,52 @@ QBDI::VMAction checkArrayWrite32(QBDI::VMInstanceRef vm, QBDI::GPRState* gprStat
     return QBDI::VMAction::CONTINUE;
 }
 
+QBDI::VMAction checkListWrite32(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState,
+                                const QBDI::MemoryAccess* accesses, size_t count, void* data) {
+
+    TestInfo* info = (TestInfo*) data;
+    QBDI::MemoryAccess memaccesses[4];
+    // The accesses passed to the callback are the ones returned by the query API
+    if(vm->getInstMemoryAccess(memaccesses, 4) < count) {
+        return QBDI::VMAction::STOP;
+    }
+    QBDI::Range<QBDI::rword> brange((QBDI::rword) info->buffer, ((QBDI::rword) info->buffer) + info->buffer_size);
+    for(size_t i = 0; i < count; i++) {
+        if(accesses[i].type != QBDI::MEMORY_WRITE) {
+            return QBDI::VMAction::STOP;
+        }
+        if(brange.contains(accesses[i].accessAddress)) {
+            size_t offset = (accesses[i].accessAddress - brange.start) >> 2;
+            if ((QBDI::rword) ((uint32_t*)info->buffer)[offset] == accesses[i].value) {
+                info->i += offset;
+            }
+        }
+    }
+    return QBDI::VMAction::CONTINUE;
+}
+
+struct TraceInfo {
+    QBDI::Range<QBDI::rword> range;
+    size_t flushes;
+    size_t records;
+    size_t matches;
+};
+
+void traceWrite32(QBDI::VMInstanceRef vm, const QBDI::MemoryAccess* accesses, size_t count, void* data) {
+    TraceInfo* info = (TraceInfo*) data;
+    info->flushes += 1;
+    info->records += count;
+    for(size_t i = 0; i < count; i++) {
+        if(accesses[i].type == QBDI::MEMORY_WRITE && accesses[i].size == 4 && info->range.contains(accesses[i].accessAddress)) {
+            QBDI::rword offset = (accesses[i].accessAddress - info->range.start) >> 2;
+            // arrayWrite32 writes the sums of the offsets, in order
+            if(accesses[i].value == N_SUM(offset) && offset == info->matches) {
+                info->matches += 1;
+            }
+        }
+    }
+}
+
 QBDI::VMAction checkUnrolledRead(QBDI::VMInstanceRef vm, const QBDI::VMState* vmState, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
     
     TestInfo* info = (TestInfo*) data;
@@ -325,6 +386,22 @@ QBDI::VMAction readSnooper(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBD
     return QBDI::VMAction::CONTINUE;
 }
 
+QBDI::VMAction countAccess(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
+    (*((size_t*) data))++;
+    return QBDI::VMAction::CONTINUE;
+}
+
+struct ObservedValues {
+    volatile uint32_t*    value;
+    std::vector<uint32_t> observed;
+};
+
+QBDI::VMAction observeValue(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
+    ObservedValues* info = (ObservedValues*) data;
+    info->observed.push_back(*info->value);
+    return QBDI::VMAction::CONTINUE;
+}
+
 QBDI::VMAction writeSnooper(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
     std::vector<QBDI::MemoryAccess> memaccesses = vm->getInstMemoryAccess();
     for(const QBDI::MemoryAccess& memaccess : memaccesses) {
@@ -542,6 +619,26 @@ TEST_F(MemoryAccessTest, DISABLED_WriteRange) {
     ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
 }
 
+#if defined(QBDI_ARCH_X86_64) && !defined(QBDI_OS_WIN)
+TEST_F(MemoryAccessTest, StackMixingWriteRange) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_StackMixingWriteRange) {
+#endif
+    QBDI::rword src = 0x1234;
+    QBDI::rword dst = 0;
+    size_t writes = 0;
+
+    // The write of pop [mem] can not be recomputed after the instruction and hits a write only range
+    vm->addMemRangeCB((QBDI::rword) &dst, (QBDI::rword) (&dst + 1), QBDI::MEMORY_WRITE, countAccess, &writes);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) &src, (QBDI::rword) &dst});
+    bool ran = vm->run((QBDI::rword) stackMixingWrite, (QBDI::rword) FAKE_RET_ADDR);
+
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(src, dst);
+    ASSERT_EQ(src, QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    ASSERT_EQ(1u, writes);
+}
+
 #if defined(QBDI_ARCH_X86_64)
 TEST_F(MemoryAccessTest, ReadWriteRange) {
 #else
@@ -572,6 +669,42 @@ TEST_F(MemoryAccessTest, DISABLED_ReadWriteRange) {
     ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
 }
 
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(MemoryAccessTest, RangeFilter) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_RangeFilter) {
+#endif
+    // The watched window is far from both ends of the buffer
+    std::vector<uint32_t> buffer(1024, 0);
+    volatile uint32_t* window = buffer.data() + 512;
+    const size_t window_size = 10;
+    size_t accesses = 0;
+    vm->addMemRangeCB((QBDI::rword) window, (QBDI::rword) (window + window_size), QBDI::MEMORY_READ_WRITE, countAccess, &accesses);
+
+    // The accesses outside of the window miss the filter and stay in the JIT code
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer.data(), (QBDI::rword) window_size});
+    bool ran = vm->run((QBDI::rword) arrayRead32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer.data(), (QBDI::rword) window_size});
+    ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(0u, accesses);
+    ASSERT_EQ(0u, vm->getCacheStatistics().hostCalls);
+
+    // The accesses inside of the window go through the gates to the callback
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) window, (QBDI::rword) window_size});
+    ran = vm->run((QBDI::rword) arrayRead32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(window_size, accesses);
+    ASSERT_LE(window_size, vm->getCacheStatistics().hostCalls);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) window, (QBDI::rword) window_size});
+    ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    // Each element is written once, the previous elements are also read
+    ASSERT_LE(2 * window_size, accesses);
+}
+
 #if defined(QBDI_ARCH_X86_64)
 TEST_F(MemoryAccessTest, MemorySnooping) {
 #else
@@ -620,3 +753,145 @@ TEST_F(MemoryAccessTest, DISABLED_MemorySnooping) {
     ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
     ASSERT_EQ(original, ret);
 }
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(MemoryAccessTest, Write32List) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_Write32List) {
+#endif
+    const size_t buffer_size = 10;
+    uint32_t buffer[buffer_size];
+    TestInfo info = {(void*)buffer, sizeof(buffer), 0};
+
+    vm->addMemAccessListCB(QBDI::MEMORY_WRITE, checkListWrite32, &info);
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) arrayWrite32(buffer, buffer_size));
+    ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
+}
+
+struct SelfDeleteInfo {
+    uint32_t id;
+    size_t   count;
+};
+
+QBDI::VMAction deleteListSelf(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState,
+                              const QBDI::MemoryAccess* accesses, size_t count, void* data) {
+    SelfDeleteInfo* info = (SelfDeleteInfo*) data;
+    info->count++;
+    vm->deleteInstrumentation(info->id);
+    return QBDI::VMAction::CONTINUE;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(MemoryAccessTest, DeleteListSelf) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_DeleteListSelf) {
+#endif
+    const size_t buffer_size = 10;
+    uint32_t buffer[buffer_size];
+    SelfDeleteInfo info = {0, 0};
+
+    // The translated code keeps running until the flush is committed and still reaches the gate
+    info.id = vm->addMemAccessListCB(QBDI::MEMORY_WRITE, deleteListSelf, &info);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_LE(1u, info.count);
+    size_t count = info.count;
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(count, info.count);
+}
+
+#if defined(QBDI_ARCH_X86_64) && defined(QBDI_OS_LINUX)
+TEST_F(MemoryAccessTest, PageWatchRange) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_PageWatchRange) {
+#endif
+    const size_t buffer_size = 64;
+    uint32_t* buffer = (uint32_t*) QBDI::alignedAlloc(4096, 4096);
+    size_t writes = 0, reads = 0;
+    vm->setOptions(QBDI::OPT_PAGE_WATCH);
+
+    // The other accesses to the watched page are single stepped without calling the callback
+    uint32_t cb = vm->addMemRangeCB((QBDI::rword) (buffer + 8), (QBDI::rword) (buffer + 16), QBDI::MEMORY_WRITE, countAccess, &writes);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(8u, writes);
+    vm->deleteInstrumentation(cb);
+    ASSERT_EQ(ret, (QBDI::rword) arrayWrite32(buffer, buffer_size));
+
+    cb = vm->addMemRangeCB((QBDI::rword) (buffer + 8), (QBDI::rword) (buffer + 16), QBDI::MEMORY_READ, countAccess, &reads);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    ran = vm->run((QBDI::rword) arrayRead32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(8u, reads);
+    vm->deleteInstrumentation(cb);
+    ASSERT_EQ(ret, (QBDI::rword) arrayRead32(buffer, buffer_size));
+
+    QBDI::alignedFree(buffer);
+}
+
+#if defined(QBDI_ARCH_X86_64) && defined(QBDI_OS_LINUX)
+TEST_F(MemoryAccessTest, PageWatchReadModifyWrite) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_PageWatchReadModifyWrite) {
+#endif
+    uint32_t* buffer = (uint32_t*) QBDI::alignedAlloc(4096, 4096);
+    buffer[0] = 0;
+    ObservedValues info = {buffer, {}};
+    vm->setOptions(QBDI::OPT_PAGE_WATCH);
+
+    // The read value instrumentation faults before the instruction, the write callback must still
+    // follow the store of the instruction itself
+    vm->recordMemoryAccess(QBDI::MEMORY_READ_WRITE);
+    uint32_t cb = vm->addMemRangeCB((QBDI::rword) buffer, (QBDI::rword) (buffer + 1), QBDI::MEMORY_READ_WRITE, observeValue, &info);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer});
+    bool ran = vm->run((QBDI::rword) incrementInPlace, (QBDI::rword) FAKE_RET_ADDR);
+    vm->deleteInstrumentation(cb);
+
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(1u, buffer[0]);
+    ASSERT_LE(2u, info.observed.size());
+    ASSERT_EQ(0u, info.observed[0]);
+    ASSERT_EQ(1u, info.observed[1]);
+    QBDI::alignedFree(buffer);
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(MemoryAccessTest, MemTrace) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_MemTrace) {
+#endif
+    const size_t buffer_size = 64;
+    uint32_t buffer[buffer_size];
+    TraceInfo info = {QBDI::Range<QBDI::rword>((QBDI::rword) buffer, (QBDI::rword) (buffer + buffer_size)), 0, 0, 0};
+
+    // A small buffer forces several flushes during the run
+    ASSERT_TRUE(vm->setMemTrace(QBDI::MEMORY_WRITE, traceWrite32, &info, 16));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) arrayWrite32(buffer, buffer_size));
+    ASSERT_EQ(buffer_size, info.matches);
+    ASSERT_LE(buffer_size, info.records);
+    ASSERT_LE(buffer_size / 16, info.flushes);
+
+    // A disabled trace records nothing
+    ASSERT_TRUE(vm->setMemTrace(QBDI::MEMORY_WRITE, nullptr, nullptr));
+    size_t records = info.records;
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    ran = vm->run((QBDI::rword) arrayWrite32, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(records, info.records);
+}
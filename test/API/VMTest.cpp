@@ -16,6 +16,8 @@
  * limitations under the License.
  */
 #include <algorithm>
+#include <map>
+#include <string.h>
 #include <gtest/gtest.h>
 #include "VMTest.h"
 
@@ -269,6 +271,42 @@ TEST_F(VMTest, Breakpoint) {
 }
 
 
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, InlineCounter) {
+#else
+TEST_F(VMTest, DISABLED_InlineCounter) {
+#endif
+    uint32_t counter = 0;
+    QBDI::rword retval = 0;
+    QBDI::rword start = (QBDI::rword) dummyFun0;
+    QBDI::rword end = start + 16;
+    // The inline counters count the same executions as the callbacks
+    uint32_t addrCounter = vm->addInlineAddrCounter(start);
+    uint32_t rangeCounter = vm->addInlineCounter(start, end);
+    ASSERT_NE(addrCounter, QBDI::VMError::INVALID_EVENTID);
+    ASSERT_NE(rangeCounter, QBDI::VMError::INVALID_EVENTID);
+    vm->addCodeRangeCB(start, end, QBDI::InstPosition::PREINST, countInstruction, &counter);
+    vm->call(&retval, (QBDI::rword) dummyFun0);
+    vm->call(&retval, (QBDI::rword) dummyFun0);
+    ASSERT_EQ(retval, (QBDI::rword) 42);
+
+    uint32_t ids[] = {addrCounter, rangeCounter};
+    uint64_t values[2];
+    vm->getInlineCounters(ids, values, 2);
+    ASSERT_EQ(2u, values[0]);
+    ASSERT_EQ((uint64_t) counter, values[1]);
+    ASSERT_EQ(2u, vm->getInlineCounter(addrCounter));
+
+    // Deleted counters are released, the others keep counting
+    vm->deleteInstrumentation(addrCounter);
+    vm->call(&retval, (QBDI::rword) dummyFun0);
+    ASSERT_EQ(0u, vm->getInlineCounter(addrCounter));
+    ASSERT_EQ((uint64_t) counter, vm->getInlineCounter(rangeCounter));
+    vm->resetInlineCounters();
+    ASSERT_EQ(0u, vm->getInlineCounter(rangeCounter));
+}
+
+
 TEST_F(VMTest, InstCallback) {
     QBDI::rword info[2] = {42, 0};
     QBDI::simulateCall(state, FAKE_RET_ADDR, {info[0]});
@@ -593,3 +631,512 @@ TEST_F(VMTest, DelayedCacheFlush) {
     ASSERT_EQ(count, info.count);
 }
 
+
+QBDI_NOINLINE QBDI::rword loopFun(QBDI::rword n) {
+    QBDI::rword volatile res = 0;
+    for(QBDI::rword i = 0; i < n; i++) {
+        res = res + (i ^ (res >> 3));
+    }
+    return res;
+}
+
+QBDI::VMAction countEvent(QBDI::VMInstanceRef vm, const QBDI::VMState *vmState, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    *((uint32_t*)data) += 1;
+    return QBDI::VMAction::CONTINUE;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, DirectChaining) {
+#else
+TEST_F(VMTest, DISABLED_DirectChaining) {
+#endif
+    uint32_t seqCount1 = 0, seqCount2 = 0;
+    uint32_t instCount1 = 0, instCount2 = 0;
+
+    // Reference execution, every sequence is executed from the VM
+    uint32_t id = vm->addVMEventCB(QBDI::VMEvent::SEQUENCE_ENTRY, countEvent, &seqCount1);
+    ASSERT_NE(id, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    vm->deleteInstrumentation(id);
+    ASSERT_LE(100u, seqCount1);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(seqCount1, vm->getCacheStatistics().dispatches);
+
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING);
+    ASSERT_EQ(vm->getOptions(), QBDI::OPT_DIRECT_CHAINING);
+
+    // Sequence events disable the chaining and should all be signaled
+    id = vm->addVMEventCB(QBDI::VMEvent::SEQUENCE_ENTRY, countEvent, &seqCount2);
+    ASSERT_NE(id, QBDI::INVALID_EVENTID);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_EQ(seqCount1, seqCount2);
+    ASSERT_EQ(seqCount2, vm->getCacheStatistics().dispatches);
+    vm->deleteInstrumentation(id);
+
+    // Chained execution, the loop runs without going back to the VM once its exits are linked
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_GT(seqCount1 / 10, vm->getCacheStatistics().dispatches);
+
+    // Instruction callbacks keep the chaining and are called as often as without it
+    id = vm->addCodeCB(QBDI::InstPosition::POSTINST, countInstruction, &instCount1);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_GT(seqCount1, vm->getCacheStatistics().dispatches);
+    vm->deleteInstrumentation(id);
+
+    vm->setOptions(QBDI::NO_OPT);
+    id = vm->addCodeCB(QBDI::InstPosition::POSTINST, countInstruction, &instCount2);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_EQ(instCount1, instCount2);
+    vm->deleteInstrumentation(id);
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, CoverageMap) {
+#else
+TEST_F(VMTest, DISABLED_CoverageMap) {
+#endif
+    std::vector<uint8_t> map1(65536, 0), map2(65536, 0);
+
+    ASSERT_FALSE(vm->setCoverageMap(map1.data(), 1000));
+    ASSERT_TRUE(vm->setCoverageMap(map1.data(), map1.size()));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_NE(std::count(map1.begin(), map1.end(), 0), (std::ptrdiff_t) map1.size());
+
+    // Chained sequences and traces must see the same edges
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING | QBDI::OPT_HOT_TRACES);
+    ASSERT_TRUE(vm->setCoverageMap(map2.data(), map2.size()));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_TRUE(map1 == map2);
+
+    // Disabled coverage leaves the map untouched
+    ASSERT_TRUE(vm->setCoverageMap(nullptr, 0));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_TRUE(map1 == map2);
+}
+
+QBDI::VMAction recordBlockEntry(QBDI::VMInstanceRef vm, const QBDI::VMState *vmState, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    ((std::vector<QBDI::rword>*) data)->push_back(vmState->basicBlockStart);
+    return QBDI::VMAction::CONTINUE;
+}
+
+void recordBlockTrace(QBDI::VMInstanceRef vm, const QBDI::rword* blocks, size_t count, void* data) {
+    std::vector<QBDI::rword>* trace = (std::vector<QBDI::rword>*) data;
+    trace->insert(trace->end(), blocks, blocks + count);
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, BlockTrace) {
+#else
+TEST_F(VMTest, DISABLED_BlockTrace) {
+#endif
+    std::vector<QBDI::rword> events, trace1, trace2;
+
+    // A small buffer forces several flushes, the trace must match the basic block events
+    ASSERT_TRUE(vm->setBlockTrace(recordBlockTrace, &trace1, 7));
+    uint32_t id = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, recordBlockEntry, &events);
+    ASSERT_NE(id, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    vm->deleteInstrumentation(id);
+    ASSERT_LT(100u, trace1.size());
+    ASSERT_EQ((QBDI::rword) loopFun, trace1.front());
+    ASSERT_TRUE(events == trace1);
+
+    // Chained sequences and traces must record the same basic blocks
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING | QBDI::OPT_HOT_TRACES);
+    ASSERT_TRUE(vm->setBlockTrace(recordBlockTrace, &trace2));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    ASSERT_TRUE(trace1 == trace2);
+
+    // A disabled trace records nothing
+    ASSERT_TRUE(vm->setBlockTrace(nullptr, nullptr));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_TRUE(trace1 == trace2);
+}
+
+QBDI_NOINLINE QBDI::rword indirectAdd(QBDI::rword a, QBDI::rword b) {
+    return a + b;
+}
+
+QBDI_NOINLINE QBDI::rword indirectXor(QBDI::rword a, QBDI::rword b) {
+    return a ^ b;
+}
+
+QBDI_NOINLINE QBDI::rword indirectFun(QBDI::rword n) {
+    QBDI::rword (* volatile ops[2])(QBDI::rword, QBDI::rword) = {indirectAdd, indirectXor};
+    QBDI::rword res = 0;
+    for(QBDI::rword i = 0; i < n; i++) {
+        res = ops[i % 2](res, i);
+    }
+    return res;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, IndirectBranchCache) {
+#else
+TEST_F(VMTest, DISABLED_IndirectBranchCache) {
+#endif
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING);
+    vm->setCacheStatistics(true);
+
+    // The first execution fills the caches with the targets of the indirect calls
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) indirectFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), indirectFun(100));
+    QBDI::CacheStatistics statistics = vm->getCacheStatistics();
+    ASSERT_LT(0u, statistics.indirectFills);
+    ASSERT_GT(100u, statistics.dispatches);
+
+    // Then the 100 indirect calls are all cache hits
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) indirectFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), indirectFun(100));
+    statistics = vm->getCacheStatistics();
+    ASSERT_EQ(0u, statistics.indirectFills);
+    ASSERT_GT(10u, statistics.dispatches);
+
+    // Unlinked by the sequence events, every indirect call goes back to the VM
+    uint32_t seqCount = 0;
+    uint32_t id = vm->addVMEventCB(QBDI::VMEvent::SEQUENCE_ENTRY, countEvent, &seqCount);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) indirectFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), indirectFun(100));
+    statistics = vm->getCacheStatistics();
+    ASSERT_EQ(0u, statistics.indirectFills);
+    ASSERT_LT(100u, statistics.dispatches);
+    vm->deleteInstrumentation(id);
+}
+
+QBDI_NOINLINE QBDI::rword recursiveFun(QBDI::rword n) {
+    if(n < 2) {
+        return n;
+    }
+    return recursiveFun(n - 1) + recursiveFun(n - 2);
+}
+
+// The return of indirectAdd has more targets than an indirect branch cache has entries, cycling
+// through them such that only the shadow return stack can predict them
+QBDI_NOINLINE QBDI::rword returnSitesFun(QBDI::rword n) {
+    QBDI::rword res = 0;
+    for(QBDI::rword i = 0; i < n; i++) {
+        res = indirectAdd(res, 1);
+        res = indirectAdd(res, 2);
+        res = indirectAdd(res, 3);
+        res = indirectAdd(res, 4);
+        res = indirectAdd(res, 5);
+        res = indirectAdd(res, 6);
+        res = indirectAdd(res, 7);
+        res = indirectAdd(res, 8);
+    }
+    return res;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, ReturnStack) {
+#else
+TEST_F(VMTest, DISABLED_ReturnStack) {
+#endif
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING);
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {50});
+    bool ran = vm->run((QBDI::rword) returnSitesFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), returnSitesFun(50));
+
+    // The 400 returns are predicted: none of them misses to the VM and refills the cache
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {50});
+    ran = vm->run((QBDI::rword) returnSitesFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), returnSitesFun(50));
+    QBDI::CacheStatistics statistics = vm->getCacheStatistics();
+    ASSERT_EQ(0u, statistics.indirectFills);
+    ASSERT_GT(10u, statistics.dispatches);
+
+    // Recursive calls return to both of their call sites
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {20});
+    ran = vm->run((QBDI::rword) recursiveFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), recursiveFun(20));
+}
+
+// The common path of the loop spans several basic blocks, the call making the rare one
+QBDI_NOINLINE QBDI::rword branchFun(QBDI::rword n) {
+    QBDI::rword volatile res = 0;
+    for(QBDI::rword i = 0; i < n; i++) {
+        if(i % 16 == 0) {
+            res = indirectXor(res, i);
+        }
+        else {
+            res = res + i;
+        }
+    }
+    return res;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, HotTraces) {
+#else
+TEST_F(VMTest, DISABLED_HotTraces) {
+#endif
+    // Reference execution
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    bool ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+    uint64_t dispatches = vm->getCacheStatistics().dispatches;
+    ASSERT_EQ(0u, vm->getCacheStatistics().traces);
+
+    // The loop gets hot and its common path is retranslated as a single trace
+    vm->setOptions(QBDI::OPT_HOT_TRACES);
+    ASSERT_EQ(vm->getOptions(), QBDI::OPT_HOT_TRACES);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+    QBDI::CacheStatistics statistics = vm->getCacheStatistics();
+    ASSERT_LT(0u, statistics.traces);
+    ASSERT_GT(dispatches, statistics.dispatches);
+
+    // The traces are kept, a hot sequence is only retranslated once
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+    ASSERT_EQ(0u, vm->getCacheStatistics().traces);
+    ASSERT_GT(dispatches, vm->getCacheStatistics().dispatches);
+
+    // Traces and direct chaining together
+    vm->setOptions(QBDI::OPT_HOT_TRACES | QBDI::OPT_DIRECT_CHAINING);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {15});
+    ran = vm->run((QBDI::rword) recursiveFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), recursiveFun(15));
+}
+
+QBDI::VMAction countBasicBlock(QBDI::VMInstanceRef vm, const QBDI::VMState *vmState, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    (*((std::map<QBDI::rword, uint32_t>*) data))[vmState->basicBlockStart] += 1;
+    return QBDI::VMAction::CONTINUE;
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, HotTraceStop) {
+#else
+TEST_F(VMTest, DISABLED_HotTraceStop) {
+#endif
+    // The basic blocks of the loop are the ones executed on most of its iterations
+    std::map<QBDI::rword, uint32_t> bbCount;
+    uint32_t id = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &bbCount);
+    ASSERT_NE(id, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    bool ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+    vm->deleteInstrumentation(id);
+    std::vector<QBDI::rword> loopBlocks;
+    for(const std::pair<const QBDI::rword, uint32_t>& entry : bbCount) {
+        if(entry.second >= 900) {
+            loopBlocks.push_back(entry.first);
+        }
+    }
+    ASSERT_LT(1u, loopBlocks.size());
+
+    // The loop gets hot and is retranslated as traces
+    vm->setOptions(QBDI::OPT_HOT_TRACES);
+    vm->setCacheStatistics(true);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+    ASSERT_LT(0u, vm->getCacheStatistics().traces);
+
+    // Any basic block of the loop stops the run, even when it was inside a trace
+    QBDI::GPRState entryState = *state;
+    for(QBDI::rword stop : loopBlocks) {
+        QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+        ran = vm->run((QBDI::rword) branchFun, stop);
+        ASSERT_TRUE(ran);
+        ASSERT_EQ(stop, QBDI_GPR_GET(state, QBDI::REG_PC));
+        vm->setGPRState(&entryState);
+    }
+
+    // The loop gets hot again and runs to its end
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1000});
+    ran = vm->run((QBDI::rword) branchFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), branchFun(1000));
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, InlineBBCounters) {
+#else
+TEST_F(VMTest, DISABLED_InlineBBCounters) {
+#endif
+    // The basic block counters count the same executions as the basic block events
+    std::map<QBDI::rword, uint32_t> bbCount;
+    ASSERT_TRUE(vm->setInlineBBCounters(true));
+    uint32_t id = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &bbCount);
+    ASSERT_NE(id, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    vm->deleteInstrumentation(id);
+    ASSERT_EQ(1u, vm->getInlineBBCounter((QBDI::rword) loopFun));
+    std::vector<QBDI::rword> addresses(bbCount.size());
+    std::vector<uint64_t> values(bbCount.size());
+    ASSERT_EQ(bbCount.size(), vm->getInlineBBCounters(addresses.data(), values.data(), bbCount.size()));
+    size_t i = 0;
+    for(const std::pair<const QBDI::rword, uint32_t>& entry : bbCount) {
+        ASSERT_EQ(entry.first, addresses[i]);
+        ASSERT_EQ((uint64_t) entry.second, values[i]);
+        ASSERT_EQ((uint64_t) entry.second, vm->getInlineBBCounter(entry.first));
+        i++;
+    }
+
+    // Chained sequences and traces go through the counters too
+    vm->setOptions(QBDI::OPT_DIRECT_CHAINING | QBDI::OPT_HOT_TRACES);
+    vm->resetInlineCounters();
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    for(const std::pair<const QBDI::rword, uint32_t>& entry : bbCount) {
+        ASSERT_EQ((uint64_t) entry.second, vm->getInlineBBCounter(entry.first));
+    }
+
+    // Disabled counters keep their value
+    ASSERT_TRUE(vm->setInlineBBCounters(false));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    for(const std::pair<const QBDI::rword, uint32_t>& entry : bbCount) {
+        ASSERT_EQ((uint64_t) entry.second, vm->getInlineBBCounter(entry.first));
+    }
+}
+
+QBDI_NOINLINE QBDI::rword floatFun(QBDI::rword n) {
+    volatile double res = 1.0;
+    for(QBDI::rword i = 0; i < n; i++) {
+        res = res * 1.5 + (double) i;
+    }
+    return (QBDI::rword) res;
+}
+
+TEST_F(VMTest, LazyFPR) {
+    // Integer only code runs without switching the FPR state
+    vm->setOptions(QBDI::OPT_LAZY_FPR);
+    ASSERT_EQ(vm->getOptions(), QBDI::OPT_LAZY_FPR);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+
+    // Floating point code still gets its own FPR state
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {20});
+    ran = vm->run((QBDI::rword) floatFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), floatFun(20));
+
+    // Both together with direct chaining
+    vm->setOptions(QBDI::OPT_LAZY_FPR | QBDI::OPT_DIRECT_CHAINING);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {20});
+    ran = vm->run((QBDI::rword) floatFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), floatFun(20));
+}
+
+TEST_F(VMTest, HugePages) {
+    vm->setOptions(QBDI::OPT_HUGE_PAGES);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+
+    // The blocks freed by a cache flush are reused with the memory access shadows and chaining
+    vm->clearAllCache();
+    vm->setOptions(QBDI::OPT_HUGE_PAGES | QBDI::OPT_DIRECT_CHAINING);
+    vm->recordMemoryAccess(QBDI::MEMORY_READ_WRITE);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {20});
+    ran = vm->run((QBDI::rword) floatFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), floatFun(20));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+}
+
+#if defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, ExtendedFPRState) {
+    // Vector registers not touched by the guest come back unmodified from the context switches,
+    // whichever of the AVX and AVX-512 state components the host supports
+    QBDI::FPRState fprState = *vm->getFPRState();
+    memset(fprState.xmm15, 0x11, sizeof(fprState.xmm15));
+    memset(fprState.ymm15, 0x22, sizeof(fprState.ymm15));
+    memset(fprState.zmm15, 0x33, sizeof(fprState.zmm15));
+    memset(fprState.zmm31, 0x44, sizeof(fprState.zmm31));
+    vm->setFPRState(&fprState);
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {100});
+    bool ran = vm->run((QBDI::rword) loopFun, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(ran);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), loopFun(100));
+
+    QBDI::FPRState* result = vm->getFPRState();
+    ASSERT_EQ(memcmp(result->xmm15, fprState.xmm15, sizeof(fprState.xmm15)), 0);
+    ASSERT_EQ(memcmp(result->ymm15, fprState.ymm15, sizeof(fprState.ymm15)), 0);
+    ASSERT_EQ(memcmp(result->zmm15, fprState.zmm15, sizeof(fprState.zmm15)), 0);
+    ASSERT_EQ(memcmp(result->zmm31, fprState.zmm31, sizeof(fprState.zmm31)), 0);
+}
+#endif
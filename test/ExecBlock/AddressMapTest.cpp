@@ -0,0 +1,119 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "ExecBlock/ExecBlockManager.h"
+#include "Utility/AddressMap.h"
+
+
+TEST(AddressMapTest, InsertFind) {
+    QBDI::AddressMap<QBDI::rword> map;
+
+    for(QBDI::rword i = 0; i < 1000; i++) {
+        map[0x400000 + 3 * i] = i;
+    }
+    ASSERT_EQ(1000u, map.size());
+    for(QBDI::rword i = 0; i < 1000; i++) {
+        const QBDI::rword* value = map.find(0x400000 + 3 * i);
+        ASSERT_NE(nullptr, value);
+        ASSERT_EQ(i, *value);
+        ASSERT_EQ(0u, map.count(0x400000 + 3 * i + 1));
+    }
+    size_t iterated = 0;
+    for(const std::pair<QBDI::rword, QBDI::rword>& entry : map) {
+        ASSERT_EQ(0x400000 + 3 * entry.second, entry.first);
+        iterated++;
+    }
+    ASSERT_EQ(1000u, iterated);
+}
+
+TEST(AddressMapTest, Erase) {
+    QBDI::AddressMap<QBDI::rword> map;
+
+    for(QBDI::rword i = 0; i < 1000; i++) {
+        map[0x400000 + i] = i;
+    }
+    // Erasing every other entry must keep the remaining probe sequences valid
+    for(QBDI::rword i = 0; i < 1000; i += 2) {
+        ASSERT_EQ(1u, map.erase(0x400000 + i));
+    }
+    ASSERT_EQ(0u, map.erase(0x400000));
+    ASSERT_EQ(500u, map.size());
+    for(QBDI::rword i = 0; i < 1000; i++) {
+        ASSERT_EQ(i % 2, map.count(0x400000 + i));
+    }
+    map.clear();
+    ASSERT_TRUE(map.empty());
+    ASSERT_EQ(nullptr, map.find(0x400001));
+}
+
+template<typename Map>
+static double lookupLatency(const Map& map, const std::vector<QBDI::rword>& keys, QBDI::rword& checksum) {
+    static const size_t ROUNDS = 100;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(size_t round = 0; round < ROUNDS; round++) {
+        for(QBDI::rword key : keys) {
+            checksum += map.find(key) != map.end() ? 1 : 0;
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count() / (ROUNDS * keys.size());
+}
+
+template<typename T>
+static double lookupLatency(const QBDI::AddressMap<T>& map, const std::vector<QBDI::rword>& keys, QBDI::rword& checksum) {
+    static const size_t ROUNDS = 100;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(size_t round = 0; round < ROUNDS; round++) {
+        for(QBDI::rword key : keys) {
+            checksum += map.find(key) != nullptr ? 1 : 0;
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+    return elapsed.count() / (ROUNDS * keys.size());
+}
+
+// Compare the dispatch lookup latency of the sequence cache before (std::map) and after
+// (AddressMap) with a region sized cache. Timings are only reported, not asserted.
+TEST(AddressMapTest, LookupBenchmark) {
+    std::map<QBDI::rword, QBDI::SeqLoc> treeCache;
+    QBDI::AddressMap<QBDI::SeqLoc> flatCache;
+    std::vector<QBDI::rword> keys;
+    QBDI::rword treeHits = 0, flatHits = 0;
+
+    // Sequences of a few instructions spread over 64KB of code, looked up in a shuffled order
+    for(QBDI::rword i = 0; i < 4096; i++) {
+        QBDI::rword address = 0x400000 + 16 * i + (i % 7);
+        treeCache[address] = QBDI::SeqLoc {0, (uint16_t) i, address, address + 16, address, address + 16};
+        flatCache[address] = treeCache[address];
+        keys.push_back(address);
+        keys.push_back(address + 1);
+    }
+    for(size_t i = keys.size() - 1; i > 0; i--) {
+        std::swap(keys[i], keys[(i * 2654435761u) % (i + 1)]);
+    }
+
+    double treeLatency = lookupLatency(treeCache, keys, treeHits);
+    double flatLatency = lookupLatency(flatCache, keys, flatHits);
+    ASSERT_EQ(treeHits, flatHits);
+    printf("[ BENCHMARK] sequenceCache lookup: std::map %.2f ns, AddressMap %.2f ns\n", treeLatency, flatLatency);
+}
@@ -42,6 +42,67 @@ TEST_F(ExecBlockManagerTest, ClearCache) {
     ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
 }
 
+TEST_F(ExecBlockManagerTest, FlushCommit) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    // Lookups twice such that the second one is answered by the front cache
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    execBlockManager.clearCache(QBDI::Range<QBDI::rword>(0x42424242, 0x42424243));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    execBlockManager.flushCommit();
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+}
+
+TEST_F(ExecBlockManagerTest, SequenceInvalidation) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    QBDI::Patch::Vec bb = getEmptyBB(0x42424243);
+    bb[0].append(QBDI::getTerminator(0x13371337));
+    execBlockManager.writeBasicBlock(bb);
+    QBDI::ExecBlock* block = execBlockManager.getProgrammedExecBlock(0x42424243);
+    ASSERT_NE(nullptr, block);
+    // Only the overlapping sequence is dropped, the rest of the region is kept
+    execBlockManager.clearCache(QBDI::Range<QBDI::rword>(0x42424243, 0x42424244));
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    execBlockManager.flushCommit();
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424243));
+    ASSERT_EQ(QBDI::NOT_FOUND, block->getSeqID((QBDI::rword) 0x42424243));
+    // The new translation replaces the dropped one
+    bb = getEmptyBB(0x42424243);
+    bb[0].append(QBDI::getTerminator(0x42424243));
+    execBlockManager.writeBasicBlock(bb);
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x42424243));
+    block->execute();
+    ASSERT_EQ((QBDI::rword) 0x42424243, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+}
+
+TEST_F(ExecBlockManagerTest, TraceProfileReset) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    QBDI::Patch::Vec bb = getEmptyBB(0x42424243);
+    bb[0].append(QBDI::getTerminator(0x13371337));
+    execBlockManager.writeBasicBlock(bb);
+    for(uint32_t i = 1; i < QBDI::HOT_TRACE_THRESHOLD; i++) {
+        ASSERT_FALSE(execBlockManager.profileSequence(0x42424243));
+    }
+    ASSERT_TRUE(execBlockManager.profileSequence(0x42424243));
+    ASSERT_FALSE(execBlockManager.profileSequence(0x42424243));
+    // The profile is dropped with the invalidated sequence and starts again with its new translation
+    execBlockManager.clearCache(QBDI::Range<QBDI::rword>(0x42424243, 0x42424244));
+    execBlockManager.flushCommit();
+    ASSERT_FALSE(execBlockManager.profileSequence(0x42424243));
+    execBlockManager.writeBasicBlock(bb);
+    for(uint32_t i = 1; i < QBDI::HOT_TRACE_THRESHOLD; i++) {
+        ASSERT_FALSE(execBlockManager.profileSequence(0x42424243));
+    }
+    ASSERT_TRUE(execBlockManager.profileSequence(0x42424243));
+}
+
 TEST_F(ExecBlockManagerTest, ExecBlockReuse) {
     QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
 
@@ -51,6 +112,58 @@ TEST_F(ExecBlockManagerTest, ExecBlockReuse) {
               execBlockManager.getProgrammedExecBlock(0x42424243));
 }
 
+TEST_F(ExecBlockManagerTest, ExecBlockPool) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    QBDI::Patch::Vec bb = getEmptyBB(0x42424242);
+    bb[0].append(QBDI::getTerminator(0x42424242));
+    execBlockManager.writeBasicBlock(bb);
+    QBDI::ExecBlock* block = execBlockManager.getProgrammedExecBlock(0x42424242);
+    ASSERT_NE(nullptr, block);
+    execBlockManager.clearCache();
+    // The erased block is reset and reused for the next region
+    bb = getEmptyBB(0x13371337);
+    bb[0].append(QBDI::getTerminator(0x13371337));
+    execBlockManager.writeBasicBlock(bb);
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x13371337));
+    ASSERT_EQ((uint16_t) 0, block->getSeqID((QBDI::rword) 0x13371337));
+    ASSERT_EQ(QBDI::NOT_FOUND, block->getSeqID((QBDI::rword) 0x42424242));
+    block->execute();
+    ASSERT_EQ((QBDI::rword) 0x13371337, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+}
+
+TEST_F(ExecBlockManagerTest, CacheBudget) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x100000));
+    size_t regionSize = execBlockManager.getCacheSize();
+    ASSERT_LT(0u, regionSize);
+    execBlockManager.setCacheBudget(4 * regionSize);
+    // Distant basic blocks are written in distinct regions while the first one stays in use
+    for(QBDI::rword address = 0x200000; address < 0x1000000; address += 0x100000) {
+        execBlockManager.writeBasicBlock(getEmptyBB(address));
+        execBlockManager.flushCommit();
+        ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x100000));
+        ASSERT_GE(4 * regionSize, execBlockManager.getCacheSize());
+    }
+    // The least recently used regions were evicted
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0xF00000));
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x200000));
+}
+
+TEST_F(ExecBlockManagerTest, PendingFlushShift) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x200000));
+    execBlockManager.clearCache(QBDI::Range<QBDI::rword>(0x200000, 0x200001));
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    // A region inserted before the queued one doesn't change which region is flushed
+    execBlockManager.writeBasicBlock(getEmptyBB(0x100000));
+    execBlockManager.flushCommit();
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x100000));
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x200000));
+}
+
 TEST_F(ExecBlockManagerTest, ExecBlockRegions) {
     QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
 
@@ -128,3 +241,57 @@ TEST_F(ExecBlockManagerTest, Stresstest) {
         ASSERT_EQ(address - 1, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
     }
 }
+
+TEST_F(ExecBlockManagerTest, ExecArena) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly, nullptr, QBDI::OPT_HUGE_PAGES);
+
+    // Blocks of distinct regions are carved from the same arena and reused after a flush
+    for(int round = 0; round < 2; round++) {
+        for(QBDI::rword address = 0; address < 0x100000; address += 0x10000) {
+            QBDI::Patch::Vec terminator = getEmptyBB(address);
+            terminator[0].append(QBDI::getTerminator(address));
+            execBlockManager.writeBasicBlock(terminator);
+        }
+        const QBDI::ExecArena* arena = execBlockManager.getProgrammedExecBlock(0)->getArena();
+#if defined(QBDI_ARCH_X86_64) && !defined(QBDI_OS_IOS)
+        ASSERT_NE(nullptr, arena);
+#endif
+        for(QBDI::rword address = 0; address < 0x100000; address += 0x10000) {
+            QBDI::ExecBlock *block = execBlockManager.getProgrammedExecBlock(address);
+            ASSERT_NE(nullptr, block);
+            ASSERT_EQ(arena, block->getArena());
+            block->execute();
+            ASSERT_EQ(address, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+        }
+        execBlockManager.clearCache();
+    }
+}
+
+TEST_F(ExecBlockManagerTest, DirectChaining) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly, nullptr, QBDI::OPT_DIRECT_CHAINING);
+    QBDI::ExecBlock *block = nullptr;
+    // Second basic block ends with a terminator, the first one is truncated before the second one
+    QBDI::Patch::Vec bb2 = getEmptyBB(0x42424243);
+    bb2[0].append(QBDI::getTerminator(0x13371337));
+    execBlockManager.writeBasicBlock(bb2);
+    QBDI::Patch::Vec bb1 = getEmptyBB(0x42424242);
+    bb1.push_back(bb2[0]);
+    execBlockManager.writeBasicBlock(bb1);
+    // Without chaining the execution returns at the end of the first sequence
+    block = execBlockManager.getProgrammedExecBlock(0x42424242);
+    ASSERT_NE(nullptr, block);
+    block->execute();
+    ASSERT_EQ((QBDI::rword) 0x42424243, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+    // With chaining the second sequence is directly executed
+    execBlockManager.setChaining(true);
+    block = execBlockManager.getProgrammedExecBlock(0x42424242);
+    ASSERT_NE(nullptr, block);
+    block->execute();
+    ASSERT_EQ((QBDI::rword) 0x13371337, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+    // Unlinking restores the initial behavior
+    execBlockManager.setChaining(false);
+    block = execBlockManager.getProgrammedExecBlock(0x42424242);
+    ASSERT_NE(nullptr, block);
+    block->execute();
+    ASSERT_EQ((QBDI::rword) 0x42424243, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
+}
@@ -71,3 +71,71 @@ TEST_F(ExecBlockTest, BasicBlockOverload) {
     }
     printf("Maximum basic block per exec block: %d\n", i);
 }
+
+TEST_F(ExecBlockTest, InstructionLookup) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    // Write a sequence of three instructions
+    QBDI::Patch::Vec seq;
+    for(QBDI::rword i = 0; i < 3; i++) {
+        seq.push_back(QBDI::Patch());
+        seq[i].metadata.address = 0x42424242 + i;
+        seq[i].metadata.instSize = 1;
+    }
+    QBDI::SeqWriteResult res = execBlock.writeSequence(seq.begin(), seq.end(), QBDI::SeqType::Exit);
+    ASSERT_NE(QBDI::EXEC_BLOCK_FULL, res.seqID);
+    ASSERT_EQ(1u, execBlock.getInstID(0x42424243));
+    ASSERT_EQ(QBDI::NOT_FOUND, execBlock.getInstID(0x13371337));
+    ASSERT_EQ(res.seqID, execBlock.getSeqID((QBDI::rword) 0x42424242));
+    ASSERT_EQ(QBDI::NOT_FOUND, execBlock.getSeqID((QBDI::rword) 0x42424244));
+    // A split sequence is indexed by its new start address
+    uint16_t splitID = execBlock.splitSequence(2);
+    ASSERT_EQ(splitID, execBlock.getSeqID((QBDI::rword) 0x42424244));
+    ASSERT_EQ(res.seqID, execBlock.getSeqID((QBDI::rword) 0x42424242));
+    ASSERT_EQ(0u, execBlock.queryShadowBySeq(splitID).size());
+}
+
+TEST_F(ExecBlockTest, DualMapping) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+#if defined(QBDI_ARCH_X86_64) && defined(QBDI_OS_LINUX)
+    ASSERT_TRUE(execBlock.isDualMapped());
+#endif
+    // Writes interleaved with executions, the code block being written through its alias
+    for(QBDI::rword i = 0; i < 8; i++) {
+        QBDI::Patch::Vec terminator;
+        terminator.push_back(QBDI::Patch());
+        terminator[0].append(QBDI::getTerminator(0x42424242 + i));
+        QBDI::SeqWriteResult res = execBlock.writeSequence(terminator.begin(), terminator.end(), QBDI::SeqType::Exit);
+        ASSERT_NE(QBDI::EXEC_BLOCK_FULL, res.seqID);
+        for(uint16_t seqID = 0; seqID <= res.seqID; seqID++) {
+            execBlock.selectSeq(seqID);
+            execBlock.execute();
+            ASSERT_EQ((QBDI::rword) 0x42424242 + seqID, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+        }
+    }
+}
+
+TEST_F(ExecBlockTest, LazyFPR) {
+    // Without OPT_LAZY_FPR the FPR state is always switched
+    QBDI::ExecBlock eagerBlock(*assembly);
+    // A block which never touches the FPU doesn't switch the FPR state
+    QBDI::ExecBlock intBlock(*assembly, nullptr, QBDI::OPT_LAZY_FPR);
+    // As soon as a sequence of the block touches the FPU, the FPR state is switched
+    QBDI::ExecBlock fpuBlock(*assembly, nullptr, QBDI::OPT_LAZY_FPR);
+
+    for(QBDI::ExecBlock* execBlock : {&eagerBlock, &intBlock, &fpuBlock}) {
+        QBDI::Patch::Vec terminator;
+        terminator.push_back(QBDI::Patch());
+        terminator[0].append(QBDI::getTerminator(0x42424242));
+        terminator[0].setUseFPR(execBlock == &fpuBlock);
+        QBDI::SeqWriteResult res = execBlock->writeSequence(terminator.begin(), terminator.end(), QBDI::SeqType::Exit);
+        ASSERT_NE(QBDI::EXEC_BLOCK_FULL, res.seqID);
+        execBlock->selectSeq(res.seqID);
+        execBlock->execute();
+        ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock->getContext()->gprState, QBDI::REG_PC));
+    }
+    ASSERT_EQ(1u, eagerBlock.getContext()->hostState.fprSwitch);
+    ASSERT_EQ(0u, intBlock.getContext()->hostState.fprSwitch);
+    ASSERT_EQ(1u, fpuBlock.getContext()->hostState.fprSwitch);
+}
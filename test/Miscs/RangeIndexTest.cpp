@@ -0,0 +1,133 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "Utility/RangeIndex.h"
+
+using RangeEntries = std::vector<QBDI::RangeIndex<size_t>::Entry>;
+
+// Deterministic pseudo random ranges, a few of them overlapping, spread over the heap
+static RangeEntries getRanges(size_t count) {
+    RangeEntries entries;
+    QBDI::rword seed = 0x1337;
+    for(size_t i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        QBDI::rword start = 0x10000000 + ((seed >> 24) % (count * 64));
+        QBDI::rword size = 1 + ((seed >> 8) % 128);
+        entries.push_back(std::make_pair(QBDI::Range<QBDI::rword>(start, start + size), i));
+    }
+    return entries;
+}
+
+static std::vector<size_t> linearQuery(const RangeEntries& entries, QBDI::Range<QBDI::rword> range) {
+    std::vector<size_t> hits;
+    for(const RangeEntries::value_type& entry : entries) {
+        if(entry.first.overlaps(range)) {
+            hits.push_back(entry.second);
+        }
+    }
+    return hits;
+}
+
+static std::vector<size_t> indexQuery(const QBDI::RangeIndex<size_t>& index, QBDI::Range<QBDI::rword> range) {
+    std::vector<size_t> hits;
+    index.forEachOverlap(range, [&](size_t value) -> bool {
+        hits.push_back(value);
+        return true;
+    });
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+TEST(RangeIndexTest, Overlaps) {
+    QBDI::RangeIndex<size_t> index;
+    RangeEntries entries = getRanges(500);
+
+    index.build(entries);
+    ASSERT_EQ(500u, index.size());
+    for(QBDI::rword address = 0x10000000 - 16; address < 0x10000000 + 500 * 64 + 256; address += 3) {
+        for(QBDI::rword size : {1, 4, 8, 32}) {
+            QBDI::Range<QBDI::rword> access(address, address + size);
+            ASSERT_EQ(linearQuery(entries, access), indexQuery(index, access));
+        }
+    }
+}
+
+TEST(RangeIndexTest, Rebuild) {
+    QBDI::RangeIndex<size_t> index;
+    RangeEntries entries;
+
+    entries.push_back(std::make_pair(QBDI::Range<QBDI::rword>(0x1000, 0x2000), 0));
+    entries.push_back(std::make_pair(QBDI::Range<QBDI::rword>(0x1800, 0x1900), 1));
+    index.build(entries);
+    uint64_t generation = index.getGeneration();
+    ASSERT_EQ(std::vector<size_t>({0, 1}), indexQuery(index, QBDI::Range<QBDI::rword>(0x17fc, 0x1804)));
+    // Visiting stops as soon as the visitor returns false
+    size_t visited = 0;
+    index.forEachOverlap(QBDI::Range<QBDI::rword>(0x1800, 0x1804), [&](size_t) -> bool {
+        visited++;
+        return false;
+    });
+    ASSERT_EQ(1u, visited);
+
+    entries.erase(entries.begin());
+    index.build(entries);
+    ASSERT_NE(generation, index.getGeneration());
+    ASSERT_EQ(std::vector<size_t>(), indexQuery(index, QBDI::Range<QBDI::rword>(0x1000, 0x1004)));
+    ASSERT_EQ(std::vector<size_t>({1}), indexQuery(index, QBDI::Range<QBDI::rword>(0x18ff, 0x1900)));
+    index.build(RangeEntries());
+    ASSERT_TRUE(index.empty());
+    ASSERT_EQ(std::vector<size_t>(), indexQuery(index, QBDI::Range<QBDI::rword>(0x18ff, 0x1900)));
+}
+
+// Report how the dispatch cost of the range callbacks scales with the number of watched ranges,
+// before (linear scan) and after (RangeIndex). Timings are only reported, not asserted.
+TEST(RangeIndexTest, DispatchBenchmark) {
+    for(size_t count : {10, 100, 1000, 5000}) {
+        RangeEntries entries = getRanges(count);
+        QBDI::RangeIndex<size_t> index;
+        index.build(entries);
+
+        const size_t ACCESSES = 20000;
+        size_t linearHits = 0, indexHits = 0;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for(size_t i = 0; i < ACCESSES; i++) {
+            QBDI::rword address = 0x10000000 + (i * 2654435761u) % (count * 64);
+            QBDI::Range<QBDI::rword> access(address, address + 8);
+            for(const RangeEntries::value_type& entry : entries) {
+                linearHits += entry.first.overlaps(access) ? 1 : 0;
+            }
+        }
+        std::chrono::duration<double, std::nano> linear = std::chrono::high_resolution_clock::now() - start;
+        start = std::chrono::high_resolution_clock::now();
+        for(size_t i = 0; i < ACCESSES; i++) {
+            QBDI::rword address = 0x10000000 + (i * 2654435761u) % (count * 64);
+            index.forEachOverlap(QBDI::Range<QBDI::rword>(address, address + 8), [&](size_t) -> bool {
+                indexHits++;
+                return true;
+            });
+        }
+        std::chrono::duration<double, std::nano> indexed = std::chrono::high_resolution_clock::now() - start;
+        ASSERT_EQ(linearHits, indexHits);
+        printf("[ BENCHMARK] %zu ranges: linear scan %.2f ns, RangeIndex %.2f ns per access\n",
+               count, linear.count() / ACCESSES, indexed.count() / ACCESSES);
+    }
+}
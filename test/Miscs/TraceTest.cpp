@@ -0,0 +1,219 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "Trace.h"
+
+static const char* TRACE_PATH = "QBDITraceTest.trace";
+
+// Deterministic mix of the record types, the addresses moving like a real execution would
+static std::vector<QBDI::TraceRecord> getRecords(size_t count) {
+    std::vector<QBDI::TraceRecord> records;
+    QBDI::TraceRecord record;
+    QBDI::rword seed = 0x1337;
+
+    memset(&record.access, 0, sizeof(QBDI::MemoryAccess));
+    memset(&record.gprState, 0, sizeof(QBDI::GPRState));
+    record.type = QBDI::TRACE_MODULE;
+    record.module = QBDI::MemoryMap(QBDI::Range<QBDI::rword>(0x400000, 0x480000),
+                                    QBDI::PF_READ | QBDI::PF_EXEC, "/usr/bin/traced");
+    records.push_back(record);
+    record.address = 0x400000;
+    for(size_t i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        switch((seed >> 32) % 3) {
+            case 0:
+                record.type = QBDI::TRACE_BASIC_BLOCK;
+                record.address += (seed >> 40) % 64 - 24;
+                break;
+            case 1:
+                record.type = QBDI::TRACE_MEMORY_ACCESS;
+                record.access.instAddress = record.address + (seed >> 48) % 16;
+                record.access.accessAddress = 0x7f000000 + (seed >> 36) % 4096;
+                record.access.size = 1 << ((seed >> 20) % 4);
+                record.access.value = (QBDI::rword) seed;
+                record.access.type = (seed >> 24) & 1 ? QBDI::MEMORY_READ : QBDI::MEMORY_WRITE;
+                break;
+            default:
+                record.type = QBDI::TRACE_REGISTERS;
+                QBDI_GPR_SET(&record.gprState, (seed >> 40) % QBDI::NUM_GPR, (QBDI::rword) (seed >> 8));
+                QBDI_GPR_SET(&record.gprState, QBDI::REG_PC, record.address);
+                break;
+        }
+        records.push_back(record);
+    }
+    return records;
+}
+
+static void writeRecords(QBDI::TraceWriter& writer, const std::vector<QBDI::TraceRecord>& records) {
+    for(const QBDI::TraceRecord& record : records) {
+        switch(record.type) {
+            case QBDI::TRACE_BASIC_BLOCK:
+                writer.writeBasicBlock(record.address);
+                break;
+            case QBDI::TRACE_MEMORY_ACCESS:
+                writer.writeMemoryAccess(record.access);
+                break;
+            case QBDI::TRACE_REGISTERS:
+                writer.writeRegisters(&record.gprState);
+                break;
+            case QBDI::TRACE_MODULE:
+                writer.writeModule(record.module);
+                break;
+        }
+    }
+}
+
+static void expectRecord(const QBDI::TraceRecord& expected, const QBDI::TraceRecord& record) {
+    ASSERT_EQ(expected.type, record.type);
+    switch(expected.type) {
+        case QBDI::TRACE_BASIC_BLOCK:
+            ASSERT_EQ(expected.address, record.address);
+            break;
+        case QBDI::TRACE_MEMORY_ACCESS:
+            ASSERT_EQ(expected.access.instAddress, record.access.instAddress);
+            ASSERT_EQ(expected.access.accessAddress, record.access.accessAddress);
+            ASSERT_EQ(expected.access.value, record.access.value);
+            ASSERT_EQ(expected.access.size, record.access.size);
+            ASSERT_EQ(expected.access.type, record.access.type);
+            break;
+        case QBDI::TRACE_REGISTERS:
+            ASSERT_EQ(0, memcmp(&expected.gprState, &record.gprState, sizeof(QBDI::GPRState)));
+            break;
+        case QBDI::TRACE_MODULE:
+            ASSERT_EQ(expected.module.range, record.module.range);
+            ASSERT_EQ(expected.module.permission, record.module.permission);
+            ASSERT_EQ(expected.module.name, record.module.name);
+            break;
+    }
+}
+
+TEST(TraceTest, WriteRead) {
+    std::vector<QBDI::TraceRecord> records = getRecords(10000);
+    QBDI::TraceWriter writer(4096);
+    QBDI::TraceReader reader;
+
+    ASSERT_TRUE(writer.open(TRACE_PATH));
+    writeRecords(writer, records);
+    ASSERT_EQ(records.size(), writer.getRecordCount());
+    ASSERT_TRUE(writer.close());
+
+    ASSERT_TRUE(reader.open(TRACE_PATH));
+    ASSERT_EQ(records.size(), reader.getRecordCount());
+    ASSERT_LT(1u, reader.getChunkCount());
+    size_t i = 0;
+    for(QBDI::TraceReader::iterator it = reader.begin(); it != reader.end(); ++it, i++) {
+        ASSERT_GT(records.size(), i);
+        ASSERT_EQ(i, it.getPosition());
+        expectRecord(records[i], *it);
+    }
+    ASSERT_EQ(records.size(), i);
+
+    // Seeking only decodes the chunk of the record
+    for(uint64_t position : {0ull, 1ull, 4321ull, (unsigned long long) records.size() - 1}) {
+        QBDI::TraceReader::iterator it = reader.seek(position);
+        ASSERT_EQ(position, it.getPosition());
+        expectRecord(records[position], *it);
+    }
+    ASSERT_TRUE(reader.seek(records.size()) == reader.end());
+    reader.close();
+    remove(TRACE_PATH);
+}
+
+TEST(TraceTest, Unindexed) {
+    std::vector<QBDI::TraceRecord> records = getRecords(5000);
+    QBDI::TraceWriter writer(1024);
+    QBDI::TraceReader reader;
+
+    // A trace whose writer was not closed can be read up to the last written chunk
+    ASSERT_TRUE(writer.open(TRACE_PATH));
+    writeRecords(writer, records);
+    ASSERT_TRUE(writer.flush());
+
+    ASSERT_TRUE(reader.open(TRACE_PATH));
+    ASSERT_EQ(records.size(), reader.getRecordCount());
+    size_t i = 0;
+    for(const QBDI::TraceRecord& record : reader) {
+        expectRecord(records[i++], record);
+    }
+    ASSERT_EQ(records.size(), i);
+    expectRecord(records[2500], *reader.seek(2500));
+    reader.close();
+    writer.close();
+    remove(TRACE_PATH);
+}
+
+static void patchTrace(long offset, uint64_t value) {
+    FILE* file = fopen(TRACE_PATH, "r+b");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(0, fseek(file, offset, offset < 0 ? SEEK_END : SEEK_SET));
+    ASSERT_EQ(1u, fwrite(&value, sizeof(value), 1, file));
+    fclose(file);
+}
+
+static uint64_t readTrace(long offset) {
+    uint64_t value = 0;
+    FILE* file = fopen(TRACE_PATH, "rb");
+    if(file != nullptr) {
+        if(fseek(file, offset, offset < 0 ? SEEK_END : SEEK_SET) != 0 ||
+           fread(&value, sizeof(value), 1, file) != 1) {
+            value = 0;
+        }
+        fclose(file);
+    }
+    return value;
+}
+
+TEST(TraceTest, CorruptIndex) {
+    std::vector<QBDI::TraceRecord> records = getRecords(5000);
+    QBDI::TraceWriter writer(1024);
+    QBDI::TraceReader reader;
+
+    ASSERT_TRUE(writer.open(TRACE_PATH));
+    writeRecords(writer, records);
+    ASSERT_TRUE(writer.close());
+    // The footer is { indexOffset, chunkCount, recordCount, magic } at the end of the file
+    uint64_t indexOffset = readTrace(-32);
+    uint64_t chunkCount = readTrace(-24);
+    ASSERT_LT(2u, chunkCount);
+
+    // A chunk count overflowing the index size computation, then chunks out of record order,
+    // must both make the reader fall back to scanning the chunks
+    patchTrace(-24, chunkCount + (1ull << 60));
+    ASSERT_TRUE(reader.open(TRACE_PATH));
+    ASSERT_EQ(records.size(), reader.getRecordCount());
+    ASSERT_EQ(chunkCount, reader.getChunkCount());
+    reader.close();
+    patchTrace(-24, chunkCount);
+
+    patchTrace(indexOffset + 2 * 16 + 8, 0);
+    ASSERT_TRUE(reader.open(TRACE_PATH));
+    ASSERT_EQ(records.size(), reader.getRecordCount());
+    ASSERT_EQ(chunkCount, reader.getChunkCount());
+    size_t i = 0;
+    for(const QBDI::TraceRecord& record : reader) {
+        expectRecord(records[i++], record);
+    }
+    ASSERT_EQ(records.size(), i);
+    expectRecord(records[4000], *reader.seek(4000));
+    reader.close();
+    remove(TRACE_PATH);
+}